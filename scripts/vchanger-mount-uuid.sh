@@ -36,58 +36,66 @@ uuid=${1,,}
 #  or else empty if UUID not found in fstab
 #
 function check_fstab {
-  local uuid=${1,,}
-  cat /etc/fstab | grep "^UUID=" | while read lin; do
-    line=`echo $lin | sed -e "s/[[:space:]]\+/ /g"`
-    tmp=`echo $line | cut -s -d ' ' -f 1 | cut -s -d '=' -f 2`
-    fu=${tmp,,}
-    if [ "z$fu" == "z$uuid" ]; then
-      echo $line | cut -s -d ' ' -f 2
+  local uuid=${1,,} dev mp rest
+  while read -r dev mp rest; do
+    dev=${dev,,}
+    if [ "z$dev" == "zuuid=$uuid" ]; then
+      echo $mp
       return 0
     fi
-  done
+  done < /etc/fstab
+}
+
+#
+#  Return success if the autochanger configuration file in param 1
+#  defines a magazine having the UUID passed in param 2. The file is
+#  parsed by the shell so that no processes are spawned per line.
+#
+function conf_has_uuid {
+  local line
+  while IFS= read -r line || [ -n "$line" ]; do
+    line=${line//[[:space:]\"]/}
+    line=${line,,}
+    [ "${line:0:14}" == "magazine=uuid:" ] || continue
+    [ "z${line:14}" == "z$2" ] && return 0
+  done < "$1"
+  return 1
 }
 
 #  Search all autochanger configuration files for a magazine
-#  definition matching the UUID in parameter 1
-for cf in `ls -1 /etc/vchanger/*.conf` ; do
-  for tmp in `cat ${cf} | grep -v "^#" | tr -d " \t" | grep -i "^magazine="` ; do
-    tmp=`echo $tmp | grep -i "^magazine=uuid:"`
-    if [ -n "$tmp" ] ; then
-      tmp=`echo $tmp | cut -d ':' -f 2 | tr -d ' \t\r\n'`
-      tmp=${tmp,,}
-      if [ "z$uuid" == "z$tmp" ] ; then
-        # param 1 UUID matches a magazine filesystem
-        mdir=$(check_fstab $uuid)
-        if [ -n "$mdir" ]; then
-          # filesystem has UUID entry in fstab, so use it
-          if [ ! -d $mdir ]; then
-            mkdir -p $mdir &>/dev/null
-            [ -d $mdir ] || exit 0  # cannot create mountpoint dir
-            chmod 0750 $mdir
-          fi
-          mount $mdir
-          [ $? -eq 0 ] || exit 0
-          /usr/bin/vchanger $cf refresh
-          exit 0
-        fi
-        # Mount under configured MOUNT_DIR
-        if [ ! -d $MOUNT_DIR/$uuid ]; then
-          mkdir -p $MOUNT_DIR/$uuid &>/dev/null
-          [ -d $MOUNT_DIR/$uuid ] || exit 0  # cannot create mountpoint dir
-          chmod 0750 $MOUNT_DIR/$uuid
-        fi
-        echo checking dev
-        [ -e /dev/disk/by-uuid/$uuid ] || exit 0  # udev has no by-uuid symlinks
-        mount $MOUNT_OPTIONS /dev/disk/by-uuid/$uuid $MOUNT_DIR/$uuid &>/dev/null
-        if [ $? -eq 0 ] ; then
-		  # On successful mount, cause update slots to be issued in bconsole
-          /usr/bin/vchanger $cf refresh
-		fi
-        exit 0
+#  definition matching the UUID in parameter 1, then refresh every
+#  autochanger defining it with a single vchanger invocation
+for cf in /etc/vchanger/*.conf ; do
+  [ -f "$cf" ] || continue
+  if conf_has_uuid "$cf" "$uuid" ; then
+    # param 1 UUID matches a magazine filesystem
+    mdir=$(check_fstab $uuid)
+    if [ -n "$mdir" ]; then
+      # filesystem has UUID entry in fstab, so use it
+      if [ ! -d $mdir ]; then
+        mkdir -p $mdir &>/dev/null
+        [ -d $mdir ] || exit 0  # cannot create mountpoint dir
+        chmod 0750 $mdir
       fi
+      mount $mdir
+      [ $? -eq 0 ] || exit 0
+      /usr/bin/vchanger /etc/vchanger refresh UUID:$uuid
+      exit 0
+    fi
+    # Mount under configured MOUNT_DIR
+    if [ ! -d $MOUNT_DIR/$uuid ]; then
+      mkdir -p $MOUNT_DIR/$uuid &>/dev/null
+      [ -d $MOUNT_DIR/$uuid ] || exit 0  # cannot create mountpoint dir
+      chmod 0750 $MOUNT_DIR/$uuid
+    fi
+    echo checking dev
+    [ -e /dev/disk/by-uuid/$uuid ] || exit 0  # udev has no by-uuid symlinks
+    mount $MOUNT_OPTIONS /dev/disk/by-uuid/$uuid $MOUNT_DIR/$uuid &>/dev/null
+    if [ $? -eq 0 ] ; then
+      # On successful mount, cause update slots to be issued in bconsole
+      /usr/bin/vchanger /etc/vchanger refresh UUID:$uuid
     fi
-  done
+    exit 0
+  fi
 done
 exit 0
-            
\ No newline at end of file
@@ -50,6 +50,7 @@
 #include "loghandler.h"
 #include "mypopen.h"
 #include "vconf.h"
+#include "timing.h"
 #include "bconsole.h"
 
 
@@ -75,9 +76,14 @@ int issue_bconsole_command(const char *bcmd)
       cmd += conf.bconsole_config;
    }
    cmd += " -n -u 30";
+   /* Trace the round trip and the lifetime of the bconsole child */
+   TraceSpan round_trip("bconsole");
+   round_trip.SetArg("command", bcmd);
+   TraceSpan child_span("bconsole child");
    /* Start bconsole process */
    log.Debug("bconsole: running '%s'", bcmd);
    pid = mypopen_raw(cmd.c_str(), &fno_in, &fno_out, NULL);
+   child_span.SetArg("pid", (long)pid);
    if (pid < 0) {
       rc = errno;
       log.Error("bconsole: run failed errno=%d", rc);
@@ -161,6 +167,7 @@ int issue_bconsole_command(const char *bcmd)
 
    /* Wait for bconsole process to finish */
    pid = waitpid(pid, &rc, 0);
+   child_span.Stop();
    if (!WIFEXITED(rc)) {
       log.Error("bconsole: abnormal exit of bconsole process");
       return EPIPE;
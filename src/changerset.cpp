@@ -0,0 +1,167 @@
+/* changerset.cpp
+ *
+ *  This file is part of vchanger by Josh Fisher.
+ *
+ *  vchanger copyright (C) 2008-2015 Josh Fisher
+ *
+ *  vchanger is free software.
+ *  You may redistribute it and/or modify it under the terms of the
+ *  GNU General Public License version 2, as published by the Free
+ *  Software Foundation.
+ *
+ *  vchanger is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vchanger.  See the file "COPYING".  If not,
+ *  write to:  The Free Software Foundation, Inc.,
+ *             59 Temple Place - Suite 330,
+ *             Boston,  MA  02111-1307, USA.
+ *
+ *  Provides classes to run a command for the set of changers defined by the
+ *  config files in a directory
+ */
+
+#include "config.h"
+#include "compat_defs.h"
+#include <stdio.h>
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#include <algorithm>
+
+#include "tstring.h"
+#include "loghandler.h"
+#include "dirscan.h"
+#include "vconf.h"
+#include "uuidlookup.h"
+#define __CHANGERSET_SOURCE 1
+#include "changerset.h"
+
+/* Global cache of magazine mountpoints */
+MountpointCache mount_cache;
+
+
+/*=================================================
+ *  Class ChangerSet
+ *=================================================*/
+
+/*-------------------------------------------------
+ *  Method to load the changers defined by the '*.conf' files in directory
+ *  'dir', in order of file name. Config values are loaded from the files'
+ *  snapshots where possible. Files that cannot be read are skipped after
+ *  logging the error. On success returns zero, else returns errno.
+ *-------------------------------------------------*/
+int ChangerSet::Load(const char *dir)
+{
+   int rc;
+   size_t n, len;
+   DirScanner scan;
+   const char *name;
+   tStringArray files;
+   ChangerSetEntry entry;
+
+   changers.clear();
+   rc = scan.Open(dir);
+   if (rc) return rc;
+   while ((name = scan.NextFile()) != NULL) {
+      len = strlen(name);
+      if (len > 5 && strcmp(name + len - 5, ".conf") == 0) files.push_back(name);
+   }
+   scan.Close();
+   std::sort(files.begin(), files.end());
+   for (n = 0; n < files.size(); n++) {
+      VchangerConfig cf;
+      tFormat(entry.config_file, "%s%s%s", dir, DIR_DELIM, files[n].c_str());
+      if (!cf.ReadSnapshot(entry.config_file) && !cf.Read(entry.config_file)) {
+         log.Error("skipping config file %s", entry.config_file.c_str());
+         continue;
+      }
+      entry.storage_name = cf.storage_name;
+      entry.magazine = cf.magazine;
+      changers.push_back(entry);
+   }
+   return 0;
+}
+
+
+/*-------------------------------------------------
+ *  Method to find the changer whose storage resource name is 'storage_name'.
+ *  Returns the changer's index, or -1 if not found.
+ *-------------------------------------------------*/
+int ChangerSet::Find(const tString &storage_name) const
+{
+   size_t n;
+
+   for (n = 0; n < changers.size(); n++) {
+      if (changers[n].storage_name == storage_name) return (int)n;
+   }
+   return -1;
+}
+
+
+/*-------------------------------------------------
+ *  Method to determine if changer 'n' defines the magazine given by its
+ *  index or by its 'magazine' setting, ignoring case
+ *-------------------------------------------------*/
+bool ChangerSet::DefinesMagazine(size_t n, const tString &mag) const
+{
+   size_t m;
+   char *endp;
+   long bay;
+
+   bay = strtol(mag.c_str(), &endp, 10);
+   if (endp != mag.c_str() && *endp == 0) {
+      return bay >= 0 && bay < (long)changers[n].magazine.size();
+   }
+   for (m = 0; m < changers[n].magazine.size(); m++) {
+      if (tCaseCmp(changers[n].magazine[m], mag) == 0) return true;
+   }
+   return false;
+}
+
+
+/*=================================================
+ *  Class MountpointCache
+ *=================================================*/
+
+/*-------------------------------------------------
+ *  Method to look up and cache the mountpoint of the filesystem with
+ *  UUID 'uuid', unless already cached
+ *-------------------------------------------------*/
+void MountpointCache::Prefetch(const tString &uuid)
+{
+   char buf[4096];
+   int rc;
+
+   if (entries.find(uuid) != entries.end()) return;
+   rc = GetMountpointFromUUID(buf, sizeof(buf), uuid.c_str());
+   entries[uuid] = std::make_pair(rc, tString(rc ? "" : buf));
+}
+
+
+/*-------------------------------------------------
+ *  Method to get the mountpoint of the filesystem with UUID 'uuid', from
+ *  the cache if it was prefetched. Returns the GetMountpointFromUUID()
+ *  result code.
+ *-------------------------------------------------*/
+int MountpointCache::Lookup(const tString &uuid, tString &mountpoint)
+{
+   char buf[4096];
+   int rc;
+   std::map<tString, std::pair<int, tString> >::const_iterator p = entries.find(uuid);
+
+   if (p != entries.end()) {
+      mountpoint = p->second.second;
+      return p->second.first;
+   }
+   buf[0] = 0;
+   rc = GetMountpointFromUUID(buf, sizeof(buf), uuid.c_str());
+   mountpoint = buf;
+   return rc;
+}
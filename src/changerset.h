@@ -0,0 +1,81 @@
+/* changerset.h
+ *
+ *  This file is part of vchanger by Josh Fisher.
+ *
+ *  vchanger copyright (C) 2008-2015 Josh Fisher
+ *
+ *  vchanger is free software.
+ *  You may redistribute it and/or modify it under the terms of the
+ *  GNU General Public License version 2, as published by the Free
+ *  Software Foundation.
+ *
+ *  vchanger is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vchanger.  See the file "COPYING".  If not,
+ *  write to:  The Free Software Foundation, Inc.,
+ *             59 Temple Place - Suite 330,
+ *             Boston,  MA  02111-1307, USA.
+ */
+#ifndef _CHANGERSET_H_
+#define _CHANGERSET_H_ 1
+
+#include <vector>
+#include <map>
+#include "tstring.h"
+
+/* A changer defined by one of the config files of a changer set */
+class ChangerSetEntry
+{
+public:
+   tString config_file;
+   tString storage_name;
+   tStringArray magazine;
+};
+
+/*
+ *  Class holding the changers defined by the config files in a directory,
+ *  so that one invocation can run a command for several changers, or
+ *  select a changer by its storage resource name.
+ */
+class ChangerSet
+{
+public:
+   ChangerSet() {}
+   virtual ~ChangerSet() {}
+   int Load(const char *dir);
+   int Find(const tString &storage_name) const;
+   bool DefinesMagazine(size_t n, const tString &mag) const;
+   inline size_t size() const { return changers.size(); }
+   inline const ChangerSetEntry& operator[](size_t n) const { return changers[n]; }
+protected:
+   std::vector<ChangerSetEntry> changers;
+};
+
+/*
+ *  Class caching the mountpoints of magazines specified by UUID. The
+ *  mountpoints of the magazines of a changer set are looked up once, before
+ *  the worker processes running the command for each changer are started,
+ *  and are shared by the workers. Other lookups are not cached, as the
+ *  magazine may be mounted or unmounted at any time.
+ */
+class MountpointCache
+{
+public:
+   MountpointCache() {}
+   virtual ~MountpointCache() {}
+   void Prefetch(const tString &uuid);
+   int Lookup(const tString &uuid, tString &mountpoint);
+   inline void clear() { entries.clear(); }
+protected:
+   std::map<tString, std::pair<int, tString> > entries;
+};
+
+#ifndef __CHANGERSET_SOURCE
+extern MountpointCache mount_cache;
+#endif
+
+#endif /* _CHANGERSET_H_ */
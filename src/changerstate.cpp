@@ -56,7 +56,14 @@
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
 
+#include <algorithm>
 #include "compat/getline.h"
 #include "compat/readlink.h"
 #include "compat/symlink.h"
@@ -64,9 +71,18 @@
 #include "loghandler.h"
 #include "errhandler.h"
 #include "util.h"
+#include "dirscan.h"
+#include "timing.h"
 #define __CHANGERSTATE_SOURCE 1
 #include "changerstate.h"
-#include "uuidlookup.h"
+#include "changerset.h"
+
+#ifndef O_DIRECTORY
+#define O_DIRECTORY 0
+#endif
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
 
 ///////////////////////////////////////////////////
 //  Class MagazineSlot
@@ -76,7 +92,8 @@ MagazineSlot::MagazineSlot(const MagazineSlot &b)
 {
    mag_bay = b.mag_bay;
    mag_slot = b.mag_slot;
-   label = b.label;
+   label_pos = b.label_pos;
+   label_len = b.label_len;
 }
 
 MagazineSlot& MagazineSlot::operator=(const MagazineSlot &b)
@@ -84,25 +101,12 @@ MagazineSlot& MagazineSlot::operator=(const MagazineSlot &b)
    if (&b != this) {
       mag_bay = b.mag_bay;
       mag_slot = b.mag_slot;
-      label = b.label;
+      label_pos = b.label_pos;
+      label_len = b.label_len;
    }
    return *this;
 }
 
-bool MagazineSlot::operator==(const MagazineSlot &b)
-{
-   if (&b == this) return true;
-   if (label == b.label) return true;
-   return false;
-}
-
-bool MagazineSlot::operator!=(const MagazineSlot &b)
-{
-   if (&b == this) return false;
-   if (label != b.label) return true;
-   return false;
-}
-
 /*-------------------------------------------------
  *  Method to clear object values
  *-------------------------------------------------*/
@@ -110,10 +114,66 @@ void MagazineSlot::clear()
 {
    mag_bay = -1;
    mag_slot = -1;
-   label.clear();
+   label_pos = 0;
+   label_len = 0;
 }
 
 
+/*-------------------------------------------------
+ *  Function object ordering magazine slots by the labels they
+ *  reference in a magazine's label arena
+ *-------------------------------------------------*/
+class MagazineSlotLabelLess
+{
+public:
+   MagazineSlotLabelLess(const char *a) : arena(a) {}
+   inline bool operator()(const MagazineSlot &a, const MagazineSlot &b) const
+      { return strcmp(arena + a.label_pos, arena + b.label_pos) < 0; }
+protected:
+   const char *arena;
+};
+
+/*-------------------------------------------------
+ *  Function object ordering magazine slots by the labels they
+ *  reference in a magazine's label arena using natural order
+ *-------------------------------------------------*/
+class MagazineSlotNaturalLess
+{
+public:
+   MagazineSlotNaturalLess(const char *a) : arena(a) {}
+   inline bool operator()(const MagazineSlot &a, const MagazineSlot &b) const
+      { return tNaturalCmp(arena + a.label_pos, arena + b.label_pos) < 0; }
+protected:
+   const char *arena;
+};
+
+/* Entry of a magazine's saved slot map */
+class SlotMapEntry
+{
+public:
+   SlotMapEntry(size_t p = 0, int s = 0) : pos(p), slot(s) {}
+public:
+   size_t pos;    /* offset of label in slot map buffer */
+   int slot;
+};
+
+/*-------------------------------------------------
+ *  Function object ordering slot map entries by label, also
+ *  used to search the entries for a label
+ *-------------------------------------------------*/
+class SlotMapEntryLess
+{
+public:
+   SlotMapEntryLess(const char *a) : arena(a) {}
+   inline bool operator()(const SlotMapEntry &a, const SlotMapEntry &b) const
+      { return strcmp(arena + a.pos, arena + b.pos) < 0; }
+   inline bool operator()(const SlotMapEntry &a, const char *b) const
+      { return strcmp(arena + a.pos, b) < 0; }
+protected:
+   const char *arena;
+};
+
+
 
 ///////////////////////////////////////////////////
 //  Class MagazineState
@@ -129,6 +189,11 @@ MagazineState::MagazineState(const MagazineState &b)
    mag_dev = b.mag_dev;
    mountpoint = b.mountpoint;
    mslot = b.mslot;
+   labels = b.labels;
+   has_slot_map = b.has_slot_map;
+   slot_map_changed = b.slot_map_changed;
+   changed_slots = b.changed_slots;
+   scan_stamp = b.scan_stamp;
    verr = b.verr;
 }
 
@@ -143,6 +208,11 @@ MagazineState& MagazineState::operator=(const MagazineState &b)
       mag_dev = b.mag_dev;
       mountpoint = b.mountpoint;
       mslot = b.mslot;
+      labels = b.labels;
+      has_slot_map = b.has_slot_map;
+      slot_map_changed = b.slot_map_changed;
+      changed_slots = b.changed_slots;
+      scan_stamp = b.scan_stamp;
       verr = b.verr;
    }
    return *this;
@@ -155,6 +225,11 @@ void MagazineState::clear()
    start_slot = 0;
    mountpoint.clear();
    mslot.clear();
+   labels.clear();
+   has_slot_map = false;
+   slot_map_changed = false;
+   changed_slots.clear();
+   scan_stamp.clear();
    verr.clear();
 }
 
@@ -181,6 +256,7 @@ int MagazineState::save()
    /* Remove magazine state files for unmounted magazines */
    if (mountpoint.empty() || mslot.empty()) {
       unlink(sname);
+      if (!mountpoint.empty() && slot_map_changed) return SaveSlotMap();
       return 0;
    }
    /* Write state file for mounted magazine */
@@ -209,6 +285,7 @@ int MagazineState::save()
    fclose(FS);
    umask(old_mask);
    log.Notice("saved state of magazine %d", mag_bay);
+   if (slot_map_changed) return SaveSlotMap();
    return 0;
 }
 
@@ -350,96 +427,59 @@ int MagazineState::restore()
 int MagazineState::UpdateMagazineFormat()
 {
    FILE *fs;
-   DIR *dir;
-   struct dirent *de;
-   struct stat st;
+   DirScanner scan;
+   const char *name;
    tString str, fname, lname, vname;
+   tStringList drive_files, loaded_files;
+   tStringListIterator p;
    int drv;
 
+   /* Find driveN and loadedN files in a single pass over the directory */
+   if (scan.Open(mountpoint)) return -1;
+   while ((name = scan.NextFile()) != NULL) {
+      str = name;
+      if (str.find("drive") == 0) str.erase(0, 5);
+      else if (str.find("loaded") == 0) str.erase(0, 6);
+      else continue;
+      if (str.find_first_of("0123456789") == tString::npos) continue;
+      if (str.find_first_not_of("0123456789") != tString::npos) continue;
+      if (name[0] == 'd') drive_files.push_back(name);
+      else loaded_files.push_back(name);
+   }
+   scan.Close();
+
    /* Rename driveN files to their volume file name */
-   dir = opendir(mountpoint.c_str());
-   if (!dir) return -1;
-   de = readdir(dir);
-   while (de) {
-      /* Skip if not regular file */
-      tFormat(fname, "%s%s%s", mountpoint.c_str(), DIR_DELIM, de->d_name);
-      stat(fname.c_str(), &st);
-      if (!S_ISREG(st.st_mode)) {
-         de = readdir(dir);
+   for (p = drive_files.begin(); p != drive_files.end(); p++) {
+      drv = (int)strtol(p->c_str() + 5, NULL, 10);
+      tFormat(fname, "%s%s%s", mountpoint.c_str(), DIR_DELIM, p->c_str());
+      tFormat(lname, "%s%sloaded%d", mountpoint.c_str(), DIR_DELIM, drv);
+      fs = fopen(lname.c_str(), "r");
+      if (fs == NULL) {
+         verr.SetErrorWithErrno(errno, "failed to find loaded%d file when updating magazine %d", drv, mag_bay);
+         log.Error("ERROR! %s", verr.GetErrorMsg());
          continue;
       }
-      /* Skip index file */
-      if (tCaseCmp(de->d_name, "index") == 0) {
-         de = readdir(dir);
+      tGetLine(str, fs);
+      fclose(fs);
+      if (str.empty()) {
+         verr.SetError(-1, "loaded%d file empty when updating magazine %d", drv, mag_bay);
+         log.Error("ERROR! %s", verr.GetErrorMsg());
          continue;
       }
-      str = de->d_name;
-      if (str.find("drive") == 0) {
-         str.erase(0, 5);
-         if (str.find_first_of("0123456789") == tString::npos) {
-            de = readdir(dir);
-            continue;
-         }
-         if (str.find_first_not_of("0123456789") != tString::npos) {
-            de = readdir(dir);
-            continue;
-         }
-         drv = (int)strtol(str.c_str(), NULL, 10);
-         tFormat(lname, "%s%sloaded%d", mountpoint.c_str(), DIR_DELIM, drv);
-         fs = fopen(lname.c_str(), "r");
-         if (fs == NULL) {
-            verr.SetErrorWithErrno(errno, "failed to find loaded%d file when updating magazine %d", drv, mag_bay);
-            log.Error("ERROR! %s", verr.GetErrorMsg());
-            de = readdir(dir);
-            continue;
-         }
-         tGetLine(str, fs);
-         fclose(fs);
-         if (str.empty()) {
-            verr.SetError(-1, "loaded%d file empty when updating magazine %d", drv, mag_bay);
-            log.Error("ERROR! %s", verr.GetErrorMsg());
-            de = readdir(dir);
-            continue;
-         }
-         tStrip(tRemoveEOL(str));
-         tFormat(vname, "%s%s%s", mountpoint.c_str(), DIR_DELIM, str.c_str());
-         if (rename(fname.c_str(), vname.c_str())) {
-            verr.SetError(EINVAL, "unable to rename 'drive%d' on magazine %d",
-                           drv, mag_bay);
-            log.Error("ERROR! %s", verr.GetErrorMsg());
-         }
+      tStrip(tRemoveEOL(str));
+      tFormat(vname, "%s%s%s", mountpoint.c_str(), DIR_DELIM, str.c_str());
+      if (rename(fname.c_str(), vname.c_str())) {
+         verr.SetError(EINVAL, "unable to rename 'drive%d' on magazine %d",
+                        drv, mag_bay);
+         log.Error("ERROR! %s", verr.GetErrorMsg());
       }
-      de = readdir(dir);
    }
-   closedir(dir);
 
    /* Delete loadedN files */
-   dir = opendir(mountpoint.c_str());
-   de = readdir(dir);
-   while (de) {
-      str = de->d_name;
-      /* Skip if not regular file */
-      tFormat(fname, "%s%s%s", mountpoint.c_str(), DIR_DELIM, de->d_name);
-      stat(fname.c_str(), &st);
-      if (!S_ISREG(st.st_mode)) {
-         de = readdir(dir);
-         continue;
-      }
-      if (str.find("loaded") == 0) {
-         str.erase(0, 6);
-         if (str.find_first_of("0123456789") == tString::npos) {
-            de = readdir(dir);
-            continue;
-         }
-         if (str.find_first_not_of("0123456789") != tString::npos) {
-            de = readdir(dir);
-            continue;
-         }
-         unlink(fname.c_str());
-      }
-      de = readdir(dir);
+   for (p = loaded_files.begin(); p != loaded_files.end(); p++) {
+      tFormat(fname, "%s%s%s", mountpoint.c_str(), DIR_DELIM, p->c_str());
+      unlink(fname.c_str());
    }
-   closedir(dir);
 
    /* Delete index file */
    tFormat(fname, "%s%sindex", mountpoint.c_str(), DIR_DELIM);
@@ -452,8 +492,12 @@ int MagazineState::UpdateMagazineFormat()
 
 /*-------------------------------------------------
  *  Method to determine mountpoint of magazine and assign its volume files
- *  to magazine slots. Regular files on the magazine are assigned slots in
- *  ascending alphanumeric order by filename beginning with magazine slot zero.
+ *  to magazine slots. Writable regular files on the magazine are volume
+ *  files. Volumes keep the magazine slots recorded in the magazine's slot
+ *  map and new volumes are appended (see AssignSlots()).
+ *  If the magazine directory has not changed since the scan recorded with
+ *  the slot map, then the volumes are taken from the slot map instead of
+ *  scanning the directory again, unless 'full_scan' is true.
  *  If the magazine's device string begins with "UUID:" (case insensitive),
  *  then it specifies the UUID of a file system on a disk partition to be used
  *  as the virtual magazine. Otherwise, it specifies a directory to be used as
@@ -467,17 +511,15 @@ int MagazineState::UpdateMagazineFormat()
  *      -3    magname not found or not mounted
  *      -5    permission denied
  *-------------------------------------------------*/
-int MagazineState::Mount()
+int MagazineState::Mount(bool full_scan)
 {
-   int rc, s;
-   DIR *dir;
-   struct dirent *de;
-   struct stat st;
-   tString fname, line, path;
+   int rc;
+   DirScanner scan;
+   const char *name;
+   bool old_format = false;
    MagazineSlot v;
-   std::list<tString> vname;
-   std::list<tString>::iterator p;
-   char buf[4096];
+   tString stamp;
+   time_t scan_time;
 
    clear();
    if (tCaseFind(mag_dev, "uuid:") != 0) {
@@ -485,8 +527,9 @@ int MagazineState::Mount()
       mountpoint = mag_dev;
    } else {
       /* magazine specified as UUID, so query OS for mountpoint */
-      rc = GetMountpointFromUUID(buf, sizeof(buf), mag_dev.substr(5).c_str());
-      mountpoint = buf;
+      PhaseTimer uuid_timer("uuid", mag_bay);
+      rc = mount_cache.Lookup(mag_dev.substr(5), mountpoint);
+      uuid_timer.Stop();
       if (rc == -3 || rc == -4) {
          /* magazine device not found or not mounted */
          mountpoint.clear();
@@ -500,34 +543,64 @@ int MagazineState::Mount()
       }
    }
 
-   /* Check mountpoint exists */
-   if (access(mountpoint.c_str(), F_OK) != 0) {
-      /* Mountpoint not found */
-      mountpoint.clear();
-      return -3;
-   }
-
-   /* Ensure access to magazine mountpoint */
+   /* Ensure mountpoint exists and magazine is writable */
    if (access(mountpoint.c_str(), W_OK) != 0) {
-      verr.SetError(rc, "no write access to directory %s", mountpoint.c_str());
+      rc = errno;
+      if (rc == ENOENT || rc == ENOTDIR) {
+         /* Mountpoint not found */
+         mountpoint.clear();
+         return -3;
+      }
+      verr.SetErrorWithErrno(rc, "no write access to directory %s", mountpoint.c_str());
       log.Error("%s", verr.GetErrorMsg());
       mountpoint.clear();
       return -5;
    }
 
-   /* If this magazine contains a file named index then assume it was
-    * created by an old version of vchanger and prepare it for use
-    * by removing meta-information files. */
-   tFormat(fname, "%s%sindex", mountpoint.c_str(), DIR_DELIM);
-   if (access(fname.c_str(), F_OK) == 0) {
-      UpdateMagazineFormat();
+   /* Adding, removing or renaming a volume file changes the directory, so
+    * if it is unchanged then the slot map still lists its volumes */
+   PhaseTimer scan_timer("scan", mag_bay);
+   scan_time = time(NULL);
+   GetScanStamp(stamp, scan_time);
+   if (!full_scan && ScanStampValid(stamp) && RestoreSlotMap()) {
+      scan_timer.AddCount(1);
+      scan_timer.Stop();
+      log.Info("magazine %d unchanged since last scan, %d volumes from slot map", mag_bay, num_slots);
+      return 0;
    }
 
-   /* Build list of this magazine's volume files */
-   dir = opendir(mountpoint.c_str());
-   if (!dir) {
+   /* Build list of this magazine's volume files, storing their names
+    * in the label arena rather than as individual strings. Names are
+    * resolved relative to the magazine directory so that each volume
+    * costs at most one system call. */
+   rc = scan.Open(mountpoint);
+   while (rc == 0) {
+      while ((name = scan.NextFile()) != NULL) {
+         /* If this magazine contains a file named index then assume it was
+          * created by an old version of vchanger */
+         if (!old_format && tCaseCmp(name, "index") == 0) {
+            old_format = true;
+            break;
+         }
+         /* Writable regular files on magazine are considered volume files */
+         if (scan.Writable(name)) {
+            v.mag_bay = mag_bay;
+            v.label_len = strlen(name);
+            v.label_pos = AddLabel(name, v.label_len);
+            mslot.push_back(v);
+         }
+      }
+      if (!name) break;
+      /* Prepare old format magazine for use by removing meta-information
+       * files, then scan it again */
+      scan.Close();
+      mslot.clear();
+      labels.clear();
+      UpdateMagazineFormat();
+      rc = scan.Open(mountpoint);
+   }
+   if (rc) {
       /* could not open mountpoint dir */
-      rc = errno;
       verr.SetErrorWithErrno(rc, "cannot open directory '%s'", mountpoint.c_str());
       log.Error("ERROR! %s", verr.GetErrorMsg());
       mountpoint.clear();
@@ -535,50 +608,330 @@ int MagazineState::Mount()
       if (rc == EACCES) return -5;
       return -1;
    }
-   de = readdir(dir);
-   while (de) {
-      /* Skip if not regular file */
-      tFormat(path, "%s%s%s", mountpoint.c_str(), DIR_DELIM, de->d_name);
-      stat(path.c_str(), &st);
-      if (!S_ISREG(st.st_mode)) {
-         de = readdir(dir);
-         continue;
-      }
-      /* Writable regular files on magazine are considered volume files */
-      if (access(path.c_str(), W_OK) == 0) {
-         vname.push_back(de->d_name);
-      }
-      de = readdir(dir);
+   scan.Close();
+   scan_timer.AddCount(scan.GetStats().syscalls());
+   scan_timer.Stop();
+   log.Info("magazine %d scan: %ld entries, %d volumes, %ld syscalls (%ld getdents, %ld stat, %ld access)",
+         mag_bay, scan.GetStats().entries, (int)mslot.size(), scan.GetStats().syscalls(),
+         scan.GetStats().reads, scan.GetStats().stats, scan.GetStats().accesses);
+   /* Assign volume files to magazine slots */
+   AssignSlots();
+   start_slot = 0;
+   num_slots = (int)mslot.size();
+   /* The directory's state is recorded once the slot map matches the scan */
+   if (old_format) GetScanStamp(stamp, scan_time);
+   scan_stamp = stamp;
+   if (!slot_map_changed && has_slot_map) SaveScanStamp();
+   return 0;
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to describe the state of the magazine directory in
+ *  'stamp' by its device, inode and modification time. If the directory
+ *  was modified within two seconds of 'scan_time', then a later change
+ *  might not alter its modification time, so 'stamp' is set empty. It is
+ *  also empty when the directory has no modification time, as for the
+ *  root of a FAT filesystem, or is on a filesystem whose directory times
+ *  are not reliably updated, since then the same stamp may be seen again
+ *  after the volumes were changed while the magazine was unplugged.
+ *-------------------------------------------------*/
+void MagazineState::GetScanStamp(tString &stamp, time_t scan_time)
+{
+   struct stat st;
+
+   stamp.clear();
+   if (stat(mountpoint.c_str(), &st) || st.st_mtime >= scan_time - 2 || st.st_mtime == 0) return;
+   if (!fs_has_dir_times(mountpoint.c_str())) return;
+   tFormat(stamp, "%s\t%s\t%lu:%lu:%ld\n", mag_dev.c_str(), mountpoint.c_str(),
+         (unsigned long)st.st_dev, (unsigned long)st.st_ino, (long)st.st_mtime);
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to determine if 'stamp' matches the directory state
+ *  recorded in the work directory file "bay_scan-N" when the magazine
+ *  was last scanned.
+ *-------------------------------------------------*/
+bool MagazineState::ScanStampValid(const tString &stamp)
+{
+   FILE *FS;
+   size_t n;
+   char sname[4096], buf[8192];
+
+   if (stamp.empty() || stamp.size() > sizeof(buf)) return false;
+   snprintf(sname, sizeof(sname), "%s%sbay_scan-%d", conf.work_dir.c_str(), DIR_DELIM, mag_bay);
+   FS = fopen(sname, "r");
+   if (!FS) return false;
+   n = fread(buf, 1, sizeof(buf), FS);
+   fclose(FS);
+   return n == stamp.size() && memcmp(buf, stamp.data(), n) == 0;
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to save the directory state of the last scan, which
+ *  must match the saved slot map, to the work directory file "bay_scan-N".
+ *  Without a state to save, any saved state is removed so that the next
+ *  invocation scans the magazine.
+ *-------------------------------------------------*/
+void MagazineState::SaveScanStamp()
+{
+   mode_t old_mask;
+   FILE *FS;
+   char sname[4096], tname[4104];
+
+   snprintf(sname, sizeof(sname), "%s%sbay_scan-%d", conf.work_dir.c_str(), DIR_DELIM, mag_bay);
+   if (scan_stamp.empty()) {
+      unlink(sname);
+      return;
    }
-   closedir(dir);
-   if (vname.empty()) {
-      /* Magazine is ready for use but has no volumes */
-      start_slot = 0;
-      num_slots = 0;
-      return 0;
+   snprintf(tname, sizeof(tname), "%s.tmp", sname);
+   old_mask = umask(027);
+   FS = fopen(tname, "w");
+   umask(old_mask);
+   if (!FS) return;
+   if (fwrite(scan_stamp.data(), 1, scan_stamp.size(), FS) != scan_stamp.size() || fclose(FS)
+         || rename(tname, sname)) {
+      unlink(tname);
+      unlink(sname);
    }
-   /* Assign volume files to slots in alphanumeric order */
-   vname.sort();
-   s = 0;
-   for (p = vname.begin(); p != vname.end(); p++) {
-      v.mag_bay = mag_bay;
-      v.label = *p;
-      v.mag_slot = s++;
+   scan_stamp.clear();
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to take the magazine's volumes from the saved slot
+ *  map, keeping the slot of each, instead of scanning the magazine.
+ *  Returns false if there is no usable slot map.
+ *-------------------------------------------------*/
+bool MagazineState::RestoreSlotMap()
+{
+   size_t p, n;
+   FILE *FS;
+   tString map;
+   MagazineSlot v;
+   char buf[65536], sname[4096];
+
+   snprintf(sname, sizeof(sname), "%s%sbay_slots-%d", conf.work_dir.c_str(), DIR_DELIM, mag_bay);
+   FS = fopen(sname, "r");
+   if (!FS) return false;
+   while ((n = fread(buf, 1, sizeof(buf), FS)) > 0) map.append(buf, n);
+   fclose(FS);
+   p = map.find('\n');
+   if (p == tString::npos || map.compare(0, p, mag_dev) != 0) return false;
+   mslot.clear();
+   labels.clear();
+   labels.reserve(map.size());
+   v.mag_bay = mag_bay;
+   for (++p; p < map.size(); p = n + 1) {
+      n = map.find('\n', p);
+      if (n == tString::npos) n = map.size();
+      v.mag_slot = (int)mslot.size();
+      v.label_len = n - p;
+      v.label_pos = n > p ? AddLabel(map.data() + p, n - p) : 0;
       mslot.push_back(v);
    }
+   while (!mslot.empty() && mslot.back().empty()) mslot.pop_back();
+   has_slot_map = true;
+   slot_map_changed = false;
+   changed_slots.clear();
+   start_slot = 0;
    num_slots = (int)mslot.size();
+   return true;
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to assign the scanned volume files in mslot to magazine
+ *  slots. The slot map saved in the work directory file "bay_slots-N" lists
+ *  the label of each magazine slot at the last invocation. Volumes found in
+ *  the map keep their previous slot, slots of volumes that no longer exist
+ *  become empty, and new volumes are appended in natural order so that
+ *  existing volumes never shift. If there is no saved map, all volumes are
+ *  assigned slots in natural order of their filenames, except that a magazine
+ *  which was mounted at the last invocation keeps the alphanumeric order used
+ *  by earlier versions, so that the slots known to the catalog do not change
+ *  when a map is first saved. Magazine slots whose contents differ from the
+ *  saved map are added to changed_slots.
+ *-------------------------------------------------*/
+void MagazineState::AssignSlots()
+{
+   int s, num_map = 0;
+   size_t p, n;
+   FILE *FS;
+   tString map;
+   MagazineSlotArray scanned;
+   MagazineSlot empty_slot;
+   std::vector<SlotMapEntry> entry;
+   std::vector<SlotMapEntry>::iterator e;
+   std::vector<char> was_full;
+   char buf[65536], sname[4096];
+
+   has_slot_map = false;
+   slot_map_changed = false;
+   changed_slots.clear();
+   /* Read saved slot map */
+   snprintf(sname, sizeof(sname), "%s%sbay_slots-%d", conf.work_dir.c_str(), DIR_DELIM, mag_bay);
+   FS = fopen(sname, "r");
+   if (FS) {
+      while ((n = fread(buf, 1, sizeof(buf), FS)) > 0) map.append(buf, n);
+      fclose(FS);
+      /* First line must be this magazine's device */
+      p = map.find('\n');
+      if (p != tString::npos && map.compare(0, p, mag_dev) == 0) {
+         has_slot_map = true;
+         map[p++] = 0;
+         while (p < map.size()) {
+            n = map.find('\n', p);
+            if (n == tString::npos) n = map.size();
+            if (n < map.size()) map[n] = 0;
+            if (n > p) entry.push_back(SlotMapEntry(p, num_map));
+            was_full.push_back(n > p ? 1 : 0);
+            ++num_map;
+            p = n + 1;
+         }
+      } else {
+         log.Warning("WARNING! magazine %d slot map is not for %s, ignoring it", mag_bay, mag_dev.c_str());
+      }
+   }
+
+   if (!has_slot_map) {
+      if (prev_num_slots > 0) {
+         /* No saved map for a magazine that was previously assigned slots, so
+          * seed the map in the alphanumeric order those slots were assigned in */
+         std::sort(mslot.begin(), mslot.end(), MagazineSlotLabelLess(labels.data()));
+      } else {
+         /* No saved map, so assign slots in natural order */
+         std::sort(mslot.begin(), mslot.end(), MagazineSlotNaturalLess(labels.data()));
+      }
+      for (s = 0; s < (int)mslot.size(); s++) {
+         mslot[s].mag_slot = s;
+      }
+      slot_map_changed = !mslot.empty();
+      return;
+   }
+
+   /* Place volumes found in the saved map in their previous slots */
+   std::sort(entry.begin(), entry.end(), SlotMapEntryLess(map.data()));
+   scanned.swap(mslot);
+   empty_slot.mag_bay = mag_bay;
+   mslot.assign(num_map, empty_slot);
+   for (n = 0; n < scanned.size(); n++) {
+      e = std::lower_bound(entry.begin(), entry.end(), labels.data() + scanned[n].label_pos,
+            SlotMapEntryLess(map.data()));
+      if (e != entry.end() && strcmp(map.data() + e->pos, labels.data() + scanned[n].label_pos) == 0
+            && mslot[e->slot].empty()) {
+         scanned[n].mag_slot = e->slot;
+         mslot[e->slot] = scanned[n];
+      } else {
+         scanned[n].mag_slot = -1;
+      }
+   }
+   /* Slots of volumes that no longer exist become empty */
+   for (s = 0; s < num_map; s++) {
+      if (was_full[s] && mslot[s].empty()) {
+         changed_slots.Add(s);
+         slot_map_changed = true;
+      }
+   }
+   while (!mslot.empty() && mslot.back().empty()) mslot.pop_back();
+   /* Append new volumes in natural order */
+   p = mslot.size();
+   for (n = 0; n < scanned.size(); n++) {
+      if (scanned[n].mag_slot < 0) mslot.push_back(scanned[n]);
+   }
+   if (mslot.size() > p) {
+      std::sort(mslot.begin() + p, mslot.end(), MagazineSlotNaturalLess(labels.data()));
+      changed_slots.Add((int)p, (int)mslot.size() - 1);
+      slot_map_changed = true;
+   }
+   if ((int)mslot.size() != num_map) slot_map_changed = true;
+   for (s = 0; s < (int)mslot.size(); s++) {
+      mslot[s].mag_slot = s;
+   }
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to save the label of the volume in each magazine
+ *  slot to the work directory file "bay_slots-N", where N is the bay
+ *  number. The first line holds the magazine device. Each following
+ *  line holds the label of a slot, or is empty for an empty slot.
+ *  On success returns zero, otherwise sets lasterr and returns errno.
+ *-------------------------------------------------*/
+int MagazineState::SaveSlotMap()
+{
+   mode_t old_mask;
+   int rc, s;
+   FILE *FS;
+   tString map;
+   char sname[4096], tname[4104];
+
+   snprintf(sname, sizeof(sname), "%s%sbay_slots-%d", conf.work_dir.c_str(), DIR_DELIM, mag_bay);
+   snprintf(tname, sizeof(tname), "%s.tmp", sname);
+   map.reserve(mag_dev.size() + labels.size() + mslot.size() + 1);
+   map = mag_dev;
+   map += '\n';
+   for (s = 0; s < (int)mslot.size(); s++) {
+      map.append(labels.data() + mslot[s].label_pos, mslot[s].label_len);
+      map += '\n';
+   }
+   old_mask = umask(027);
+   FS = fopen(tname, "w");
+   if (!FS) {
+      rc = errno;
+      umask(old_mask);
+      verr.SetErrorWithErrno(rc, "cannot open magazine %d slot map for writing", mag_bay);
+      log.Error("ERROR! %s", verr.GetErrorMsg());
+      return rc;
+   }
+   if (fwrite(map.data(), 1, map.size(), FS) != map.size() || fclose(FS)) {
+      rc = errno;
+      unlink(tname);
+      umask(old_mask);
+      verr.SetErrorWithErrno(rc, "cannot write magazine %d slot map", mag_bay);
+      log.Error("ERROR! %s", verr.GetErrorMsg());
+      return rc;
+   }
+   umask(old_mask);
+   if (rename(tname, sname)) {
+      rc = errno;
+      unlink(tname);
+      verr.SetErrorWithErrno(rc, "cannot replace magazine %d slot map", mag_bay);
+      log.Error("ERROR! %s", verr.GetErrorMsg());
+      return rc;
+   }
+   slot_map_changed = false;
+   log.Notice("saved slot map of magazine %d (%d slots)", mag_bay, (int)mslot.size());
+   SaveScanStamp();
    return 0;
 }
 
 
 /*-------------------------------------------------
- *  Method to get path to volume file in a magazine slot
- *  On success returns path, else returns empty string
+ *  Method to append a label to the magazine's label arena.
+ *  Returns the offset of the NUL terminated copy of the label.
+ *-------------------------------------------------*/
+size_t MagazineState::AddLabel(const char *lab, size_t len)
+{
+   size_t pos = labels.size();
+   labels.append(lab, len);
+   labels.append(1, '\0');
+   return pos;
+}
+
+
+/*-------------------------------------------------
+ *  Method to get label of volume file in a magazine slot. The
+ *  returned pointer refers to the magazine's label arena and is
+ *  only valid until the next volume is added to the magazine.
+ *  On success returns label, else returns empty string
  *-------------------------------------------------*/
 const char* MagazineState::GetVolumeLabel(int ms) const
 {
    if (ms >= 0 && ms < (int)mslot.size() && !mslot[ms].empty()) {
-      return mslot[ms].label.c_str();
+      return labels.data() + mslot[ms].label_pos;
    }
    return "";
 }
@@ -591,8 +944,11 @@ const char* MagazineState::GetVolumeLabel(int ms) const
 tString MagazineState::GetVolumePath(int ms)
 {
    tString result;
-   if (ms >= 0 && ms < (int)mslot.size()) {
-      tFormat(result, "%s%s%s", mountpoint.c_str(), DIR_DELIM, GetVolumeLabel(ms));
+   if (ms >= 0 && ms < (int)mslot.size() && !mslot[ms].empty()) {
+      result.reserve(mountpoint.size() + mslot[ms].label_len + 1);
+      result = mountpoint;
+      result += DIR_DELIM;
+      result.append(labels.data() + mslot[ms].label_pos, mslot[ms].label_len);
    }
    return result;
 }
@@ -616,71 +972,252 @@ const char* MagazineState::GetVolumePath(tString &path, int ms)
 int MagazineState::GetVolumeSlot(const char *label)
 {
    int n;
+   size_t len = strlen(label);
    for (n = 0; n < num_slots; n++) {
-      if (mslot[n].label == label) return n;
+      if (mslot[n].label_len == len
+            && memcmp(labels.data() + mslot[n].label_pos, label, len) == 0) return n;
    }
    return -1;
 }
 
 
 /*-------------------------------------------------
- *  Method to create a new volume file. 'vol_label_in' gives the
- *  name of the new volume file to create on the magazine. If empty,
- *  then a volume file name is generated based on the magazine's name.
- *  A new magazine slot is appended to hold the new volume and a new
- *  virtual slot is appended that maps to the new magazine slot.
- *  On success returns zero, else sets lasterr and returns negative
+ *  Method to set the label of the volume in magazine slot 'ms', or to
+ *  empty the slot if 'label' is empty. A slot following the last slot
+ *  is appended. The volume file must already be in the magazine.
  *-------------------------------------------------*/
-int MagazineState::CreateVolume(const char *vol_label_in)
+void MagazineState::SetSlotVolume(int ms, const tString &label)
 {
-   int rc = 0, slot;
-   FILE *fs;
-   tString fname, label(vol_label_in);
-   MagazineSlot new_mslot;
+   MagazineSlot v;
 
-   if (label.empty()) {
-      slot = (int)mslot.size();
-      --slot;
-      while(rc == 0) {
-         ++slot;
-         tFormat(label, "%s_%d_%d", conf.storage_name.c_str(), mag_bay, slot);
-         tFormat(fname, "%s%s%s", mountpoint.c_str(), DIR_DELIM, label.c_str());
-         if (access(fname.c_str(), F_OK)) rc = errno;
-         else rc = 0;
-      }
+   if (ms < 0 || ms > (int)mslot.size()) return;
+   v.mag_bay = mag_bay;
+   v.mag_slot = ms;
+   v.label_len = label.size();
+   v.label_pos = label.empty() ? 0 : AddLabel(label.c_str(), label.size());
+   if (ms == (int)mslot.size()) {
+      mslot.push_back(v);
+      num_slots = (int)mslot.size();
    } else {
-      tFormat(fname, "%s%s%s", mountpoint.c_str(), DIR_DELIM, label.c_str());
-      if (access(fname.c_str(), F_OK)) rc = errno;
-      else rc = 0;
-      if (rc == 0) {
-         verr.SetErrorWithErrno(rc, "volume %s already exists on magazine %d", label.c_str(), mag_bay);
-         return EEXIST;
-      }
+      mslot[ms] = v;
    }
-   if (rc != ENOENT) {
-      verr.SetErrorWithErrno(rc, "error %d accessing volumes on magazine %d", rc, mag_bay);
+   changed_slots.Add(ms);
+   slot_map_changed = true;
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to open the magazine's mountpoint directory so that
+ *  volume files can be created relative to it.
+ *  On success returns the open file descriptor, else sets lasterr and
+ *  returns negative.
+ *-------------------------------------------------*/
+int MagazineState::OpenMountpoint()
+{
+   if (mountpoint.empty()) {
+      verr.SetError(ENOENT, "magazine %d is not mounted", mag_bay);
       log.Error("MagazineState::CreateVolume: %s", verr.GetErrorMsg());
       return -1;
    }
-   /* Create new volume file on magazine */
-   fs = fopen(fname.c_str(), "w");
-   if (!fs) {
+#ifdef HAVE_DIRFD_FUNCS
+   int rc, dfd = open(mountpoint.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+   if (dfd < 0) {
       rc = errno;
-      verr.SetErrorWithErrno(rc, "error %d creating volume on magazine %d", rc, mag_bay);
+      verr.SetErrorWithErrno(rc, "error %d opening magazine %d", rc, mag_bay);
       log.Error("MagazineState::CreateVolume: %s", verr.GetErrorMsg());
       return -1;
    }
-   fclose(fs);
+   return dfd;
+#else
+   /* Volume files will be created by path */
+   return 0;
+#endif
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to create the new volume file 'label' in the magazine
+ *  directory open as 'dfd'. The file is created exclusively, so an existing
+ *  file is never truncated, and without a separate check for its existence.
+ *  A new magazine slot is appended to hold the new volume.
+ *  On success returns zero. If the file already exists returns EEXIST,
+ *  else sets lasterr and returns errno.
+ *-------------------------------------------------*/
+int MagazineState::CreateVolumeAt(int dfd, const tString &label)
+{
+   int rc, fd;
+   MagazineSlot new_mslot;
+
+#ifdef HAVE_DIRFD_FUNCS
+   fd = openat(dfd, label.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+#else
+   tString fname;
+   tFormat(fname, "%s%s%s", mountpoint.c_str(), DIR_DELIM, label.c_str());
+   fd = open(fname.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+#endif
+   if (fd < 0) {
+      rc = errno;
+      if (rc == EEXIST) return rc;
+      verr.SetErrorWithErrno(rc, "error %d creating volume on magazine %d", rc, mag_bay);
+      log.Error("MagazineState::CreateVolume: %s", verr.GetErrorMsg());
+      return rc;
+   }
+   /* Preallocate space so that the storage daemon's writes to the volume are
+    * not fragmented by other volumes being written at the same time */
+   if (mag_bay < (int)conf.mag_opts.size() && conf.mag_opts[mag_bay].prealloc_size > 0) {
+      rc = preallocate_fd(fd, conf.mag_opts[mag_bay].prealloc_size,
+            conf.mag_opts[mag_bay].prealloc_mode == PREALLOC_KEEP_SIZE);
+      if (rc) {
+         /* The volume is still usable, so only warn */
+         log.Warning("could not preallocate %lld bytes for volume '%s' on magazine %d (errno=%d)",
+               conf.mag_opts[mag_bay].prealloc_size, label.c_str(), mag_bay, rc);
+      }
+   }
+   close(fd);
    new_mslot.mag_bay = mag_bay;
    new_mslot.mag_slot = mslot.size();
-   new_mslot.label = label;
+   new_mslot.label_len = label.size();
+   new_mslot.label_pos = AddLabel(label.c_str(), label.size());
    mslot.push_back(new_mslot);
+   changed_slots.Add(new_mslot.mag_slot);
+   slot_map_changed = true;
    ++num_slots;
    log.Notice("created volume '%s' on magazine %d (%s)", label.c_str(), mag_bay, mag_dev.c_str());
    return 0;
 }
 
 
+/*-------------------------------------------------
+ *  Method to create a new volume file. 'vol_label_in' gives the
+ *  name of the new volume file to create on the magazine. If empty,
+ *  then a volume file name is generated based on the magazine's name.
+ *  A new magazine slot is appended to hold the new volume.
+ *  On success returns zero, else sets lasterr and returns negative
+ *-------------------------------------------------*/
+int MagazineState::CreateVolume(const char *vol_label_in)
+{
+   int rc, slot, dfd;
+   tString label(vol_label_in);
+
+   if ((dfd = OpenMountpoint()) < 0) return -1;
+   if (label.empty()) {
+      slot = (int)mslot.size();
+      do {
+         tFormat(label, "%s_%d_%d", conf.storage_name.c_str(), mag_bay, slot++);
+         rc = CreateVolumeAt(dfd, label);
+      } while (rc == EEXIST);
+   } else {
+      rc = CreateVolumeAt(dfd, label);
+      if (rc == EEXIST) {
+         verr.SetErrorWithErrno(rc, "volume %s already exists on magazine %d", label.c_str(), mag_bay);
+      }
+   }
+#ifdef HAVE_DIRFD_FUNCS
+   close(dfd);
+#endif
+   if (rc) return -1;
+   return 0;
+}
+
+
+/*-------------------------------------------------
+ *  Method to find the uniqueness numbers used by volumes on the magazine
+ *  whose labels are of the form 'prefix' + '_' + number. The numbers are
+ *  added to 'used' in a single pass over the magazine's slots.
+ *  Returns the highest number found, or negative if none was found.
+ *-------------------------------------------------*/
+int MagazineState::GetVolumeNumbers(const tString &prefix, std::set<int> &used) const
+{
+   int n, num, highest = -1;
+   size_t len;
+   const char *lab, *p;
+
+   for (n = 0; n < (int)mslot.size(); n++) {
+      if (mslot[n].empty() || mslot[n].label_len < prefix.size() + 2) continue;
+      lab = labels.data() + mslot[n].label_pos;
+      if (memcmp(lab, prefix.data(), prefix.size()) || lab[prefix.size()] != '_') continue;
+      num = 0;
+      for (len = prefix.size() + 1, p = lab + len; len < mslot[n].label_len; len++, p++) {
+         if (!isdigit(*p) || num > 100000000) break;
+         num = num * 10 + (*p - '0');
+      }
+      if (len < mslot[n].label_len) continue;
+      used.insert(num);
+      if (num > highest) highest = num;
+   }
+   return highest;
+}
+
+
+/*-------------------------------------------------
+ *  Method to count the magazine's unused volumes, which are the volume
+ *  files that are empty or hold only a Bacula volume label.
+ *  On success returns the number of unused volumes, else sets lasterr
+ *  and returns negative.
+ *-------------------------------------------------*/
+int MagazineState::CountFreeVolumes()
+{
+   int rc, n, nfree = 0;
+   struct stat st;
+   DirScanner dir;
+
+   if (mountpoint.empty()) return 0;
+   rc = dir.Open(mountpoint);
+   if (rc) {
+      verr.SetErrorWithErrno(rc, "error %d opening magazine %d", rc, mag_bay);
+      log.Error("MagazineState::CountFreeVolumes: %s", verr.GetErrorMsg());
+      return -1;
+   }
+   for (n = 0; n < (int)mslot.size(); n++) {
+      if (mslot[n].empty()) continue;
+      if (dir.Stat(labels.data() + mslot[n].label_pos, &st)) continue;
+      if (st.st_size < FREE_VOLUME_SIZE) ++nfree;
+   }
+   return nfree;
+}
+
+
+/*-------------------------------------------------
+ *  Method to create 'count' new volume files with labels of the form
+ *  'prefix' + '_' + number. Numbers are tried beginning with 'start' and
+ *  increasing by 'stride', skipping the numbers in 'used' and those of
+ *  files that already exist on the magazine. The magazine's directory is
+ *  opened once, and each file is created exclusively relative to it. The
+ *  number of volumes created is returned in 'created'. Only this magazine
+ *  is modified, so magazines may create volumes concurrently.
+ *  On success returns zero, else sets lasterr and returns negative
+ *-------------------------------------------------*/
+int MagazineState::CreateVolumes(const tString &prefix, const std::set<int> &used, int start,
+      int stride, int count, int &created)
+{
+   int rc = 0, dfd;
+   tString label;
+
+   created = 0;
+   if (stride < 1) stride = 1;
+   if ((dfd = OpenMountpoint()) < 0) return -1;
+   while (created < count) {
+      while (used.find(start) != used.end()) start += stride;
+      tFormat(label, "%s_%d", prefix.c_str(), start);
+      start += stride;
+      rc = CreateVolumeAt(dfd, label);
+      if (rc == EEXIST) {
+         /* File is not a known volume, so leave it alone */
+         log.Info("skipping label '%s' of existing file on magazine %d", label.c_str(), mag_bay);
+         continue;
+      }
+      if (rc) break;
+      fprintf(stdout, "creating label '%s'\n", label.c_str());
+      ++created;
+   }
+#ifdef HAVE_DIRFD_FUNCS
+   close(dfd);
+#endif
+   if (rc) return -1;
+   return 0;
+}
+
+
 /*-------------------------------------------------
  *  Method to assign bay number and device for this magazine
  *-------------------------------------------------*/
@@ -693,6 +1230,76 @@ void MagazineState::SetBay(int bay, const char *dev)
 
 
 
+///////////////////////////////////////////////////
+//  Class SlotRangeList
+///////////////////////////////////////////////////
+
+/*-------------------------------------------------
+ *  Method to add the range of slots 'first' through 'last'
+ *-------------------------------------------------*/
+void SlotRangeList::Add(int first, int last)
+{
+   if (first > last) range.push_back(std::make_pair(last, first));
+   else range.push_back(std::make_pair(first, last));
+}
+
+/*-------------------------------------------------
+ *  Method to add all ranges of 'b', offset by 'offset'
+ *-------------------------------------------------*/
+void SlotRangeList::Add(const SlotRangeList &b, int offset)
+{
+   size_t n;
+   for (n = 0; n < b.range.size(); n++) {
+      range.push_back(std::make_pair(b.range[n].first + offset, b.range[n].second + offset));
+   }
+}
+
+/*-------------------------------------------------
+ *  Method to sort ranges and merge overlapping or adjacent ranges
+ *-------------------------------------------------*/
+void SlotRangeList::Normalize()
+{
+   size_t n, m;
+   if (range.size() < 2) return;
+   std::sort(range.begin(), range.end());
+   m = 0;
+   for (n = 1; n < range.size(); n++) {
+      if (range[n].first <= range[m].second + 1) {
+         if (range[n].second > range[m].second) range[m].second = range[n].second;
+      } else {
+         range[++m] = range[n];
+      }
+   }
+   range.resize(m + 1);
+}
+
+/*-------------------------------------------------
+ *  Method to format ranges as a slot list of the form "1-5,7,9-10",
+ *  as accepted by the slots= argument of Bacula console commands.
+ *  Slots below 1 or above 'max_slot' (if not negative) are omitted.
+ *-------------------------------------------------*/
+tString SlotRangeList::ToString(int max_slot)
+{
+   size_t n;
+   int first, last;
+   tString result, tmp;
+
+   Normalize();
+   for (n = 0; n < range.size(); n++) {
+      first = range[n].first < 1 ? 1 : range[n].first;
+      last = range[n].second;
+      if (max_slot >= 0 && last > max_slot) last = max_slot;
+      if (first > last) continue;
+      if (!result.empty()) result += ',';
+      if (first == last) tFormat(tmp, "%d", first);
+      else tFormat(tmp, "%d-%d", first, last);
+      result += tmp;
+   }
+   return result;
+}
+
+
+
 ///////////////////////////////////////////////////
 //  Class VirtualSlot
 ///////////////////////////////////////////////////
@@ -765,21 +1372,23 @@ void DriveState::clear()
 
 /*-------------------------------------------------
  *  Method to save dynamic configuration info to a file in
- *  the work directory named dynamic.conf.
+ *  the work directory named dynamic.conf. The file is replaced
+ *  atomically, since it may be read without holding the changer lock.
  *-------------------------------------------------*/
 void DynamicConfig::save()
 {
    mode_t old_mask;
    int rc;
    FILE *FS;
-   char sname[4096];
+   char sname[4096], tname[4104];
 
    if (max_slot < 10) max_slot = 10;
    /* Build path to dynamic.conf file */
    snprintf(sname, sizeof(sname), "%s%sdynamic.conf", conf.work_dir.c_str(), DIR_DELIM);
+   snprintf(tname, sizeof(tname), "%s.tmp", sname);
    /* Write dynamic config info */
    old_mask = umask(027);
-   FS = fopen(sname, "w");
+   FS = fopen(tname, "w");
    if (!FS) {
       /* Unable to open dynamic.conf file for writing */
       rc = errno;
@@ -787,19 +1396,25 @@ void DynamicConfig::save()
       log.Error("ERROR! cannot open dynamic.conf file for writing (errno=%d)", rc);
       return;
    }
-   /* Save max slot number in use to dynamic configuration */
-   if (fprintf(FS, "max_used_slot=%d\n", max_slot) < 0) {
+   /* Save max slot number in use and state generation to dynamic configuration */
+   if (fprintf(FS, "max_used_slot=%d\ngeneration=%ld\n", max_slot, generation) < 0) {
       /* I/O error writing dynamic.conf file */
       rc = errno;
       fclose(FS);
-      unlink(sname);
+      unlink(tname);
       umask(old_mask);
       log.Error("ERROR! i/o error writing dynamic.conf file (errno=%d)", rc);
       return;
    }
    fclose(FS);
    umask(old_mask);
-   log.Notice("saved dynamic configuration (max used slot: %d)", max_slot);
+   if (rename(tname, sname)) {
+      rc = errno;
+      unlink(tname);
+      log.Error("ERROR! cannot replace dynamic.conf file (errno=%d)", rc);
+      return;
+   }
+   log.Notice("saved dynamic configuration (max used slot: %d, generation: %ld)", max_slot, generation);
 }
 
 
@@ -830,22 +1445,22 @@ void DynamicConfig::restore()
       log.Error("ERROR! cannot open dynamic.conf file for restore (errno=%d)", rc);
       return;
    }
-   if (tGetLine(line, FS) == NULL) {
-      rc = errno;
-      if (!feof(FS)) {
-         /* error reading bay state file */
-         fclose(FS);
-         log.Error("ERROR! i/o error reading dynamic.conf file (errno=%d)", rc);
-         return;
+   while (tGetLine(line, FS) != NULL) {
+      tStrip(tRemoveEOL(line));
+      if (tCaseFind(line, "max_used_slot=") == 0) {
+         max_slot = (int)strtol(line.substr(14).c_str(), NULL, 10);
+         if (max_slot < 10) max_slot = 10;
+      } else if (tCaseFind(line, "generation=") == 0) {
+         generation = strtol(line.substr(11).c_str(), NULL, 10);
       }
    }
-   fclose(FS);
-
-   /* Get magazine device (UUID or path specified in config) */
-   tStrip(tRemoveEOL(line));
-   if (tCaseFind(line, "max_used_slot") == 0) {
-      max_slot = (int)strtol(line.substr(14).c_str(), NULL, 10);
-      if (max_slot < 10) max_slot = 10;
+   if (!feof(FS)) {
+      /* error reading dynamic.conf file */
+      rc = errno;
+      fclose(FS);
+      log.Error("ERROR! i/o error reading dynamic.conf file (errno=%d)", rc);
+      return;
    }
+   fclose(FS);
 }
 
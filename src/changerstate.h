@@ -24,42 +24,59 @@
 #define CHANGERSTATE_H_
 
 #include <vector>
+#include <set>
+#include <utility>
 #include "tstring.h"
 #include "errhandler.h"
 
 class MagazineSlot
 {
 public:
-   MagazineSlot() : mag_bay(-1), mag_slot(-1) {}
+   MagazineSlot() : mag_bay(-1), mag_slot(-1), label_pos(0), label_len(0) {}
    MagazineSlot(const MagazineSlot &b);
 	virtual ~MagazineSlot() {}
 	MagazineSlot& operator=(const MagazineSlot &b);
-   bool operator==(const MagazineSlot &b);
-   bool operator!=(const MagazineSlot &b);
    void clear();
-   inline bool empty() { return label.empty(); }
-   inline bool empty() const { return label.empty(); }
-   inline bool operator==(const char *lab) { return (label == lab); }
-   inline bool operator!=(const char *lab) { return (label != lab); }
+   inline bool empty() { return label_len == 0; }
+   inline bool empty() const { return label_len == 0; }
 public:
 	int mag_bay;
 	int mag_slot;
-	tString label;
+	size_t label_pos;    /* offset of label in the magazine's label arena */
+	size_t label_len;
 };
 
 typedef std::vector<MagazineSlot> MagazineSlotArray;
 
+/* A set of slot numbers, kept as a list of inclusive ranges */
+class SlotRangeList
+{
+public:
+   SlotRangeList() {}
+   virtual ~SlotRangeList() {}
+   inline void clear() { range.clear(); }
+   inline bool empty() const { return range.empty(); }
+   void Add(int first, int last);
+   inline void Add(int slot) { Add(slot, slot); }
+   void Add(const SlotRangeList &b, int offset = 0);
+   void Normalize();
+   tString ToString(int max_slot = -1);
+protected:
+   std::vector< std::pair<int, int> > range;
+};
+
 class MagazineState
 {
 public:
-   MagazineState() : mag_bay(-1), num_slots(0), start_slot(0), prev_num_slots(0), prev_start_slot(0) {}
+   MagazineState() : mag_bay(-1), num_slots(0), start_slot(0), prev_num_slots(0), prev_start_slot(0),
+         has_slot_map(false), slot_map_changed(false) {}
 	MagazineState(const MagazineState &b);
 	virtual ~MagazineState() {}
 	MagazineState& operator=(const MagazineState &b);
 	void clear();
    int save();
 	int restore();
-	int Mount();
+	int Mount(bool full_scan = false);
 	void SetBay(int bay, const char *dev);
 	inline void SetBay(int bay, const tString &dev) { SetBay(bay, dev.c_str()); }
    tString GetVolumePath(int mag_slot);
@@ -69,11 +86,25 @@ public:
    inline int GetVolumeSlot(const tString &fname) { return GetVolumeSlot(fname.c_str()); }
 	int CreateVolume(const char *vol_label = "");
 	inline int CreateVolume(const tString &labl) { return CreateVolume(labl.c_str()); }
+   void SetSlotVolume(int mag_slot, const tString &label);
+   int GetVolumeNumbers(const tString &prefix, std::set<int> &used) const;
+   int CountFreeVolumes();
+   int CreateVolumes(const tString &prefix, const std::set<int> &used, int start, int stride,
+         int count, int &created);
    inline bool empty() { return mountpoint.empty(); }
    inline bool empty() const { return mountpoint.empty(); }
 protected:
 	int ReadMagazineIndex();
 	int UpdateMagazineFormat();
+	size_t AddLabel(const char *lab, size_t len);
+	void AssignSlots();
+	int SaveSlotMap();
+   bool RestoreSlotMap();
+   void GetScanStamp(tString &stamp, time_t scan_time);
+   bool ScanStampValid(const tString &stamp);
+   void SaveScanStamp();
+   int OpenMountpoint();
+   int CreateVolumeAt(int dfd, const tString &label);
 public:
 	int mag_bay;
 	int num_slots;
@@ -83,9 +114,17 @@ public:
 	tString mag_dev;
 	tString mountpoint;
 	MagazineSlotArray mslot;
+	tString labels;      /* arena holding the NUL terminated labels of all slots */
+	bool has_slot_map;   /* true if slots were assigned from a saved slot map */
+	bool slot_map_changed;
+	SlotRangeList changed_slots;  /* magazine slots changed from the saved slot map */
+   tString scan_stamp;  /* state of the magazine directory scanned, to be saved with the slot map */
    ErrorHandler verr;
 };
 
+/* Volume files smaller than this hold at most a Bacula volume label */
+#define FREE_VOLUME_SIZE 65536
+
 typedef std::vector<MagazineState> MagazineStateArray;
 
 class VirtualSlot
@@ -110,11 +149,12 @@ typedef std::vector<VirtualSlot> VirtualSlotArray;
 class DynamicConfig
 {
 public:
-   DynamicConfig() : max_slot(0) {}
+   DynamicConfig() : max_slot(0), generation(0) {}
    void save();
    void restore();
 public:
    int max_slot;
+   long generation;  /* incremented whenever the changer's state changes */
 };
 
 class DriveState
@@ -0,0 +1,271 @@
+/* dirscan.cpp
+ *
+ *  This file is part of vchanger by Josh Fisher.
+ *
+ *  vchanger copyright (C) 2008-2015 Josh Fisher
+ *
+ *  vchanger is free software.
+ *  You may redistribute it and/or modify it under the terms of the
+ *  GNU General Public License version 2, as published by the Free
+ *  Software Foundation.
+ *
+ *  vchanger is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vchanger.  See the file "COPYING".  If not,
+ *  write to:  The Free Software Foundation, Inc.,
+ *             59 Temple Place - Suite 330,
+ *             Boston,  MA  02111-1307, USA.
+ *
+ *  Provides a class for enumerating the regular files in a directory
+ */
+
+#include "config.h"
+#include "compat_defs.h"
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+
+#include "dirscan.h"
+
+#if defined(HAVE_DIRFD_FUNCS) && defined(SYS_getdents64) && defined(DT_UNKNOWN)
+#define USE_GETDENTS64 1
+/* Size of buffer used to read directory entries in bulk */
+#define DIRSCAN_BUF_SIZE (256 * 1024)
+/* Layout of the records returned by the getdents64 system call */
+struct linux_dirent64
+{
+   uint64_t d_ino;
+   int64_t d_off;
+   unsigned short d_reclen;
+   unsigned char d_type;
+   char d_name[1];
+};
+#endif
+#ifndef O_DIRECTORY
+#define O_DIRECTORY 0
+#endif
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+
+/*=================================================
+ *  Class DirScanner
+ *=================================================*/
+
+DirScanner::DirScanner() : dfd(-1), dir(NULL), buf(NULL), buf_len(0), buf_pos(0)
+{
+}
+
+DirScanner::~DirScanner()
+{
+   Close();
+}
+
+
+/*-------------------------------------------------
+ *  Method to open directory 'dpath' for scanning.
+ *  On success returns zero, else returns errno.
+ *-------------------------------------------------*/
+int DirScanner::Open(const char *dpath)
+{
+   int rc;
+
+   Close();
+   stats.clear();
+   path = dpath;
+#ifdef HAVE_DIRFD_FUNCS
+   dfd = open(dpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+   if (dfd < 0) {
+      rc = errno;
+      return rc;
+   }
+#ifdef USE_GETDENTS64
+   buf = (char*)malloc(DIRSCAN_BUF_SIZE);
+   if (!buf) {
+      close(dfd);
+      dfd = -1;
+      return ENOMEM;
+   }
+#else
+   /* Directory stream takes ownership of the descriptor */
+   dir = fdopendir(dfd);
+   if (!dir) {
+      rc = errno;
+      close(dfd);
+      dfd = -1;
+      return rc;
+   }
+#endif
+#else
+   dir = opendir(dpath);
+   if (!dir) {
+      rc = errno;
+      return rc;
+   }
+#endif
+   return 0;
+}
+
+
+/*-------------------------------------------------
+ *  Method to close the directory being scanned
+ *-------------------------------------------------*/
+void DirScanner::Close()
+{
+   if (dir) {
+      closedir(dir);
+      dir = NULL;
+      dfd = -1;
+   }
+   if (dfd >= 0) {
+      close(dfd);
+      dfd = -1;
+   }
+   if (buf) {
+      free(buf);
+      buf = NULL;
+   }
+   buf_len = 0;
+   buf_pos = 0;
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to get the name of the next directory entry,
+ *  skipping the '.' and '..' entries. On return, 'is_reg' is set
+ *  to 1 if the entry is a regular file, 0 if it is not, or -1 if
+ *  the filesystem did not report the entry's type.
+ *  Returns NULL when there are no more entries.
+ *-------------------------------------------------*/
+const char* DirScanner::NextEntry(int &is_reg)
+{
+#ifdef USE_GETDENTS64
+   long n;
+   struct linux_dirent64 *de;
+
+   if (dfd < 0) return NULL;
+   while (true) {
+      if (buf_pos >= buf_len) {
+         n = syscall(SYS_getdents64, dfd, buf, DIRSCAN_BUF_SIZE);
+         ++stats.reads;
+         if (n <= 0) return NULL;
+         buf_len = (size_t)n;
+         buf_pos = 0;
+      }
+      de = (struct linux_dirent64*)(buf + buf_pos);
+      buf_pos += de->d_reclen;
+      ++stats.entries;
+      if (de->d_name[0] == '.' && (de->d_name[1] == 0
+            || (de->d_name[1] == '.' && de->d_name[2] == 0))) continue;
+      if (de->d_type == DT_REG) is_reg = 1;
+      else if (de->d_type == DT_UNKNOWN) is_reg = -1;
+      else is_reg = 0;
+      return de->d_name;
+   }
+#else
+   struct dirent *de;
+
+   if (!dir) return NULL;
+   /* readdir() buffers entries internally, so its calls are not counted */
+   while ((de = readdir(dir)) != NULL) {
+      ++stats.entries;
+      if (de->d_name[0] == '.' && (de->d_name[1] == 0
+            || (de->d_name[1] == '.' && de->d_name[2] == 0))) continue;
+#ifdef DT_UNKNOWN
+      if (de->d_type == DT_REG) is_reg = 1;
+      else if (de->d_type == DT_UNKNOWN) is_reg = -1;
+      else is_reg = 0;
+#else
+      is_reg = -1;
+#endif
+      return de->d_name;
+   }
+   return NULL;
+#endif
+}
+
+
+/*-------------------------------------------------
+ *  Method to get the name of the next regular file in the directory.
+ *  Symlinks are not followed. The returned name is only valid until
+ *  the next call. Returns NULL when there are no more files.
+ *-------------------------------------------------*/
+const char* DirScanner::NextFile()
+{
+   int is_reg;
+   const char *name;
+   struct stat st;
+
+   while ((name = NextEntry(is_reg)) != NULL) {
+      if (is_reg < 0) {
+         /* Filesystem does not report entry types, so must stat */
+         if (Stat(name, &st)) continue;
+         if (S_ISREG(st.st_mode)) is_reg = 1;
+      }
+      if (is_reg > 0) return name;
+   }
+   return NULL;
+}
+
+
+/*-------------------------------------------------
+ *  Method to determine if a file in the directory is writable
+ *-------------------------------------------------*/
+bool DirScanner::Writable(const char *name)
+{
+   ++stats.accesses;
+#ifdef HAVE_DIRFD_FUNCS
+   return faccessat(dfd, name, W_OK, 0) == 0;
+#else
+   fname = path;
+   fname += DIR_DELIM;
+   fname += name;
+   return access(fname.c_str(), W_OK) == 0;
+#endif
+}
+
+
+/*-------------------------------------------------
+ *  Method to get status of a file in the directory without
+ *  following symlinks.
+ *  On success returns zero, else returns errno.
+ *-------------------------------------------------*/
+int DirScanner::Stat(const char *name, struct stat *st)
+{
+   ++stats.stats;
+#ifdef HAVE_DIRFD_FUNCS
+   if (fstatat(dfd, name, st, AT_SYMLINK_NOFOLLOW)) return errno;
+#else
+   fname = path;
+   fname += DIR_DELIM;
+   fname += name;
+   if (stat(fname.c_str(), st)) return errno;
+#endif
+   return 0;
+}
@@ -0,0 +1,88 @@
+/* dirscan.h
+ *
+ *  This file is part of vchanger by Josh Fisher.
+ *
+ *  vchanger copyright (C) 2008-2015 Josh Fisher
+ *
+ *  vchanger is free software.
+ *  You may redistribute it and/or modify it under the terms of the
+ *  GNU General Public License version 2, as published by the Free
+ *  Software Foundation.
+ *
+ *  vchanger is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vchanger.  See the file "COPYING".  If not,
+ *  write to:  The Free Software Foundation, Inc.,
+ *             59 Temple Place - Suite 330,
+ *             Boston,  MA  02111-1307, USA.
+ */
+#ifndef _DIRSCAN_H_
+#define _DIRSCAN_H_ 1
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_DIRENT_H
+#include <dirent.h>
+#endif
+#include "tstring.h"
+
+#if defined(HAVE_OPENAT) && defined(HAVE_FSTATAT) && defined(HAVE_FACCESSAT) && defined(HAVE_FDOPENDIR)
+#define HAVE_DIRFD_FUNCS 1
+#endif
+
+/* Counters of the system calls made while scanning a directory */
+class DirScanStats
+{
+public:
+   DirScanStats() : entries(0), reads(0), stats(0), accesses(0) {}
+   inline void clear() { entries = reads = stats = accesses = 0; }
+   inline long syscalls() const { return reads + stats + accesses; }
+public:
+   long entries;     /* directory entries returned */
+   long reads;       /* getdents64/readdir calls */
+   long stats;       /* stat/fstatat calls */
+   long accesses;    /* access/faccessat calls */
+};
+
+/*
+ *  Class to enumerate the regular files in a directory using as few system
+ *  calls as possible. Where available, entries are read in bulk relative to
+ *  an open directory file descriptor, the entry type returned by the kernel
+ *  is used to skip non-regular files, and fstatat() is only called for
+ *  entries whose type the filesystem does not report.
+ */
+class DirScanner
+{
+public:
+   DirScanner();
+   virtual ~DirScanner();
+   int Open(const char *path);
+   inline int Open(const tString &path) { return Open(path.c_str()); }
+   void Close();
+   const char* NextFile();
+   bool Writable(const char *name);
+   int Stat(const char *name, struct stat *st);
+   inline int GetDirFD() const { return dfd; }
+   inline const DirScanStats& GetStats() const { return stats; }
+protected:
+   const char* NextEntry(int &is_reg);
+protected:
+   int dfd;
+   DIR *dir;
+   char *buf;
+   size_t buf_len;
+   size_t buf_pos;
+   tString path;
+   tString fname;
+   DirScanStats stats;
+};
+
+#endif /* _DIRSCAN_H_ */
@@ -56,7 +56,19 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#ifdef HAVE_WINDOWS_H
+#include <direct.h>
+#endif
 
+#include <algorithm>
+#include <map>
+#include <set>
 #include "compat/gettimeofday.h"
 #include "compat/readlink.h"
 #include "compat/sleep.h"
@@ -64,8 +76,206 @@
 #include "util.h"
 #include "loghandler.h"
 #include "bconsole.h"
+#include "timing.h"
 #include "diskchanger.h"
 
+#if defined(HAVE_READLINKAT) && defined(HAVE_SYMLINKAT) && defined(HAVE_RENAMEAT) && defined(HAVE_UNLINKAT)
+#define HAVE_LINKAT_FUNCS 1
+#endif
+#ifndef O_DIRECTORY
+#define O_DIRECTORY 0
+#endif
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+#ifndef ECANCELED
+#define ECANCELED EINTR
+#endif
+
+/* Directory on a magazine's filesystem where volumes being migrated or
+ * rebalanced are copied before they are placed in the magazine */
+#define MIGRATE_STAGING_DIR ".vchanger-staging"
+
+/* Volumes to create on one magazine, possibly in a thread of its own */
+class CreateVolumesJob
+{
+public:
+   CreateVolumesJob() : mag(NULL), start(0), stride(1), count(0), prev_num(0), created(0), rc(0) {}
+   void Run();
+public:
+   MagazineState *mag;
+   tString prefix;
+   std::set<int> used;
+   int start;
+   int stride;
+   int count;
+   int prev_num;
+   int created;
+   int rc;
+};
+
+/*-------------------------------------------------
+ *  Method to create the job's volumes on its magazine
+ *-------------------------------------------------*/
+void CreateVolumesJob::Run()
+{
+   TraceSpan span("createvols", mag->mag_bay);
+   rc = mag->CreateVolumes(prefix, used, start, stride, count, created);
+   span.SetArg("volumes", (long)created);
+}
+
+#ifdef HAVE_PTHREAD_H
+static void* create_volumes_thread(void *arg)
+{
+   ((CreateVolumesJob*)arg)->Run();
+   return NULL;
+}
+#endif
+
+/* Space of a filesystem holding magazines, while planning a rebalance */
+class RebalanceFs
+{
+public:
+   RebalanceFs() : dev(0), avail(0), total(0), bay(-1) {}
+   inline double Free() const { return total > 0 ? (double)avail / (double)total : 0; }
+public:
+   dev_t dev;
+   long long avail;
+   long long total;
+   int bay;                      /* magazine receiving volumes moved to the filesystem */
+   VolumeMoveArray vols;         /* volumes that may be moved off, largest first */
+};
+
+static bool volume_move_larger(const VolumeMove &a, const VolumeMove &b)
+{
+   return a.size > b.size;
+}
+
+/* Volume moves shared by the threads staging a rebalance. A filesystem takes
+ * part in only one move at a time, so that each disk streams a single volume
+ * rather than seeking between several. */
+class RebalanceRunner
+{
+public:
+   RebalanceRunner(VolumeMoveArray &m, DiskChanger &c, long long r);
+   ~RebalanceRunner();
+   void Run();
+protected:
+   bool Busy(size_t i) const;
+   void Lock();
+   void Unlock();
+   void Wait();
+   void Wake();
+public:
+   VolumeMoveArray &moves;
+   DiskChanger &changer;
+   std::vector<dev_t> src_dev;
+   std::vector<dev_t> dst_dev;
+   std::vector<bool> started;
+   std::multiset<dev_t> busy;
+   long long rate;               /* bytes per second each move may copy, or 0 */
+#ifdef HAVE_PTHREAD_H
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;
+#endif
+};
+
+RebalanceRunner::RebalanceRunner(VolumeMoveArray &m, DiskChanger &c, long long r)
+      : moves(m), changer(c), src_dev(m.size(), 0), dst_dev(m.size(), 0),
+        started(m.size(), false), rate(r)
+{
+#ifdef HAVE_PTHREAD_H
+   pthread_mutex_init(&mutex, NULL);
+   pthread_cond_init(&cond, NULL);
+#endif
+}
+
+RebalanceRunner::~RebalanceRunner()
+{
+#ifdef HAVE_PTHREAD_H
+   pthread_cond_destroy(&cond);
+   pthread_mutex_destroy(&mutex);
+#endif
+}
+
+void RebalanceRunner::Lock()
+{
+#ifdef HAVE_PTHREAD_H
+   pthread_mutex_lock(&mutex);
+#endif
+}
+
+void RebalanceRunner::Unlock()
+{
+#ifdef HAVE_PTHREAD_H
+   pthread_mutex_unlock(&mutex);
+#endif
+}
+
+void RebalanceRunner::Wait()
+{
+#ifdef HAVE_PTHREAD_H
+   pthread_cond_wait(&cond, &mutex);
+#endif
+}
+
+void RebalanceRunner::Wake()
+{
+#ifdef HAVE_PTHREAD_H
+   pthread_cond_broadcast(&cond);
+#endif
+}
+
+bool RebalanceRunner::Busy(size_t i) const
+{
+   return busy.find(src_dev[i]) != busy.end() || busy.find(dst_dev[i]) != busy.end();
+}
+
+/*-------------------------------------------------
+ *  Method to stage moves, one at a time, until all moves have been
+ *  started. Several threads may run this method at once.
+ *-------------------------------------------------*/
+void RebalanceRunner::Run()
+{
+   size_t i, pending;
+
+   Lock();
+   while (true) {
+      pending = 0;
+      for (i = 0; i < moves.size(); i++) {
+         if (started[i]) continue;
+         ++pending;
+         if (!Busy(i)) break;
+      }
+      if (i >= moves.size()) {
+         if (!pending) break;
+         /* Wait for a move on a busy filesystem to finish */
+         Wait();
+         continue;
+      }
+      started[i] = true;
+      busy.insert(src_dev[i]);
+      busy.insert(dst_dev[i]);
+      Unlock();
+
+      changer.StageVolumeMove(moves[i], rate);
+
+      Lock();
+      busy.erase(busy.find(src_dev[i]));
+      busy.erase(busy.find(dst_dev[i]));
+      Wake();
+   }
+   Unlock();
+}
+
+#ifdef HAVE_PTHREAD_H
+static void* rebalance_thread(void *arg)
+{
+   ((RebalanceRunner*)arg)->Run();
+   return NULL;
+}
+#endif
+
 
 /*=================================================
  *  Class DiskChanger
@@ -96,13 +306,28 @@ void DiskChanger::InitializeMagazines()
       m.prev_start_slot = 0;
       magazine.push_back(m);
       /* Restore previous slot count and starting virtual slot */
+      PhaseTimer restore_timer("restore", n);
       magazine[n].restore();
+      restore_timer.Stop();
       /* Get mountpoint and build magazine slot array  */
-      magazine[n].Mount();
+      TraceSpan mount_span("mount", n);
+      magazine[n].Mount(full_scan == SCAN_ALL || full_scan == n);
    }
 }
 
 
+/*-------------------------------------------------
+ *  Protected method to record that the state of the changer has changed
+ *  by incrementing the state generation saved in dynamic.conf. Output
+ *  cached for a previous generation is no longer valid.
+ *------------------------------------------------*/
+void DiskChanger::StateChanged()
+{
+   ++dconf.generation;
+   dconf.save();
+}
+
+
 /*-------------------------------------------------
  *  Protected method to find the start of an empty range of
  *  'count' virtual slots, adding slots if needed.
@@ -134,17 +359,106 @@ int DiskChanger::FindEmptySlotRange(int count)
    return start;
 }
 
+/*-------------------------------------------------
+ *  Protected method to determine if virtual slots 'first' through 'last'
+ *  can be assigned to magazine 'mag', adding slots if needed. The range is
+ *  available if none of its slots have been assigned to another magazine
+ *  and it does not overlap the previous slots of a higher numbered mounted
+ *  magazine that has not yet been assigned slots.
+ *------------------------------------------------*/
+bool DiskChanger::SlotRangeAvailable(int mag, int first, int last)
+{
+   VirtualSlot vs;
+   int v, m, prev_last;
+
+   if (first < 1) return false;
+   while ((int)vslot.size() <= last) {
+      vs.vs = (int)vslot.size();
+      vslot.push_back(vs);
+   }
+   for (v = first; v <= last; v++) {
+      if (vslot[v].mag_bay >= 0 && vslot[v].mag_bay != mag) return false;
+   }
+   for (m = mag + 1; m < (int)magazine.size(); m++) {
+      if (magazine[m].empty() || magazine[m].start_slot > 0) continue;
+      if (magazine[m].prev_start_slot < 1) continue;
+      prev_last = magazine[m].prev_start_slot + magazine[m].prev_num_slots - 1;
+      if (magazine[m].prev_start_slot <= last && prev_last >= first) return false;
+   }
+   return true;
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to map the slots of magazine 'mag' onto the virtual
+ *  slots beginning at 'start'. Empty magazine slots are also mapped so
+ *  that their virtual slots stay reserved for the magazine.
+ *------------------------------------------------*/
+void DiskChanger::AssignMagazineSlots(int mag, int start)
+{
+   int s, v;
+   magazine[mag].start_slot = start;
+   for (s = 0; s < magazine[mag].num_slots; s++) {
+      v = start + s;
+      vslot[v].mag_bay = mag;
+      vslot[v].mag_slot = s;
+   }
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to assign virtual slots to the magazine slots appended
+ *  to magazine 'mag', which previously had 'prev_num' slots. If the virtual
+ *  slots following the magazine's range are free, its range is extended and
+ *  only the new slots need 'update slots'. Otherwise the magazine is moved
+ *  to a range of empty virtual slots, along with any drives loaded from it.
+ *------------------------------------------------*/
+void DiskChanger::AssignAppendedSlots(int mag, int prev_num)
+{
+   int s, v, old_start = magazine[mag].start_slot;
+   std::vector<int> drv(prev_num, -1);
+
+   if (magazine[mag].num_slots <= prev_num) return;
+   if (old_start > 0
+         && SlotRangeAvailable(mag, old_start + prev_num, old_start + magazine[mag].num_slots - 1)) {
+      AssignMagazineSlots(mag, old_start);
+      update_slots.Add(old_start + prev_num, old_start + magazine[mag].num_slots - 1);
+      return;
+   }
+   /* Release the magazine's previous range */
+   for (s = 0; s < prev_num && old_start > 0; s++) {
+      v = old_start + s;
+      if (v >= (int)vslot.size() || vslot[v].mag_bay != mag) continue;
+      drv[s] = vslot[v].drv;
+      vslot[v].drv = -1;
+      vslot[v].mag_bay = -1;
+      vslot[v].mag_slot = -1;
+      update_slots.Add(v);
+   }
+   AssignMagazineSlots(mag, FindEmptySlotRange(magazine[mag].num_slots));
+   for (s = 0; s < prev_num; s++) {
+      if (drv[s] < 0) continue;
+      vslot[magazine[mag].start_slot + s].drv = drv[s];
+      drive[drv[s]].vs = magazine[mag].start_slot + s;
+   }
+   update_slots.Add(magazine[mag].start_slot, magazine[mag].start_slot + magazine[mag].num_slots - 1);
+}
+
+
 /*-------------------------------------------------
  *  Protected method to initialize array of virtual slot and
  *  assign magazine volumes to virtual slots. When possible,
  *  volumes are assigned to the same slot they were in
- *  previously.
+ *  previously. A magazine whose slots were assigned from its
+ *  saved slot map keeps its previous start slot even when
+ *  volumes have been added or removed, so only the slots that
+ *  changed need to be updated in Bacula's catalog.
  *------------------------------------------------*/
 void DiskChanger::InitializeVirtSlots()
 {
    int s, m, v, last;
    VirtualSlot vs;
-   bool found;
+   bool found, changed;
 
    /* Create all known slots as initially empty */
    vslot.clear();
@@ -172,13 +486,48 @@ void DiskChanger::InitializeVirtSlots()
             log.Warning("update slots needed. magazine %d no longer mounted; previous: %d volumes in slots %d-%d", m,
                   magazine[m].prev_num_slots, magazine[m].prev_start_slot,
                   magazine[m].prev_start_slot + magazine[m].prev_num_slots - 1);
-            needs_update = true;
+            update_slots.Add(magazine[m].prev_start_slot,
+                  magazine[m].prev_start_slot + magazine[m].prev_num_slots - 1);
          }
          continue;
       }
       /* Magazine is currently mounted, so check for change in slot assignment */
       log.Info("magazine %d has %d volumes on %s", m, magazine[m].num_slots,
                   magazine[m].mountpoint.c_str());
+      if (magazine[m].has_slot_map && magazine[m].prev_start_slot > 0) {
+         /* Volumes kept their magazine slots, so attempt to keep the previous
+          * start slot, growing or shrinking the range as needed */
+         if (magazine[m].num_slots == 0) {
+            if (magazine[m].prev_num_slots) {
+               log.Warning("update slots needed. magazine %d has no volumes; previous: %d volumes in slots %d-%d", m,
+                     magazine[m].prev_num_slots, magazine[m].prev_start_slot,
+                     magazine[m].prev_start_slot + magazine[m].prev_num_slots - 1);
+               update_slots.Add(magazine[m].prev_start_slot,
+                     magazine[m].prev_start_slot + magazine[m].prev_num_slots - 1);
+            }
+            continue;
+         }
+         if (!SlotRangeAvailable(m, magazine[m].prev_start_slot,
+               magazine[m].prev_start_slot + magazine[m].num_slots - 1)) {
+            log.Warning("update slots needed. magazine %d previous slots %d-%d are not available", m,
+                  magazine[m].prev_start_slot, magazine[m].prev_start_slot + magazine[m].num_slots - 1);
+            needs_update = true;
+            continue;
+         }
+         AssignMagazineSlots(m, magazine[m].prev_start_slot);
+         if (magazine[m].prev_num_slots > magazine[m].num_slots) {
+            update_slots.Add(magazine[m].start_slot + magazine[m].num_slots,
+                  magazine[m].prev_start_slot + magazine[m].prev_num_slots - 1);
+         }
+         update_slots.Add(magazine[m].changed_slots, magazine[m].start_slot);
+         if (!magazine[m].changed_slots.empty() || magazine[m].prev_num_slots != magazine[m].num_slots) {
+            log.Warning("update slots needed. magazine %d has %d volumes, previously had %d", m,
+                  magazine[m].num_slots, magazine[m].prev_num_slots);
+         }
+         log.Notice("%d volumes on magazine %d assigned slots %d-%d", magazine[m].num_slots, m,
+               magazine[m].start_slot, magazine[m].start_slot + magazine[m].num_slots - 1);
+         continue;
+      }
       if (magazine[m].num_slots != magazine[m].prev_num_slots) {
          /* Number of volumes has changed or magazine was not previously mounted, so
           * needs new slot assignment and also 'update slots' will be needed */
@@ -210,12 +559,7 @@ void DiskChanger::InitializeVirtSlots()
          continue;
       }
       /* Assign this magazine's volumes to the same slots as previously assigned */
-      magazine[m].start_slot = magazine[m].prev_start_slot;
-      for (s = 0; s < magazine[m].num_slots; s++) {
-         v = magazine[m].start_slot + s;
-         vslot[v].mag_bay = m;
-         vslot[v].mag_slot = s;
-      }
+      AssignMagazineSlots(m, magazine[m].prev_start_slot);
       log.Notice("%d volumes on magazine %d assigned slots %d-%d", magazine[m].num_slots, m,
             magazine[m].start_slot, magazine[m].start_slot + magazine[m].num_slots - 1);
    }
@@ -224,25 +568,44 @@ void DiskChanger::InitializeVirtSlots()
    for (m = 0; m < (int)magazine.size(); m++) {
       if (magazine[m].empty() || magazine[m].start_slot > 0) continue;
       if (magazine[m].num_slots == 0) continue;
-      magazine[m].start_slot = FindEmptySlotRange(magazine[m].num_slots);
-      for (s = 0; s < magazine[m].num_slots; s++) {
-         v = magazine[m].start_slot + s;
-         vslot[v].mag_bay = m;
-         vslot[v].mag_slot = s;
-      }
+      AssignMagazineSlots(m, FindEmptySlotRange(magazine[m].num_slots));
       log.Notice("%d volumes on magazine %d assigned slots %d-%d", magazine[m].num_slots, m,
             magazine[m].start_slot, magazine[m].start_slot + magazine[m].num_slots - 1);
    }
 
-   /* Save updated state of magazines */
+   /* Save updated state of magazines, noting any change in slot assignment */
+   changed = false;
    for (m = 0; m < (int)magazine.size(); m++) {
+      if (magazine[m].slot_map_changed || magazine[m].start_slot != magazine[m].prev_start_slot
+            || magazine[m].num_slots != magazine[m].prev_num_slots) changed = true;
       magazine[m].save();
    }
    /* Update dynamic configuration info */
-   if ((int)vslot.size() >= dconf.max_slot) {
+   if ((int)vslot.size() - 1 != dconf.max_slot) {
       dconf.max_slot = (int)vslot.size() - 1;
-      dconf.save();
+      if (!changed) dconf.save();
    }
+   if (changed) StateChanged();
+}
+
+
+/*-------------------------------------------------
+ *  Function to determine if work directory entry 'de' is a symlink
+ *------------------------------------------------*/
+static bool work_dir_symlink(const struct dirent *de)
+{
+#ifdef S_ISLNK
+   struct stat st;
+   tString path;
+
+#ifdef DT_UNKNOWN
+   if (de->d_type != DT_UNKNOWN) return de->d_type == DT_LNK;
+#endif
+   tFormat(path, "%s%s%s", conf.work_dir.c_str(), DIR_DELIM, de->d_name);
+   return lstat(path.c_str(), &st) == 0 && S_ISLNK(st.st_mode);
+#else
+   return true;
+#endif
 }
 
 
@@ -258,7 +621,9 @@ int DiskChanger::InitializeDrives()
    DriveState ds;
    tString tmp;
 
-   /* For each drive for which a state file exists. try to restore its state */
+   /* For each drive for which a state file exists. try to restore its state.
+    * The drive symlinks, named by drive number, are found in the same pass */
+   drive_links.clear();
    d = opendir(conf.work_dir.c_str());
    if (!d) {
       rc = errno;
@@ -282,6 +647,9 @@ int DiskChanger::InitializeDrives()
          }
          n = (int)strtol(tmp.c_str(), NULL, 10);
          if (n > max_drive) max_drive = n;
+      } else if (!tmp.empty() && tmp.find_first_not_of("0123456789") == tString::npos
+            && work_dir_symlink(de)) {
+         drive_links.insert((int)strtol(tmp.c_str(), NULL, 10));
       }
       de = readdir(d);
    }
@@ -300,6 +668,14 @@ int DiskChanger::InitializeDrives()
          log.Error("ERROR! %s", verr.GetErrorMsg());
       }
    }
+   /* Remove symlinks left for drives that have no state file */
+   while (!drive_links.empty() && *drive_links.rbegin() > max_drive) {
+      n = *drive_links.rbegin();
+      if (UnlinkDriveSymlink(n)) {
+         log.Error("ERROR! %s", verr.GetErrorMsg());
+         break;
+      }
+   }
    return 0;
 }
 
@@ -317,6 +693,18 @@ void DiskChanger::SetMaxDrive(int need)
    }
 }
 
+/*-------------------------------------------------
+ *  Function to get the name of the symlink for drive 'drv'. When the work
+ *  directory is open as 'dfd' the name is relative to it, else it is the
+ *  full path.
+ *------------------------------------------------*/
+static const char* drive_link_name(tString &name, int dfd, int drv, const char *suffix = "")
+{
+   if (dfd >= 0) tFormat(name, "%d%s", drv, suffix);
+   else tFormat(name, "%s%s%d%s", conf.work_dir.c_str(), DIR_DELIM, drv, suffix);
+   return name.c_str();
+}
+
 /*
  *  Method to create symlink for drive pointing to currently loaded volume file
  */
@@ -341,31 +729,81 @@ int DiskChanger::CreateDriveSymlink(int drv)
       verr.SetError(ENOENT, "cannot create symlink for unloaded drive %d", drv);
       return ENOENT;
    }
-   tFormat(sname, "%s%s%d", conf.work_dir.c_str(), DIR_DELIM, drv);
-   rc = readlink(sname.c_str(), lname, sizeof(lname));
-   if (rc > 0) {
-      if (rc >= (int)sizeof(lname)) {
-         verr.SetError(ENAMETOOLONG, "symlink target too long on readlink for drive %d", drv);
-         return ENAMETOOLONG;
-      }
-      lname[rc] = 0;
-      if (fname == lname) {
-         /* symlink already exists */
-         log.Info("found symlink for drive %d -> %s", drv, fname.c_str());
-         return 0;
+   drive_link_name(sname, work_dfd, drv);
+   if (drive_links.find(drv) != drive_links.end()) {
+#ifdef HAVE_LINKAT_FUNCS
+      if (work_dfd >= 0) rc = readlinkat(work_dfd, sname.c_str(), lname, sizeof(lname));
+      else
+#endif
+      rc = readlink(sname.c_str(), lname, sizeof(lname));
+      if (rc > 0) {
+         if (rc >= (int)sizeof(lname)) {
+            verr.SetError(ENAMETOOLONG, "symlink target too long on readlink for drive %d", drv);
+            return ENAMETOOLONG;
+         }
+         lname[rc] = 0;
+         if (fname == lname) {
+            /* symlink already exists */
+            log.Info("found symlink for drive %d -> %s", drv, fname.c_str());
+            return 0;
+         }
       }
-      /* Symlink points to wrong mountpoint, so delete and re-create */
-      if (RemoveDriveSymlink(drv)) return EEXIST;
    }
+#ifdef HAVE_LINKAT_FUNCS
+   if (work_dfd >= 0) return SwapDriveSymlink(drv, fname);
+#endif
+   /* Delete any symlink pointing to the wrong volume and re-create it */
+   if (RemoveDriveSymlink(drv)) return EEXIST;
    if (symlink(fname.c_str(), sname.c_str())) {
       rc = errno;
       verr.SetErrorWithErrno(rc, "error %d creating symlink for drive %d", rc, drv);
       return rc;
    }
+   drive_links.insert(drv);
    log.Notice("created symlink for drive %d -> %s", drv, fname.c_str());
    return 0;
 }
 
+/*-------------------------------------------------
+ *  Protected method to point drive 'drv's symlink at 'target' by creating
+ *  a temporary symlink in the work directory and renaming it over the
+ *  drive's symlink, so that the drive's device is never missing.
+ *  On success returns zero, else on error sets lasterr and
+ *  returns errno.
+ *-------------------------------------------------*/
+int DiskChanger::SwapDriveSymlink(int drv, const tString &target)
+{
+#ifdef HAVE_LINKAT_FUNCS
+   int rc = 0;
+   tString sname, tname;
+
+   drive_link_name(sname, work_dfd, drv);
+   drive_link_name(tname, work_dfd, drv, ".tmp");
+   if (symlinkat(target.c_str(), work_dfd, tname.c_str())) {
+      rc = errno;
+      if (rc == EEXIST) {
+         /* Left behind by an interrupted invocation */
+         unlinkat(work_dfd, tname.c_str(), 0);
+         rc = symlinkat(target.c_str(), work_dfd, tname.c_str()) ? errno : 0;
+      }
+   }
+   if (!rc && renameat(work_dfd, tname.c_str(), work_dfd, sname.c_str())) {
+      rc = errno;
+      unlinkat(work_dfd, tname.c_str(), 0);
+   }
+   if (rc) {
+      verr.SetErrorWithErrno(rc, "error %d creating symlink for drive %d", rc, drv);
+      return rc;
+   }
+   drive_links.insert(drv);
+   log.Notice("created symlink for drive %d -> %s", drv, target.c_str());
+   return 0;
+#else
+   verr.SetError(ENOSYS, "cannot replace symlink for drive %d", drv);
+   return ENOSYS;
+#endif
+}
+
 /*-------------------------------------------------
  *  Method to delete this drive's symlink.
  *  On success returns zero, else on error sets lasterr and
@@ -373,16 +811,35 @@ int DiskChanger::CreateDriveSymlink(int drv)
  *-------------------------------------------------*/
 int DiskChanger::RemoveDriveSymlink(int drv)
 {
-   int rc;
-   tString sname;
-
    if (drv < 0 || drv >= (int)drive.size()) {
       verr.SetError(EINVAL, "cannot delete symlink for invalid drive %d", drv);
       return EINVAL;
    }
+   return UnlinkDriveSymlink(drv);
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to delete the symlink for drive number 'drv' if the
+ *  work directory has one, whether or not the drive exists.
+ *  On success returns zero, else on error sets lasterr and
+ *  returns errno.
+ *-------------------------------------------------*/
+int DiskChanger::UnlinkDriveSymlink(int drv)
+{
+   int rc;
+   tString sname;
+
    /* Remove symlink pointing to loaded volume file */
-   tFormat(sname, "%s%s%d", conf.work_dir.c_str(), DIR_DELIM, drv);
-   if (unlink(sname.c_str())) {
+   if (drive_links.find(drv) == drive_links.end()) return 0;
+   drive_links.erase(drv);
+   drive_link_name(sname, work_dfd, drv);
+#ifdef HAVE_LINKAT_FUNCS
+   if (work_dfd >= 0) rc = unlinkat(work_dfd, sname.c_str(), 0);
+   else
+#endif
+   rc = unlink(sname.c_str());
+   if (rc) {
       if (errno == ENOENT) return 0;  /* Ignore if not found */
       /* System error preventing deletion of symlink */
       rc = errno;
@@ -557,26 +1014,36 @@ int DiskChanger::RestoreDriveState(int drv)
  *  On success, returns zero. On error, returns negative.
  *  In either case, obtains a lock on the changer unless the lock operation
  *  itself fails. The lock will be released when the DiskChanger object
- *  is destroyed.
+ *  is destroyed. Slots found to need an 'update slots' are kept when the
+ *  changer is initialized again, since the state saved by the earlier
+ *  initialization no longer shows them, and are only cleared once
+ *  UpdateBacula() has updated them.
  *------------------------------------------------*/
 int DiskChanger::Initialize()
 {
    /* Make sure we have a lock on this changer */
    if (Lock()) return verr.GetError();
+#ifdef HAVE_LINKAT_FUNCS
+   /* Drive symlinks are updated relative to the open work directory */
+   if (work_dfd < 0) work_dfd = open(conf.work_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif
    magazine.clear();
    vslot.clear();
    drive.clear();
    dconf.restore();
-   needs_update = false;
 
    /* Initialize array of mounted magazines */
    InitializeMagazines();
 
    /* Initialize array of virtual slots */
+   PhaseTimer vslots_timer("vslots");
    InitializeVirtSlots();
+   vslots_timer.Stop();
 
    /* Initialize array of virtual drives */
+   PhaseTimer drives_timer("drives");
    if (InitializeDrives()) return verr.GetError();
+   drives_timer.Stop();
 
    return 0;
 }
@@ -613,7 +1080,7 @@ int DiskChanger::LoadDrive(int drv, int slot)
       log.Error("ERROR! %s", verr.GetErrorMsg());
       return EBUSY;
    }
-   if (vslot[slot].empty()) {
+   if (SlotEmpty(slot)) {
       verr.SetError(EINVAL, "cannot load drive %d from empty slot %d", drv, slot);
       log.Error("ERROR! %s", verr.GetErrorMsg());
       return ENOENT;
@@ -638,6 +1105,7 @@ int DiskChanger::LoadDrive(int drv, int slot)
    m = vslot[slot].mag_bay;
    ms = vslot[slot].mag_slot;
    log.Notice("loaded drive %d from slot %d (%s)", drv, slot, magazine[m].GetVolumeLabel(ms));
+   StateChanged();
    return 0;
 }
 
@@ -681,121 +1149,919 @@ int DiskChanger::UnloadDrive(int drv)
       return rc;
    }
    log.Notice("unloaded drive %d", drv);
+   StateChanged();
    return 0;
 }
 
 
 /*-------------------------------------------------
- *  Method to create new volume files in virtual slots 'slot1' through 'slot2'.
- *  Use volume labels (barcodes) of the form prefix + '_' + mag_slot_number, where
- *  mag_slot_number is the magazine relative slot number of the magazine slot that
- *  the virtual slot maps to. If 'label_prefix' is blank, then use the magazine name
- *  of the magazine the virtual slot is mapped onto as the prefix.
- *  Returns zero on success, else returns negative and sets lasterr.
+ *  Method to move the volume in virtual slot 'src' to the empty virtual
+ *  slot 'dst'. The destination must be an empty slot of a mounted magazine
+ *  or the slot following the last slot of a mounted magazine. The volume
+ *  file is renamed when the magazines share a filesystem, else it is
+ *  copied, by reflink or by the kernel where possible, and the original
+ *  removed. The slot maps of both magazines are updated and both slots
+ *  are marked for 'update slots'.
+ *  On success, returns zero. Otherwise sets lasterr and returns errno.
  *------------------------------------------------*/
-int DiskChanger::CreateVolumes(int bay, int count, int start, const char *label_prefix_in)
+int DiskChanger::TransferVolume(int src, int dst)
 {
-   MagazineSlot vol;
-   tString label, label_prefix(label_prefix_in);
-   int i;
+   int rc, m, ms, dm, dms;
+   tString label, from, to;
 
    if (!changer_lock) {
       verr.SetError(EINVAL, "changer not initialized");
       log.Error("ERROR! %s", verr.GetErrorMsg());
-      return -1;
+      return EINVAL;
    }
-   if (bay < 0 || bay >= (int)magazine.size()) {
-      verr.SetError(EINVAL, "invalid magazine");
+   if (src < 1 || src >= (int)vslot.size() || SlotEmpty(src)) {
+      verr.SetError(EINVAL, "cannot transfer from empty slot %d", src);
       log.Error("ERROR! %s", verr.GetErrorMsg());
-      return -1;
+      return EINVAL;
    }
-   if (count < 1) count = 1;
-   tStrip(tRemoveEOL(label_prefix));
-   if (label_prefix.empty()) {
-      /* Default prefix is storage-name_magazine-number */
-      tFormat(label_prefix, "%s_%d", conf.storage_name.c_str(), bay);
+   if (dst < 1 || !SlotEmpty(dst)) {
+      verr.SetError(EINVAL, "cannot transfer to slot %d, slot is not empty", dst);
+      log.Error("ERROR! %s", verr.GetErrorMsg());
+      return EINVAL;
    }
-   if (start < 0) {
-      /* Find highest uniqueness number for this filename prefix */
-      for (i = magazine[bay].num_slots * 5; i > 0; i--) {
-         tFormat(label, "%s_%d", label_prefix.c_str(), i);
-         if (magazine[bay].GetVolumeSlot(label) >= 0) break;
-      }
-      start = i;
+   if (vslot[src].drv >= 0) {
+      verr.SetError(EBUSY, "cannot transfer slot %d, volume is loaded in drive %d", src, vslot[src].drv);
+      log.Error("ERROR! %s", verr.GetErrorMsg());
+      return EBUSY;
    }
-   for (i = 0; i < count; i++) {
-      tFormat(label, "%s_%d", label_prefix.c_str(), start);
-      if (!magazine[bay].empty()) {
-         while (magazine[bay].GetVolumeSlot(label) >= 0) {
-            ++start;
-            tFormat(label, "%s_%d", label_prefix.c_str(), start);
-         }
+   m = vslot[src].mag_bay;
+   ms = vslot[src].mag_slot;
+   /* Find the magazine and magazine slot that will hold the volume */
+   if (dst < (int)vslot.size() && vslot[dst].mag_bay >= 0) {
+      dm = vslot[dst].mag_bay;
+      dms = vslot[dst].mag_slot;
+   } else {
+      for (dm = 0; dm < (int)magazine.size(); dm++) {
+         if (!magazine[dm].empty() && magazine[dm].start_slot > 0
+               && magazine[dm].start_slot + magazine[dm].num_slots == dst) break;
       }
-      fprintf(stdout, "creating label '%s'\n", label.c_str());
-      if (magazine[bay].CreateVolume(label)) {
-         if (i) magazine[bay].save();
-         return -1;
+      if (dm >= (int)magazine.size() || !SlotRangeAvailable(dm, dst, dst)) {
+         verr.SetError(EINVAL, "cannot transfer to slot %d, slot is not in a mounted magazine", dst);
+         log.Error("ERROR! %s", verr.GetErrorMsg());
+         return EINVAL;
+      }
+      dms = magazine[dm].num_slots;
+   }
+   label = magazine[m].GetVolumeLabel(ms);
+   if (dm != m) {
+      /* Move the volume file to the destination magazine */
+      magazine[m].GetVolumePath(from, ms);
+      tFormat(to, "%s%s%s", magazine[dm].mountpoint.c_str(), DIR_DELIM, label.c_str());
+      TraceSpan span("transfer", dm);
+      rc = file_move(to.c_str(), from.c_str());
+      if (rc) {
+         verr.SetErrorWithErrno(rc, "error %d moving volume %s from magazine %d to magazine %d",
+               rc, label.c_str(), m, dm);
+         log.Error("ERROR! %s", verr.GetErrorMsg());
+         return rc;
       }
-      ++start;
    }
-   /* Update magazine state */
-   magazine[bay].save();
-   /* New mag state will require 'update slots' and 'label barcodes' in Bacula */
-   needs_update = true;
-   needs_label = true;
-   log.Notice("update slots needed. %d volumes added to magazine %d",count , bay);
+   /* Empty the source magazine slot and place the volume in the destination */
+   magazine[m].SetSlotVolume(ms, "");
+   magazine[dm].SetSlotVolume(dms, label);
+   if (dms == magazine[dm].num_slots - 1) AssignMagazineSlots(dm, magazine[dm].start_slot);
+   update_slots.Add(src);
+   update_slots.Add(dst);
+   if ((int)vslot.size() - 1 > dconf.max_slot) {
+      dconf.max_slot = (int)vslot.size() - 1;
+   }
+   magazine[m].save();
+   if (dm != m) magazine[dm].save();
+   log.Notice("transferred volume %s from slot %d to slot %d", label.c_str(), src, dst);
+   StateChanged();
    return 0;
 }
 
+
 /*-------------------------------------------------
- *  Method to cause Bacula to update its catalog to reflect
- *  changes in the available volumes
- *-------------------------------------------------*/
-int DiskChanger::UpdateBacula()
+ *  Method to create new volume files on each of the magazines in 'bays',
+ *  where 'counts' gives the number of volumes to create on each. Use volume labels (barcodes) of the form prefix + '_' + number,
+ *  where number is a uniqueness number of at least 'start', or greater than
+ *  the highest number already used if 'start' is negative. If 'label_prefix'
+ *  is blank, then the prefix is the storage name + '_' + magazine number.
+ *  When several magazines share a given prefix, each magazine uses every
+ *  n'th number so that labels are unique across the magazines. Volumes are
+ *  created on each magazine in a thread of its own, and the changer state
+ *  is saved once after all magazines are done.
+ *  Returns zero on success, else returns negative and sets lasterr.
+ *------------------------------------------------*/
+int DiskChanger::CreateVolumes(const std::vector<int> &bays, const std::vector<int> &counts,
+      int start, const char *label_prefix_in)
 {
-   int rc;
-   FILE *update_lock;
-   tString cmd;
-   char lockfile[4096];
+   std::vector<CreateVolumesJob> job(bays.size());
+#ifdef HAVE_PTHREAD_H
+   std::vector<pthread_t> thread(bays.size());
+#endif
+   std::vector<bool> threaded(bays.size(), false);
+   std::set<int> used;
+   tString label_prefix(label_prefix_in);
+   int i, bay, highest = -1, total = 0, failed = -1;
 
-   /* Check if update needed */
-   if (!needs_update && !needs_label) return 0; /* Nothing to do */
-   /* Create update lock lockfile */
-   snprintf(lockfile, sizeof(lockfile), "%s%s%s.updatelock", conf.work_dir.c_str(), DIR_DELIM,
-         conf.storage_name.c_str());
-   rc = exclusive_fopen(lockfile, &update_lock);
-   if (rc == EEXIST) {
-      /* Update already in progress in another process, so skip */
-      return 0;
+   if (!changer_lock) {
+      verr.SetError(EINVAL, "changer not initialized");
+      log.Error("ERROR! %s", verr.GetErrorMsg());
+      return -1;
    }
-   if (rc) {
-      /* error creating lockfile, so skip */
-      log.Error("bconsole: errno=%d creating update lockfile", rc);
-      if (needs_update)
-         log.Error("WARNING! 'update slots' needed in bconsole");
-      if (needs_label)
-         log.Error("WARNING! 'label barcodes' needed in bconsole");
-      return 0;
+   if (bays.empty() || counts.size() != bays.size()) {
+      verr.SetError(EINVAL, "no magazine given");
+      log.Error("ERROR! %s", verr.GetErrorMsg());
+      return -1;
    }
-   log.Debug("created update lockfile for pid %d", getpid());
-   /* Perform update slots command in bconsole */
-   if (needs_update) {
-      /* Issue update slots command in bconsole */
-      tFormat(cmd, "update slots storage=\"%s\"", conf.storage_name.c_str());
-      if(issue_bconsole_command(cmd.c_str())) {
-         log.Error("WARNING! 'update slots' needed in bconsole");
+   for (i = 0; i < (int)bays.size(); i++) {
+      bay = bays[i];
+      if (bay < 0 || bay >= (int)magazine.size()) {
+         verr.SetError(EINVAL, "invalid magazine");
+         log.Error("ERROR! %s", verr.GetErrorMsg());
+         return -1;
+      }
+      if (magazine[bay].empty()) {
+         verr.SetError(ENOENT, "magazine %d is not mounted", bay);
+         log.Error("ERROR! %s", verr.GetErrorMsg());
+         return -1;
       }
    }
-   /* Perform label barcodes command in bconsole */
-   if (needs_label) {
-      tFormat(cmd, "label storage=\"%s\" pool=\"%s\" barcodes\nyes\nyes\n", conf.storage_name.c_str(),
-            conf.def_pool.c_str());
-      if (issue_bconsole_command(cmd.c_str())) {
-         log.Error("WARNING! 'label barcodes' needed in bconsole");
+   if (CheckVolumeSpace(bays, counts)) return -1;
+   tStrip(tRemoveEOL(label_prefix));
+   if (!label_prefix.empty()) {
+      /* Numbers used with the given prefix on any of the magazines are skipped */
+      for (i = 0; i < (int)bays.size(); i++) {
+         highest = std::max(highest, magazine[bays[i]].GetVolumeNumbers(label_prefix, used));
       }
    }
-   /* Obtain changer lock before removing update lock */
-   fclose(update_lock);
+   for (i = 0; i < (int)bays.size(); i++) {
+      bay = bays[i];
+      job[i].mag = &magazine[bay];
+      job[i].count = std::max(counts[i], 1);
+      job[i].prev_num = magazine[bay].num_slots;
+      if (label_prefix.empty()) {
+         /* Default prefix is storage-name_magazine-number */
+         tFormat(job[i].prefix, "%s_%d", conf.storage_name.c_str(), bay);
+         highest = magazine[bay].GetVolumeNumbers(job[i].prefix, job[i].used);
+         job[i].start = start < 0 ? highest + 1 : start;
+      } else {
+         job[i].prefix = label_prefix;
+         job[i].used = used;
+         job[i].start = (start < 0 ? highest + 1 : start) + i;
+         job[i].stride = (int)bays.size();
+      }
+   }
+   /* Create the volumes, with a thread for each magazine after the first.
+    * Without threads, the magazines are done one after another. */
+#ifdef HAVE_PTHREAD_H
+   for (i = 1; i < (int)bays.size(); i++) {
+      if (pthread_create(&thread[i], NULL, create_volumes_thread, &job[i]) == 0) {
+         threaded[i] = true;
+      }
+   }
+#endif
+   job[0].Run();
+   for (i = 1; i < (int)bays.size(); i++) {
+      if (threaded[i]) {
+#ifdef HAVE_PTHREAD_H
+         pthread_join(thread[i], NULL);
+#endif
+      } else job[i].Run();
+   }
+   for (i = 0; i < (int)bays.size(); i++) {
+      bay = bays[i];
+      total += job[i].created;
+      if (job[i].rc && failed < 0) failed = i;
+      if (!job[i].created) continue;
+      AssignAppendedSlots(bay, job[i].prev_num);
+      /* Update magazine state */
+      magazine[bay].save();
+      log.Notice("update slots needed. %d volumes added to magazine %d", job[i].created, bay);
+   }
+   if (total) {
+      if ((int)vslot.size() - 1 > dconf.max_slot) {
+         dconf.max_slot = (int)vslot.size() - 1;
+      }
+      StateChanged();
+      /* New mag state will require 'update slots' and 'label barcodes' in Bacula */
+      needs_label = true;
+   }
+   if (failed >= 0) {
+      verr.SetError(job[failed].mag->verr.GetError(), "%s", job[failed].mag->verr.GetErrorMsg());
+      return -1;
+   }
+   return 0;
+}
+
+/*-------------------------------------------------
+ *  Protected method to plan the volume moves that even out the fraction of
+ *  free space on the filesystems holding the mounted magazines. Volumes are
+ *  repeatedly moved, largest first, from the filesystem with the least free
+ *  space to the one with the most, as long as the move does not leave the
+ *  receiving filesystem with less free space than the one giving it up.
+ *  Volumes loaded in a drive and unused volumes are never moved. Fast-tier
+ *  magazines are left out, since their volumes are migrated instead. On
+ *  return, 'moves' holds the volumes to move.
+ *  Returns the number of volumes to move, or negative on error and sets
+ *  lasterr.
+ *------------------------------------------------*/
+int DiskChanger::PlanRebalance(VolumeMoveArray &moves)
+{
+   int m, ms, v;
+   size_t f, lo, hi, n;
+   long long avail, total;
+   struct stat st;
+   tString path;
+   VolumeMove mv;
+   std::vector<RebalanceFs> fs;
+
+   if (!changer_lock) {
+      verr.SetError(EINVAL, "changer not initialized");
+      log.Error("ERROR! %s", verr.GetErrorMsg());
+      return -1;
+   }
+   moves.clear();
+   for (m = 0; m < (int)magazine.size(); m++) {
+      if (magazine[m].empty() || FastTier(m) || stat(magazine[m].mountpoint.c_str(), &st)) continue;
+      if (GetMagazineSpace(m, avail, total) || total <= 0) continue;
+      for (f = 0; f < fs.size() && fs[f].dev != st.st_dev; f++) ;
+      if (f >= fs.size()) {
+         fs.push_back(RebalanceFs());
+         fs[f].dev = st.st_dev;
+         fs[f].avail = avail;
+         fs[f].total = total;
+         fs[f].bay = m;
+      }
+      for (ms = 0; ms < magazine[m].num_slots; ms++) {
+         if (magazine[m].mslot[ms].empty()) continue;
+         v = magazine[m].start_slot + ms;
+         if (magazine[m].start_slot > 0 && v < (int)vslot.size() && vslot[v].drv >= 0) continue;
+         if (stat(magazine[m].GetVolumePath(path, ms), &st) || st.st_size < FREE_VOLUME_SIZE) continue;
+         mv.src_bay = m;
+         mv.src_slot = ms;
+         mv.size = (long long)st.st_size;
+         mv.mtime = st.st_mtime;
+         mv.label = magazine[m].GetVolumeLabel(ms);
+         fs[f].vols.push_back(mv);
+      }
+   }
+   for (f = 0; f < fs.size(); f++) {
+      std::sort(fs[f].vols.begin(), fs[f].vols.end(), volume_move_larger);
+   }
+   while (fs.size() > 1) {
+      lo = hi = fs.size();
+      for (f = 0; f < fs.size(); f++) {
+         if (!fs[f].vols.empty() && (lo >= fs.size() || fs[f].Free() < fs[lo].Free())) lo = f;
+         if (hi >= fs.size() || fs[f].Free() > fs[hi].Free()) hi = f;
+      }
+      if (lo >= fs.size() || lo == hi) break;
+      for (n = 0; n < fs[lo].vols.size(); n++) {
+         if ((double)(fs[hi].avail - fs[lo].vols[n].size) / (double)fs[hi].total
+               >= (double)(fs[lo].avail + fs[lo].vols[n].size) / (double)fs[lo].total) break;
+      }
+      if (n >= fs[lo].vols.size()) break;
+      mv = fs[lo].vols[n];
+      mv.dst_bay = fs[hi].bay;
+      moves.push_back(mv);
+      fs[lo].avail += mv.size;
+      fs[hi].avail -= mv.size;
+      fs[lo].vols.erase(fs[lo].vols.begin() + n);
+   }
+   return (int)moves.size();
+}
+
+
+/*-------------------------------------------------
+ *  Method to copy the volumes of the rebalance 'moves' to the staging
+ *  directories of their destination magazines. Up to 'Rebalance Jobs'
+ *  volumes are copied at once, each filesystem taking part in one copy at
+ *  a time, and the data copied is limited to 'Rebalance Bandwidth' bytes
+ *  per second. The changer need not be locked, and the moves are completed
+ *  by CommitStagedMoves().
+ *  Returns the number of volumes staged.
+ *------------------------------------------------*/
+int DiskChanger::StageRebalance(VolumeMoveArray &moves)
+{
+   int i, jobs, staged = 0;
+   long long rate;
+   struct stat st;
+#ifdef HAVE_PTHREAD_H
+   std::vector<pthread_t> thread;
+#endif
+
+   if (moves.empty()) return 0;
+   jobs = std::min(conf.rebalance_jobs, (int)moves.size());
+   rate = conf.rebalance_rate > 0 ? std::max(conf.rebalance_rate / jobs, 1LL) : 0;
+   RebalanceRunner runner(moves, *this, rate);
+   for (i = 0; i < (int)moves.size(); i++) {
+      if (!stat(magazine[moves[i].src_bay].mountpoint.c_str(), &st)) runner.src_dev[i] = st.st_dev;
+      if (!stat(magazine[moves[i].dst_bay].mountpoint.c_str(), &st)) runner.dst_dev[i] = st.st_dev;
+   }
+   log.Notice("staging %d volumes with %d jobs", (int)moves.size(), jobs);
+   /* Run the moves, with a thread for each job after the first. Without
+    * threads, the moves are done one after another. */
+#ifdef HAVE_PTHREAD_H
+   thread.resize(jobs);
+   for (i = 1; i < jobs; i++) {
+      if (pthread_create(&thread[i], NULL, rebalance_thread, &runner)) break;
+   }
+   jobs = i;
+#else
+   jobs = 1;
+#endif
+   runner.Run();
+#ifdef HAVE_PTHREAD_H
+   for (i = 1; i < jobs; i++) pthread_join(thread[i], NULL);
+#endif
+   for (i = 0; i < (int)moves.size(); i++) {
+      if (!moves[i].rc) ++staged;
+   }
+   return staged;
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to update the slot maps for the volumes in 'moves'
+ *  whose files have been moved, that is those whose 'rc' is zero. Each
+ *  volume is removed from its source magazine slot and appended to its
+ *  destination magazine, and the magazines changed are saved.
+ *  Returns the number of volumes moved.
+ *------------------------------------------------*/
+int DiskChanger::CommitVolumeMoves(const VolumeMoveArray &moves)
+{
+   int i, moved = 0;
+   std::vector<int> prev_num;
+   std::vector<bool> touched(magazine.size(), false);
+
+   for (i = 0; i < (int)magazine.size(); i++) prev_num.push_back(magazine[i].num_slots);
+   for (i = 0; i < (int)moves.size(); i++) {
+      if (moves[i].rc) continue;
+      update_slots.Add(magazine[moves[i].src_bay].start_slot + moves[i].src_slot);
+      magazine[moves[i].src_bay].SetSlotVolume(moves[i].src_slot, "");
+      magazine[moves[i].dst_bay].SetSlotVolume((int)magazine[moves[i].dst_bay].mslot.size(), moves[i].label);
+      touched[moves[i].src_bay] = touched[moves[i].dst_bay] = true;
+      ++moved;
+   }
+   for (i = 0; i < (int)magazine.size(); i++) {
+      if (!touched[i]) continue;
+      AssignAppendedSlots(i, prev_num[i]);
+      magazine[i].save();
+   }
+   if (moved) {
+      if ((int)vslot.size() - 1 > dconf.max_slot) {
+         dconf.max_slot = (int)vslot.size() - 1;
+      }
+      StateChanged();
+   }
+   return moved;
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to determine if magazine 'mag' is on the fast tier
+ *-------------------------------------------------*/
+bool DiskChanger::FastTier(int mag) const
+{
+   return mag >= 0 && mag < (int)conf.mag_opts.size() && conf.mag_opts[mag].tier == TIER_FAST;
+}
+
+
+/*-------------------------------------------------
+ *  Method to determine if volumes are to be migrated from mounted fast-tier
+ *  magazines to slow-tier magazines.
+ *-------------------------------------------------*/
+bool DiskChanger::MigrationConfigured() const
+{
+   int n;
+   if (conf.migrate_after <= 0) return false;
+   for (n = 0; n < (int)magazine.size(); n++) {
+      if (!magazine[n].empty() && FastTier(n)) return true;
+   }
+   return false;
+}
+
+
+/*-------------------------------------------------
+ *  Method to plan the migration of volumes from the mounted fast-tier
+ *  magazines to the mounted slow-tier magazines. A volume is migrated once
+ *  its file has not been modified for 'Migrate After' minutes, and only
+ *  if it is not loaded in a drive. Each volume goes to the slow-tier
+ *  magazine on another filesystem having the most free space left. On
+ *  return, 'moves' holds the volumes to migrate.
+ *  Returns the number of volumes to migrate, or negative on error and sets
+ *  lasterr.
+ *------------------------------------------------*/
+int DiskChanger::PlanMigration(VolumeMoveArray &moves)
+{
+   int m, ms, v, n, best;
+   long long avail, total;
+   time_t now = time(NULL);
+   struct stat st;
+   tString path;
+   VolumeMove mv;
+   std::vector<int> slow;
+   std::vector<dev_t> dev;
+   std::map<dev_t, long long> left;
+
+   if (!changer_lock) {
+      verr.SetError(EINVAL, "changer not initialized");
+      log.Error("ERROR! %s", verr.GetErrorMsg());
+      return -1;
+   }
+   moves.clear();
+   for (m = 0; m < (int)magazine.size(); m++) {
+      if (magazine[m].empty() || FastTier(m)) continue;
+      if (stat(magazine[m].mountpoint.c_str(), &st) || GetMagazineSpace(m, avail, total)) continue;
+      slow.push_back(m);
+      dev.push_back(st.st_dev);
+      left[st.st_dev] = avail;
+   }
+   if (slow.empty()) return 0;
+   for (m = 0; m < (int)magazine.size(); m++) {
+      if (magazine[m].empty() || !FastTier(m) || stat(magazine[m].mountpoint.c_str(), &st)) continue;
+      for (ms = 0; ms < magazine[m].num_slots; ms++) {
+         if (magazine[m].mslot[ms].empty()) continue;
+         v = magazine[m].start_slot + ms;
+         if (magazine[m].start_slot > 0 && v < (int)vslot.size() && vslot[v].drv >= 0) continue;
+         if (stat(magazine[m].GetVolumePath(path, ms), &st) || st.st_size < FREE_VOLUME_SIZE) continue;
+         if (now - st.st_mtime < (time_t)conf.migrate_after * 60) continue;
+         best = -1;
+         for (n = 0; n < (int)slow.size(); n++) {
+            if (dev[n] == st.st_dev || left[dev[n]] < (long long)st.st_size) continue;
+            if (best < 0 || left[dev[n]] > left[dev[best]]) best = n;
+         }
+         if (best < 0) {
+            log.Warning("no slow-tier magazine has room for volume %s (%lld bytes)",
+                  magazine[m].GetVolumeLabel(ms), (long long)st.st_size);
+            continue;
+         }
+         mv.src_bay = m;
+         mv.src_slot = ms;
+         mv.dst_bay = slow[best];
+         mv.size = (long long)st.st_size;
+         mv.mtime = st.st_mtime;
+         mv.label = magazine[m].GetVolumeLabel(ms);
+         left[dev[best]] -= mv.size;
+         moves.push_back(mv);
+      }
+   }
+   return (int)moves.size();
+}
+
+
+/*-------------------------------------------------
+ *  Method to copy the volume of move 'mv' to the staging directory on the
+ *  filesystem of its destination magazine, preserving its ownership,
+ *  permissions and modification time. The copy is limited to 'rate' bytes
+ *  per second, or is unlimited if 'rate' is zero. The changer need not be
+ *  locked, and the slot maps are not changed until CommitStagedMoves() is
+ *  called. Several threads may stage moves at once.
+ *  On success returns zero, else sets mv.rc and returns errno.
+ *------------------------------------------------*/
+int DiskChanger::StageVolumeMove(VolumeMove &mv, long long rate)
+{
+   tString dir, from, to;
+
+   tFormat(dir, "%s%s%s", magazine[mv.dst_bay].mountpoint.c_str(), DIR_DELIM, MIGRATE_STAGING_DIR);
+#ifndef HAVE_WINDOWS_H
+   if (mkdir(dir.c_str(), 0750) && errno != EEXIST) {
+#else
+   if (_mkdir(dir.c_str()) && errno != EEXIST) {
+#endif
+      mv.rc = errno;
+      log.Error("ERROR! error %d creating staging directory %s", mv.rc, dir.c_str());
+      return mv.rc;
+   }
+   magazine[mv.src_bay].GetVolumePath(from, mv.src_slot);
+   tFormat(to, "%s%s%s", dir.c_str(), DIR_DELIM, mv.label.c_str());
+   /* Remove a copy left by a move that was interrupted */
+   unlink(to.c_str());
+   TraceSpan span("stage", mv.dst_bay);
+   span.SetArg("bytes", (long)mv.size);
+   mv.rc = file_copy(to.c_str(), from.c_str(), rate);
+   span.Stop();
+   if (mv.rc) {
+      log.Error("ERROR! error %d staging volume %s on magazine %d", mv.rc, mv.label.c_str(), mv.dst_bay);
+      return mv.rc;
+   }
+   mv.staged = to;
+   log.Info("staged volume %s on magazine %d (%lld bytes)", mv.label.c_str(), mv.dst_bay, mv.size);
+   return 0;
+}
+
+
+/*-------------------------------------------------
+ *  Method to complete the moves in 'moves' that were staged. The changer
+ *  must have been initialized again after staging. A volume that is now
+ *  loaded in a drive, or whose file was modified while it was being staged,
+ *  is left on its source magazine and its staged copy removed, to be moved
+ *  later, and its 'rc' is set to EBUSY or EAGAIN. If the volume or either
+ *  magazine is no longer available, the move is skipped and its 'rc' is set
+ *  to ENOENT. Otherwise the staged copy
+ *  is renamed into the destination magazine, the original removed, and the
+ *  slot maps updated.
+ *  Returns the number of volumes moved, or negative on error and sets
+ *  lasterr.
+ *------------------------------------------------*/
+int DiskChanger::CommitStagedMoves(VolumeMoveArray &moves)
+{
+   int i, ms, v;
+   struct stat st;
+   tString staged, from, to;
+
+   if (!changer_lock) {
+      verr.SetError(EINVAL, "changer not initialized");
+      log.Error("ERROR! %s", verr.GetErrorMsg());
+      return -1;
+   }
+   for (i = 0; i < (int)moves.size(); i++) {
+      VolumeMove &mv = moves[i];
+      if (mv.rc) continue;
+      tFormat(staged, "%s%s%s%s%s", magazine[mv.dst_bay].mountpoint.c_str(), DIR_DELIM,
+            MIGRATE_STAGING_DIR, DIR_DELIM, mv.label.c_str());
+      /* Slots may have been reassigned while the volume was being staged */
+      ms = magazine[mv.src_bay].empty() ? -1 : magazine[mv.src_bay].GetVolumeSlot(mv.label);
+      if (ms < 0 || magazine[mv.dst_bay].empty()) {
+         mv.rc = ENOENT;
+      } else {
+         mv.src_slot = ms;
+         v = magazine[mv.src_bay].start_slot + ms;
+         if (magazine[mv.src_bay].start_slot > 0 && v < (int)vslot.size() && vslot[v].drv >= 0) {
+            mv.rc = EBUSY;
+         } else if (stat(magazine[mv.src_bay].GetVolumePath(from, ms), &st)
+               || (long long)st.st_size != mv.size || st.st_mtime != mv.mtime) {
+            mv.rc = EAGAIN;
+         }
+      }
+      if (mv.rc == ENOENT) {
+         log.Info("volume %s or its magazine is no longer available, move skipped", mv.label.c_str());
+         unlink(staged.c_str());
+         continue;
+      }
+      if (mv.rc) {
+         log.Info("volume %s changed while being staged, move deferred", mv.label.c_str());
+         unlink(staged.c_str());
+         continue;
+      }
+      tFormat(to, "%s%s%s", magazine[mv.dst_bay].mountpoint.c_str(), DIR_DELIM, mv.label.c_str());
+      if (access(to.c_str(), F_OK) == 0) mv.rc = EEXIST;
+      else if (rename(staged.c_str(), to.c_str())) mv.rc = errno;
+      else if (unlink(from.c_str())) {
+         /* Do not leave the volume in both magazines */
+         mv.rc = errno;
+         rename(to.c_str(), staged.c_str());
+      }
+      if (mv.rc) {
+         log.Error("ERROR! error %d moving volume %s from magazine %d to magazine %d", mv.rc,
+               mv.label.c_str(), mv.src_bay, mv.dst_bay);
+         unlink(staged.c_str());
+         continue;
+      }
+      log.Notice("moved volume %s from magazine %d to magazine %d (%lld bytes)", mv.label.c_str(),
+            mv.src_bay, mv.dst_bay, mv.size);
+   }
+   return CommitVolumeMoves(moves);
+}
+
+
+/*-------------------------------------------------
+ *  Method to remove the staged copies of the moves in 'moves' when they
+ *  cannot be completed, such as when the changer could not be initialized
+ *  again after staging. The moves are left with 'rc' set to ECANCELED.
+ *------------------------------------------------*/
+void DiskChanger::DiscardStagedMoves(VolumeMoveArray &moves)
+{
+   size_t i;
+
+   for (i = 0; i < moves.size(); i++) {
+      if (moves[i].staged.empty()) continue;
+      if (!moves[i].rc) moves[i].rc = ECANCELED;
+      if (unlink(moves[i].staged.c_str()) == 0) {
+         log.Info("removed staged copy of volume %s", moves[i].label.c_str());
+      }
+      moves[i].staged.clear();
+   }
+}
+
+
+/*-------------------------------------------------
+ *  Method to get the space of the filesystem holding mounted magazine 'mag'
+ *  in 'avail' and 'total' bytes.
+ *  On success returns zero, else returns errno.
+ *-------------------------------------------------*/
+int DiskChanger::GetMagazineSpace(int mag, long long &avail, long long &total) const
+{
+   avail = total = 0;
+   if (mag < 0 || mag >= (int)magazine.size() || magazine[mag].empty()) return ENOENT;
+   return fs_space(magazine[mag].mountpoint.c_str(), &avail, &total);
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to check that 'counts[i]' volumes of the expected
+ *  volume size will fit on magazine 'bays[i]', for each magazine. The
+ *  volumes of magazines on the same filesystem must fit together.
+ *  Magazines without a known volume size are not checked.
+ *  Returns zero if the volumes will fit, else sets lasterr and returns
+ *  negative.
+ *-------------------------------------------------*/
+int DiskChanger::CheckVolumeSpace(const std::vector<int> &bays, const std::vector<int> &counts)
+{
+   int i, bay;
+   long long vsize, avail, total;
+   struct stat st;
+   std::map<dev_t, long long> needed;
+
+   for (i = 0; i < (int)bays.size(); i++) {
+      bay = bays[i];
+      vsize = bay < (int)conf.mag_opts.size() ? conf.mag_opts[bay].VolumeSize() : 0;
+      if (vsize <= 0 || stat(magazine[bay].mountpoint.c_str(), &st)) continue;
+      if (GetMagazineSpace(bay, avail, total)) continue;
+      needed[st.st_dev] += vsize * std::max(counts[i], 1);
+      if (needed[st.st_dev] > avail) {
+         verr.SetError(ENOSPC, "%d volumes of %lld bytes will not fit in the %lld bytes free on magazine %d",
+               std::max(counts[i], 1), vsize, avail, bay);
+         log.Error("ERROR! %s", verr.GetErrorMsg());
+         return -1;
+      }
+   }
+   return 0;
+}
+
+
+/*-------------------------------------------------
+ *  Method to choose the mounted magazines on which to create 'count' new
+ *  volumes so that the free space of the magazines is kept balanced. Each
+ *  volume is placed on the magazine whose filesystem will have the most
+ *  free space left, using the expected volume size of each magazine.
+ *  Magazines without a known volume size are not used. Fast-tier magazines
+ *  are filled before slow-tier magazines are used. On return, 'bays'
+ *  holds the magazines chosen and 'counts' the number of volumes for each.
+ *  Returns zero on success, else sets lasterr and returns negative if the
+ *  volumes will not fit.
+ *-------------------------------------------------*/
+int DiskChanger::PlaceVolumes(int count, std::vector<int> &bays, std::vector<int> &counts)
+{
+   int i, n, best;
+   long long avail, total;
+   struct stat st;
+   std::vector<int> cand, placed;
+   std::vector<bool> fast;
+   std::vector<dev_t> dev;
+   std::vector<long long> vsize;
+   std::map<dev_t, long long> left;
+
+   bays.clear();
+   counts.clear();
+   for (n = 0; n < (int)magazine.size() && n < (int)conf.mag_opts.size(); n++) {
+      if (magazine[n].empty() || conf.mag_opts[n].VolumeSize() <= 0) continue;
+      if (stat(magazine[n].mountpoint.c_str(), &st) || GetMagazineSpace(n, avail, total)) continue;
+      cand.push_back(n);
+      fast.push_back(FastTier(n));
+      dev.push_back(st.st_dev);
+      vsize.push_back(conf.mag_opts[n].VolumeSize());
+      left[st.st_dev] = avail;
+   }
+   if (cand.empty()) {
+      verr.SetError(EINVAL, "no mounted magazine has a known volume size");
+      log.Error("ERROR! %s", verr.GetErrorMsg());
+      return -1;
+   }
+   placed.assign(cand.size(), 0);
+   for (i = 0; i < count; i++) {
+      best = -1;
+      for (n = 0; n < (int)cand.size(); n++) {
+         if (left[dev[n]] < vsize[n]) continue;
+         if (best >= 0 && fast[best] != fast[n]) {
+            if (fast[n]) best = n;
+            continue;
+         }
+         if (best < 0 || left[dev[n]] - vsize[n] > left[dev[best]] - vsize[best]
+               || (left[dev[n]] - vsize[n] == left[dev[best]] - vsize[best] && placed[n] < placed[best])) {
+            best = n;
+         }
+      }
+      if (best < 0) {
+         verr.SetError(ENOSPC, "only %d of %d volumes will fit on the mounted magazines", i, count);
+         log.Error("ERROR! %s", verr.GetErrorMsg());
+         return -1;
+      }
+      left[dev[best]] -= vsize[best];
+      ++placed[best];
+   }
+   for (n = 0; n < (int)cand.size(); n++) {
+      if (!placed[n]) continue;
+      bays.push_back(cand[n]);
+      counts.push_back(placed[n]);
+      log.Info("placing %d volumes on magazine %d", placed[n], cand[n]);
+   }
+   return 0;
+}
+
+
+/*-------------------------------------------------
+ *  Method to determine if any mounted magazine has a minimum number of
+ *  unused volumes to maintain.
+ *-------------------------------------------------*/
+bool DiskChanger::PrecreateConfigured() const
+{
+   int n;
+   for (n = 0; n < (int)magazine.size() && n < (int)conf.mag_opts.size(); n++) {
+      if (!magazine[n].empty() && conf.mag_opts[n].min_free > 0) return true;
+   }
+   return false;
+}
+
+
+/*-------------------------------------------------
+ *  Method to create volumes on each mounted magazine whose number of unused
+ *  volumes has fallen below its 'Min Free Volumes' setting, bringing the
+ *  number up to its 'Max Free Volumes' setting. The volumes for all such
+ *  magazines are created as a single batch.
+ *  Returns the number of volumes created, or negative on error and sets
+ *  lasterr.
+ *-------------------------------------------------*/
+int DiskChanger::PrecreateVolumes()
+{
+   std::vector<int> bays, counts;
+   int n, nfree, prev_slots = 0, new_slots = 0, rc;
+
+   if (!changer_lock) {
+      verr.SetError(EINVAL, "changer not initialized");
+      log.Error("ERROR! %s", verr.GetErrorMsg());
+      return -1;
+   }
+   for (n = 0; n < (int)magazine.size() && n < (int)conf.mag_opts.size(); n++) {
+      if (magazine[n].empty() || conf.mag_opts[n].min_free <= 0) continue;
+      nfree = magazine[n].CountFreeVolumes();
+      if (nfree < 0 || nfree >= conf.mag_opts[n].min_free) continue;
+      log.Info("magazine %d has %d unused volumes, creating %d", n, nfree,
+            conf.mag_opts[n].max_free - nfree);
+      bays.push_back(n);
+      counts.push_back(conf.mag_opts[n].max_free - nfree);
+      prev_slots += magazine[n].num_slots;
+   }
+   if (bays.empty()) return 0;
+   rc = CreateVolumes(bays, counts);
+   for (n = 0; n < (int)bays.size(); n++) new_slots += magazine[bays[n]].num_slots;
+   if (rc) return -1;
+   return new_slots - prev_slots;
+}
+
+
+/*-------------------------------------------------
+ *  Method to renumber the virtual slots assigned to mounted magazines into
+ *  a dense layout beginning at slot 1, keeping the magazines in the same
+ *  relative order, and shrink the highest slot number to the slots in use.
+ *  Both the old and new slot ranges of each magazine that moved are added
+ *  to the slots needing 'update slots'.
+ *  Returns the number of magazines moved, or negative on error and
+ *  sets lasterr.
+ *------------------------------------------------*/
+int DiskChanger::CompactSlots()
+{
+   int n, m, d, next, moved = 0, old_max;
+   VirtualSlot vs;
+   std::vector< std::pair<int, int> > order;
+   std::vector<int> drv_mag, drv_mslot;
+
+   if (!changer_lock) {
+      verr.SetError(EINVAL, "changer not initialized");
+      log.Error("ERROR! %s", verr.GetErrorMsg());
+      return -1;
+   }
+   /* Order mounted magazines by their current start slot */
+   for (m = 0; m < (int)magazine.size(); m++) {
+      if (magazine[m].empty() || magazine[m].num_slots == 0 || magazine[m].start_slot < 1) continue;
+      order.push_back(std::make_pair(magazine[m].start_slot, m));
+   }
+   std::sort(order.begin(), order.end());
+   /* Remember the magazine slot loaded in each drive */
+   drv_mag.assign(drive.size(), -1);
+   drv_mslot.assign(drive.size(), -1);
+   for (d = 0; d < (int)drive.size(); d++) {
+      if (drive[d].empty()) continue;
+      drv_mag[d] = vslot[drive[d].vs].mag_bay;
+      drv_mslot[d] = vslot[drive[d].vs].mag_slot;
+   }
+   /* Assign new start slots */
+   next = 1;
+   for (n = 0; n < (int)order.size(); n++) {
+      m = order[n].second;
+      if (magazine[m].start_slot != next) {
+         log.Notice("magazine %d moved from slots %d-%d to %d-%d", m, magazine[m].start_slot,
+               magazine[m].start_slot + magazine[m].num_slots - 1, next, next + magazine[m].num_slots - 1);
+         update_slots.Add(magazine[m].start_slot, magazine[m].start_slot + magazine[m].num_slots - 1);
+         update_slots.Add(next, next + magazine[m].num_slots - 1);
+         magazine[m].start_slot = next;
+         ++moved;
+      }
+      next += magazine[m].num_slots;
+   }
+   /* Rebuild virtual slots, keeping one slot beyond the last used */
+   old_max = (int)vslot.size() - 1;
+   if (next < 10) next = 10;
+   vslot.clear();
+   for (n = 0; n <= next; n++) {
+      vs.vs = n;
+      vslot.push_back(vs);
+   }
+   for (n = 0; n < (int)order.size(); n++) {
+      AssignMagazineSlots(order[n].second, magazine[order[n].second].start_slot);
+   }
+   for (d = 0; d < (int)drive.size(); d++) {
+      if (drv_mag[d] < 0) continue;
+      drive[d].vs = magazine[drv_mag[d]].start_slot + drv_mslot[d];
+      vslot[drive[d].vs].drv = d;
+   }
+   /* Save updated state of magazines */
+   for (m = 0; m < (int)magazine.size(); m++) {
+      magazine[m].save();
+   }
+   dconf.max_slot = (int)vslot.size() - 1;
+   StateChanged();
+   log.Notice("compacted virtual slots: %d magazines moved, max slot %d, previously %d",
+         moved, dconf.max_slot, old_max);
+   return moved;
+}
+
+
+/*-------------------------------------------------
+ *  Method to cause Bacula to update its catalog to reflect
+ *  changes in the available volumes
+ *-------------------------------------------------*/
+int DiskChanger::UpdateBacula()
+{
+   int rc;
+   FILE *update_lock;
+   tString cmd;
+   char lockfile[4096];
+
+   /* Check if update needed */
+   if (!NeedsUpdate() && !needs_label) return 0; /* Nothing to do */
+   /* Create update lock lockfile */
+   snprintf(lockfile, sizeof(lockfile), "%s%s%s.updatelock", conf.work_dir.c_str(), DIR_DELIM,
+         conf.storage_name.c_str());
+   rc = exclusive_fopen(lockfile, &update_lock);
+   if (rc == EEXIST) {
+      /* Update already in progress in another process, so skip */
+      return 0;
+   }
+   if (rc) {
+      /* error creating lockfile, so skip */
+      log.Error("bconsole: errno=%d creating update lockfile", rc);
+      if (NeedsUpdate())
+         log.Error("WARNING! 'update slots' needed in bconsole");
+      if (needs_label)
+         log.Error("WARNING! 'label barcodes' needed in bconsole");
+      return 0;
+   }
+   log.Debug("created update lockfile for pid %d", getpid());
+   /* Time spent running bconsole and the number of commands issued are recorded */
+   PhaseTimer bconsole_timer("bconsole");
+   /* Perform update slots command in bconsole */
+   if (needs_update) {
+      /* Issue update slots command in bconsole */
+      tFormat(cmd, "update slots storage=\"%s\"", conf.storage_name.c_str());
+      bconsole_timer.AddCount(1);
+      if(issue_bconsole_command(cmd.c_str())) {
+         log.Error("WARNING! 'update slots' needed in bconsole");
+         ++bconsole_failed;
+      } else {
+         ++bconsole_ok;
+         needs_update = false;
+         update_slots.clear();
+      }
+   } else if (!update_slots.empty()) {
+      /* Only some slots changed, so update just those slots */
+      tString slots = update_slots.ToString(NumSlots());
+      if (!slots.empty()) {
+         tFormat(cmd, "update slots storage=\"%s\" slots=%s", conf.storage_name.c_str(), slots.c_str());
+         bconsole_timer.AddCount(1);
+         if(issue_bconsole_command(cmd.c_str())) {
+            log.Error("WARNING! 'update slots' needed in bconsole");
+            ++bconsole_failed;
+         } else {
+            ++bconsole_ok;
+            update_slots.clear();
+         }
+      } else update_slots.clear();
+   }
+   /* Perform label barcodes command in bconsole */
+   if (needs_label) {
+      tFormat(cmd, "label storage=\"%s\" pool=\"%s\" barcodes\nyes\nyes\n", conf.storage_name.c_str(),
+            conf.def_pool.c_str());
+      bconsole_timer.AddCount(1);
+      if (issue_bconsole_command(cmd.c_str())) {
+         log.Error("WARNING! 'label barcodes' needed in bconsole");
+         ++bconsole_failed;
+      } else {
+         ++bconsole_ok;
+         needs_label = false;
+      }
+   }
+   bconsole_timer.Stop();
+   /* Obtain changer lock before removing update lock */
+   fclose(update_lock);
    unlink(lockfile);
    log.Debug("removed update lockfile for pid %d", getpid());
    return 0;
@@ -860,6 +2126,9 @@ int DiskChanger::Lock(long timeout_seconds)
    }
    snprintf(lockfile, sizeof(lockfile), "%s%s%s.lock", conf.work_dir.c_str(), DIR_DELIM,
          conf.storage_name.c_str());
+   /* Time spent waiting for the lock and the number of attempts are recorded */
+   PhaseTimer lock_timer("lock");
+   lock_timer.AddCount(1);
    rc = exclusive_fopen(lockfile, &changer_lock);
    if (rc == EEXIST && timeout == 0) {
       /* timeout=0 means do not wait */
@@ -875,6 +2144,7 @@ int DiskChanger::Lock(long timeout_seconds)
          log.Error("ERROR! %s", verr.GetErrorMsg());
          return EACCES;
       }
+      lock_timer.AddCount(1);
       rc = exclusive_fopen(lockfile, &changer_lock);
    }
    if (rc) {
@@ -895,6 +2165,10 @@ int DiskChanger::Lock(long timeout_seconds)
 void DiskChanger::Unlock()
 {
    char lockfile[4096];
+   if (work_dfd >= 0) {
+      close(work_dfd);
+      work_dfd = -1;
+   }
    if (!changer_lock) return;
    fclose(changer_lock);
    changer_lock = NULL;
@@ -923,7 +2197,9 @@ bool DiskChanger::MagazineEmpty(int mag) const
 bool DiskChanger::SlotEmpty(int slot) const
 {
    if (slot <= 0 || slot >= (int)vslot.size()) return true;
-   return vslot[slot].empty();
+   if (vslot[slot].empty()) return true;
+   /* Slot may be mapped to an empty magazine slot */
+   return magazine[vslot[slot].mag_bay].mslot[vslot[slot].mag_slot].empty();
 }
 
 
@@ -972,6 +2248,58 @@ int DiskChanger::GetMagazineSlots(int mag) const
 }
 
 
+/*-------------------------------------------------
+ *  Method to return the number of volumes in magazine 'mag', not
+ *  counting empty magazine slots
+ *------------------------------------------------*/
+int DiskChanger::GetMagazineVolumes(int mag) const
+{
+   int n, count = 0;
+   if (mag < 0 || mag >= (int)magazine.size()) return 0;
+   for (n = 0; n < magazine[mag].num_slots; n++) {
+      if (!magazine[mag].mslot[n].empty()) ++count;
+   }
+   return count;
+}
+
+
+/*-------------------------------------------------
+ *  Method to set the metrics describing the current state of the changer.
+ *  The changer must have been initialized.
+ *------------------------------------------------*/
+void DiskChanger::ExportMetrics(MetricsFile &m)
+{
+   int n, mounted = 0;
+   long usec;
+   tString lbl;
+
+   m.Clear("vchanger_magazine_mounted");
+   m.Clear("vchanger_magazine_volumes");
+   m.Clear("vchanger_magazine_scan_duration_seconds");
+   for (n = 0; n < (int)magazine.size(); n++) {
+      tFormat(lbl, "changer=\"%s\",bay=\"%d\"", conf.storage_name.c_str(), n);
+      m.Set("vchanger_magazine_mounted", lbl.c_str(), magazine[n].empty() ? 0 : 1);
+      if (magazine[n].empty()) continue;
+      ++mounted;
+      m.Set("vchanger_magazine_volumes", lbl.c_str(), GetMagazineVolumes(n));
+      usec = timing.PhaseUsec("scan", n);
+      if (usec >= 0) m.Set("vchanger_magazine_scan_duration_seconds", lbl.c_str(), usec / 1000000.0);
+   }
+   tFormat(lbl, "changer=\"%s\",state=\"mounted\"", conf.storage_name.c_str());
+   m.Set("vchanger_magazines", lbl.c_str(), mounted);
+   tFormat(lbl, "changer=\"%s\",state=\"unmounted\"", conf.storage_name.c_str());
+   m.Set("vchanger_magazines", lbl.c_str(), (int)magazine.size() - mounted);
+   tFormat(lbl, "changer=\"%s\"", conf.storage_name.c_str());
+   m.Set("vchanger_slots", lbl.c_str(), NumSlots());
+   m.Set("vchanger_needs_update", lbl.c_str(), NeedsUpdate() ? 1 : 0);
+   m.Set("vchanger_needs_label", lbl.c_str(), needs_label ? 1 : 0);
+   tFormat(lbl, "changer=\"%s\",result=\"success\"", conf.storage_name.c_str());
+   m.Add("vchanger_bconsole_commands_total", lbl.c_str(), bconsole_ok);
+   tFormat(lbl, "changer=\"%s\",result=\"failure\"", conf.storage_name.c_str());
+   m.Add("vchanger_bconsole_commands_total", lbl.c_str(), bconsole_failed);
+}
+
+
 /*-------------------------------------------------
  *  Method to return the start of the virtual slot range
  *  that is assigned to magazine 'mag' volumes.
@@ -991,3 +2319,295 @@ const char* DiskChanger::GetMagazineMountpoint(int mag) const
    if (mag < 0 || mag >= (int)magazine.size()) return "";
    return magazine[mag].mountpoint.c_str();
 }
+
+
+/*-------------------------------------------------
+ *  Function to append the label of the volume in magazine slot 'ms'
+ *  of magazine 'mag' to 'out'.
+ *------------------------------------------------*/
+static inline void append_slot_label(OutputBuffer &out, const MagazineState &mag, int ms)
+{
+   const MagazineSlot &v = mag.mslot[ms];
+   out.Append(mag.labels.data() + v.label_pos, v.label_len);
+}
+
+
+/*-------------------------------------------------
+ *  Method to format the LIST command output, one line of the form
+ *  'slot:label' for each virtual slot, with an empty label for an
+ *  empty slot.
+ *------------------------------------------------*/
+void DiskChanger::FormatList(OutputBuffer &out) const
+{
+   int slot, num_slots = (int)vslot.size() - 2;
+   const VirtualSlot *vs;
+
+   out.reserve(out.size() + (num_slots > 0 ? num_slots : 0) * 24);
+   for (slot = 1; slot <= num_slots; slot++) {
+      vs = &vslot[slot];
+      out.AppendInt(slot).Append(':');
+      if (!vs->empty() && !magazine[vs->mag_bay].mslot[vs->mag_slot].empty()) {
+         append_slot_label(out, magazine[vs->mag_bay], vs->mag_slot);
+      }
+      out.Append('\n');
+   }
+}
+
+
+/*-------------------------------------------------
+ *  Method to format the LISTALL command output, one line for each drive
+ *  followed by one line for each virtual slot. A slot whose volume is
+ *  loaded in a drive is shown as empty.
+ *------------------------------------------------*/
+void DiskChanger::FormatListAll(OutputBuffer &out) const
+{
+   int n, num_slots = (int)vslot.size() - 2;
+   const VirtualSlot *vs;
+   std::vector<char> loaded(vslot.size(), 0);
+
+   out.reserve(out.size() + (drive.size() + (num_slots > 0 ? num_slots : 0)) * 28);
+   /* Drive state info */
+   for (n = 0; n < (int)drive.size(); n++) {
+      out.Append("D:", 2).AppendInt(n);
+      if (drive[n].empty()) {
+         out.Append(":E\n", 3);
+         continue;
+      }
+      vs = &vslot[drive[n].vs];
+      loaded[drive[n].vs] = 1;
+      out.Append(":F:", 3).AppendInt(drive[n].vs).Append(':');
+      if (!vs->empty()) append_slot_label(out, magazine[vs->mag_bay], vs->mag_slot);
+      out.Append('\n');
+   }
+   /* Slot state info */
+   for (n = 1; n <= num_slots; n++) {
+      vs = &vslot[n];
+      out.Append("S:", 2).AppendInt(n);
+      if (loaded[n] || vs->empty() || magazine[vs->mag_bay].mslot[vs->mag_slot].empty()) {
+         out.Append(":E\n", 3);
+      } else {
+         out.Append(":F:", 3);
+         append_slot_label(out, magazine[vs->mag_bay], vs->mag_slot);
+         out.Append('\n');
+      }
+   }
+}
+
+
+/*-------------------------------------------------
+ *  Method to format the LISTMAGS command output, one line for each
+ *  magazine of the form 'mag:count:start:mountpoint', or 'mag:::' if
+ *  the magazine is not mounted. The filesystem space of each magazine
+ *  is added by AddListMagsSpace().
+ *------------------------------------------------*/
+void DiskChanger::FormatListMags(OutputBuffer &out) const
+{
+   int n;
+
+   for (n = 0; n < (int)magazine.size(); n++) {
+      out.AppendInt(n).Append(':');
+      if (magazine[n].empty()) {
+         out.Append("::\n", 3);
+         continue;
+      }
+      out.AppendInt(magazine[n].num_slots).Append(':').AppendInt(magazine[n].start_slot).Append(':');
+      out.Append(magazine[n].mountpoint).Append('\n');
+   }
+}
+
+
+/*-------------------------------------------------
+ *  Function to append the LISTMAGS output lines in 'in' to 'out' with the
+ *  free and total bytes of each magazine's filesystem added, giving lines
+ *  of the form 'mag:count:start:mountpoint:free:total'. Free space changes
+ *  without the changer's state changing, so it is added to both fresh and
+ *  cached output rather than being cached itself.
+ *------------------------------------------------*/
+void DiskChanger::AddListMagsSpace(const OutputBuffer &in, OutputBuffer &out)
+{
+   size_t p = 0, e, c;
+   int fld;
+   long long avail, total;
+   tString mnt, space;
+
+   while (p < in.size()) {
+      e = p;
+      while (e < in.size() && in.data()[e] != '\n') ++e;
+      /* Mountpoint follows the third colon */
+      for (c = p, fld = 0; c < e && fld < 3; c++) {
+         if (in.data()[c] == ':') ++fld;
+      }
+      mnt.assign(in.data() + c, e - c);
+      out.Append(in.data() + p, e - p);
+      if (!mnt.empty() && fs_space(mnt.c_str(), &avail, &total) == 0) {
+         tFormat(space, ":%lld:%lld\n", avail, total);
+         out.Append(space);
+      } else {
+         out.Append("::\n", 3);
+      }
+      p = e + 1;
+   }
+}
+
+
+/*-------------------------------------------------
+ *  Function to build the line of an output cache file's header describing
+ *  magazine 'mag' with device 'mag_dev' and current mountpoint 'mountpoint'.
+ *  The line identifies the directory holding the magazine's volumes by
+ *  device, inode and modification time, so that mounting, unmounting, or
+ *  adding or removing volume files changes the line. A UUID magazine that
+ *  is not mounted is described only by the absence of its device, so the
+ *  line changes when the device is attached. A directory without a
+ *  modification time, or on a filesystem whose directory times are not
+ *  reliable, such as FAT, cannot be described. Sets 'newest' to the latest
+ *  modification time seen. Returns false if the magazine's state cannot
+ *  be described, in which case output must not be cached.
+ *------------------------------------------------*/
+static bool cache_magazine_line(tString &line, int mag, const tString &mag_dev,
+      const char *mountpoint, time_t &newest)
+{
+   struct stat st;
+   const char *kind = "M";
+
+   if (!mountpoint || !mountpoint[0]) {
+      if (tCaseFind(mag_dev, "uuid:") == 0) {
+#ifdef HAVE_LIBUDEV_H
+         tString dev_path;
+         /* Device nodes are only reliable if udev maintains them */
+         if (stat("/dev/disk/by-uuid", &st)) return false;
+         dev_path = "/dev/disk/by-uuid/";
+         dev_path += mag_dev.substr(5);
+         if (stat(dev_path.c_str(), &st) == 0) return false;
+         tToLower(dev_path);
+         if (stat(dev_path.c_str(), &st) == 0) return false;
+         tToUpper(dev_path);
+         dev_path.replace(0, 18, "/dev/disk/by-uuid/");
+         if (stat(dev_path.c_str(), &st) == 0) return false;
+         tFormat(line, "mag=%d\t%s\tU\t-\t\n", mag, mag_dev.c_str());
+         return true;
+#else
+         return false;
+#endif
+      }
+      /* Directory magazine that is not usable */
+      kind = "P";
+      mountpoint = mag_dev.c_str();
+   }
+   if (stat(mountpoint, &st)) {
+      tFormat(line, "mag=%d\t%s\t%s\t-\t%s\n", mag, mag_dev.c_str(), kind, mountpoint);
+      return true;
+   }
+   if (st.st_mtime == 0 || !fs_has_dir_times(mountpoint)) return false;
+   tFormat(line, "mag=%d\t%s\t%s\t%lu:%lu:%ld\t%s\n", mag, mag_dev.c_str(), kind,
+         (unsigned long)st.st_dev, (unsigned long)st.st_ino, (long)st.st_mtime, mountpoint);
+   if (st.st_mtime > newest) newest = st.st_mtime;
+   return true;
+}
+
+
+/*-------------------------------------------------
+ *  Method to read the output of command 'name' cached in the work
+ *  directory file 'name.cache' and append it to 'out'. This does not
+ *  require the changer to be initialized. The cached output is only used
+ *  if it was written for the current state generation and the magazines
+ *  are in the same state as when it was written.
+ *  Returns zero on success, else returns non-zero.
+ *------------------------------------------------*/
+int DiskChanger::ReadOutputCache(const char *name, OutputBuffer &out)
+{
+   int n, fld;
+   size_t len, p, e, f, kind = 0, last = 0;
+   FILE *FS;
+   time_t newest = 0;
+   tString cache, line, head, mountpoint;
+   char buf[65536], sname[4096];
+
+   dconf.restore();
+   snprintf(sname, sizeof(sname), "%s%s%s.cache", conf.work_dir.c_str(), DIR_DELIM, name);
+   FS = fopen(sname, "r");
+   if (!FS) return errno;
+   while ((len = fread(buf, 1, sizeof(buf), FS)) > 0) cache.append(buf, len);
+   fclose(FS);
+   /* Check generation and number of magazines */
+   tFormat(head, "vchanger-cache gen=%ld mags=%d\n", dconf.generation, (int)conf.magazine.size());
+   if (cache.compare(0, head.size(), head) != 0) return -1;
+   /* Check state of each magazine */
+   p = head.size();
+   for (n = 0; n < (int)conf.magazine.size(); n++) {
+      e = cache.find('\n', p);
+      if (e == tString::npos) return -1;
+      /* Fields are mag=N, device, kind, identity and mountpoint */
+      fld = 0;
+      for (f = p; f < e; f++) {
+         if (cache[f] != '\t') continue;
+         if (++fld == 2) kind = f + 1;
+         last = f;
+      }
+      if (fld != 4) return -1;
+      mountpoint.clear();
+      if (cache[kind] == 'M') mountpoint = cache.substr(last + 1, e - last - 1);
+      if (!cache_magazine_line(line, n, conf.magazine[n], mountpoint.c_str(), newest)) return -1;
+      if (cache.compare(p, e + 1 - p, line) != 0) return -1;
+      p = e + 1;
+   }
+   if (cache.compare(p, 1, "\n") != 0) return -1;
+   out.Append(cache.data() + p + 1, cache.size() - p - 1);
+   log.Debug("using cached %s output (generation %ld)", name, dconf.generation);
+   return 0;
+}
+
+
+/*-------------------------------------------------
+ *  Method to save the output 'out' of command 'name' to the work directory
+ *  file 'name.cache' tagged with the current state generation and the state
+ *  of each magazine. Must be called while holding the changer lock. Output
+ *  is not cached if a magazine directory was modified within the last
+ *  second, since a later change within the same second would go unnoticed.
+ *------------------------------------------------*/
+void DiskChanger::WriteOutputCache(const char *name, const OutputBuffer &out)
+{
+   int m, rc;
+   mode_t old_mask;
+   FILE *FS;
+   time_t newest = 0;
+   tString head, line;
+   char sname[4096], tname[4104];
+
+   if (!changer_lock) return;
+   tFormat(head, "vchanger-cache gen=%ld mags=%d\n", dconf.generation, (int)magazine.size());
+   for (m = 0; m < (int)magazine.size(); m++) {
+      if (!cache_magazine_line(line, m, magazine[m].mag_dev, magazine[m].mountpoint.c_str(), newest)) {
+         log.Debug("not caching %s output, magazine %d state unknown", name, m);
+         return;
+      }
+      head += line;
+   }
+   head += '\n';
+   if (newest >= time(NULL) - 1) {
+      log.Debug("not caching %s output, magazine recently modified", name);
+      return;
+   }
+   snprintf(sname, sizeof(sname), "%s%s%s.cache", conf.work_dir.c_str(), DIR_DELIM, name);
+   snprintf(tname, sizeof(tname), "%s.tmp", sname);
+   old_mask = umask(027);
+   FS = fopen(tname, "w");
+   umask(old_mask);
+   if (!FS) {
+      log.Error("ERROR! cannot open %s for writing (errno=%d)", tname, errno);
+      return;
+   }
+   if (fwrite(head.data(), 1, head.size(), FS) != head.size()
+         || (out.size() && fwrite(out.data(), 1, out.size(), FS) != out.size()) || fclose(FS)) {
+      rc = errno;
+      unlink(tname);
+      log.Error("ERROR! i/o error writing %s (errno=%d)", tname, rc);
+      return;
+   }
+   if (rename(tname, sname)) {
+      rc = errno;
+      unlink(tname);
+      log.Error("ERROR! cannot replace %s (errno=%d)", sname, rc);
+      return;
+   }
+   log.Debug("cached %s output (generation %ld)", name, dconf.generation);
+}
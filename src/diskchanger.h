@@ -26,16 +26,59 @@
 #include "vconf.h"
 #include "errhandler.h"
 #include "changerstate.h"
+#include "outbuf.h"
+#include "metrics.h"
+
+/* Values of DiskChanger::SetFullScan() other than a magazine bay */
+#define SCAN_CHANGED   -1    /* scan only magazines changed since the last scan */
+#define SCAN_ALL       -2    /* scan all magazines */
+
+/* A volume to be moved from one magazine to another */
+class VolumeMove
+{
+public:
+   VolumeMove() : src_bay(-1), src_slot(-1), dst_bay(-1), size(0), mtime(0), rc(0) {}
+public:
+   int src_bay;
+   int src_slot;        /* magazine slot of the volume on the source magazine */
+   int dst_bay;
+   long long size;
+   time_t mtime;        /* modification time of the volume file when the move was planned */
+   tString label;
+   tString staged;      /* path of the copy staged on the destination filesystem, or empty */
+   int rc;              /* errno of the move, or zero if it succeeded */
+};
+
+typedef std::vector<VolumeMove> VolumeMoveArray;
 
 class DiskChanger
 {
 public:
-   DiskChanger() : changer_lock(NULL), needs_update(false), needs_label(false)  {}
+   DiskChanger() : changer_lock(NULL), work_dfd(-1), needs_update(false), needs_label(false), full_scan(SCAN_CHANGED),
+         bconsole_ok(0), bconsole_failed(0) {}
    virtual ~DiskChanger();
    int Initialize();
    int LoadDrive(int drv, int slot);
    int UnloadDrive(int drv);
-   int CreateVolumes(int bay, int count, int start = -1, const char *label_prefix = "");
+   int TransferVolume(int src, int dst);
+   int CreateVolumes(const std::vector<int> &bays, const std::vector<int> &counts, int start = -1,
+         const char *label_prefix = "");
+   inline int CreateVolumes(const std::vector<int> &bays, int count, int start = -1,
+         const char *label_prefix = "")
+         { return CreateVolumes(bays, std::vector<int>(bays.size(), count), start, label_prefix); }
+   inline int CreateVolumes(int bay, int count, int start = -1, const char *label_prefix = "")
+         { return CreateVolumes(std::vector<int>(1, bay), count, start, label_prefix); }
+   int PlaceVolumes(int count, std::vector<int> &bays, std::vector<int> &counts);
+   int PrecreateVolumes();
+   bool PrecreateConfigured() const;
+   int CompactSlots();
+   int PlanRebalance(VolumeMoveArray &moves);
+   int StageRebalance(VolumeMoveArray &moves);
+   bool MigrationConfigured() const;
+   int PlanMigration(VolumeMoveArray &moves);
+   int StageVolumeMove(VolumeMove &mv, long long rate);
+   int CommitStagedMoves(VolumeMoveArray &moves);
+   void DiscardStagedMoves(VolumeMoveArray &moves);
    int UpdateBacula();
    const char* GetVolumeLabel(int slot);
    const char* GetVolumePath(tString &fname, int slot);
@@ -47,29 +90,55 @@ public:
    int GetMagazineSlots(int mag) const;
    int GetMagazineStartSlot(int mag) const;
    const char* GetMagazineMountpoint(int mag) const;
+   void FormatList(OutputBuffer &out) const;
+   void FormatListAll(OutputBuffer &out) const;
+   void FormatListMags(OutputBuffer &out) const;
+   static void AddListMagsSpace(const OutputBuffer &in, OutputBuffer &out);
+   int ReadOutputCache(const char *name, OutputBuffer &out);
+   void WriteOutputCache(const char *name, const OutputBuffer &out);
+   inline long GetGeneration() const { return dconf.generation; }
+   int GetMagazineVolumes(int mag) const;
+   int GetMagazineSpace(int mag, long long &avail, long long &total) const;
+   void ExportMetrics(MetricsFile &m);
    inline int NumDrives() { return (int)drive.size(); }
    inline int NumMagazines() { return (int)magazine.size(); }
    inline int NumSlots() { return (int)vslot.size() - 2; }
    inline int GetError() { return verr.GetError(); }
    inline const char* GetErrorMsg() const { return verr.GetErrorMsg(); }
-   inline bool NeedsUpdate() const { return needs_update; }
+   inline bool NeedsUpdate() const { return needs_update || !update_slots.empty(); }
    inline bool NeedsLabel() const { return needs_label; }
+   inline void SetFullScan(int bay) { full_scan = bay; }
    int Lock(long timeout = 30);
    void Unlock();
 protected:
    void InitializeMagazines();
    int FindEmptySlotRange(int count);
+   bool SlotRangeAvailable(int mag, int first, int last);
+   void AssignMagazineSlots(int mag, int start);
+   void AssignAppendedSlots(int mag, int prev_num);
+   int CommitVolumeMoves(const VolumeMoveArray &moves);
+   bool FastTier(int mag) const;
+   int CheckVolumeSpace(const std::vector<int> &bays, const std::vector<int> &counts);
+   void StateChanged();
    int InitializeDrives();
    void InitializeVirtSlots();
    void SetMaxDrive(int n);
    int CreateDriveSymlink(int drv);
+   int SwapDriveSymlink(int drv, const tString &target);
    int RemoveDriveSymlink(int drv);
+   int UnlinkDriveSymlink(int drv);
    int SaveDriveState(int drv);
    int RestoreDriveState(int drv);
 protected:
    FILE *changer_lock;
+   int work_dfd;           /* work directory, opened while the changer is locked */
    bool needs_update;
    bool needs_label;
+   int full_scan;          /* bay to scan even if unchanged since the last scan, or SCAN_ALL */
+   int bconsole_ok;        /* bconsole commands that succeeded in this invocation */
+   int bconsole_failed;    /* bconsole commands that failed in this invocation */
+   std::set<int> drive_links;    /* drives having a symlink in the work directory */
+   SlotRangeList update_slots;   /* slots needing 'update slots' when a full update is not needed */
    ErrorHandler verr;
    DynamicConfig dconf;
    MagazineStateArray magazine;
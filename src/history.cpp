@@ -0,0 +1,195 @@
+/* history.cpp
+ *
+ *  This file is part of vchanger by Josh Fisher.
+ *
+ *  vchanger copyright (C) 2008-2015 Josh Fisher
+ *
+ *  vchanger is free software.
+ *  You may redistribute it and/or modify it under the terms of the
+ *  GNU General Public License version 2, as published by the Free
+ *  Software Foundation.
+ *
+ *  vchanger is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vchanger.  See the file "COPYING".  If not,
+ *  write to:  The Free Software Foundation, Inc.,
+ *             59 Temple Place - Suite 330,
+ *             Boston,  MA  02111-1307, USA.
+ *
+ *  Provides a class for keeping a history of vchanger invocations
+ */
+
+#include "config.h"
+#include "compat_defs.h"
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+
+#include "util.h"
+#include "history.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/* Time to wait for another process to finish with the history file */
+#define HISTORY_LOCK_TIMEOUT_MS 2000
+
+
+/*-------------------------------------------------
+ *  Function to read or write exactly 'len' bytes at offset 'off'.
+ *  On success returns zero, else returns errno.
+ *-------------------------------------------------*/
+static int read_at(int fd, void *buf, size_t len, off_t off)
+{
+   ssize_t n;
+   if (lseek(fd, off, SEEK_SET) < 0) return errno;
+   n = read(fd, buf, len);
+   if (n < 0) return errno;
+   return (size_t)n == len ? 0 : EIO;
+}
+
+static int write_at(int fd, const void *buf, size_t len, off_t off)
+{
+   ssize_t n;
+   if (lseek(fd, off, SEEK_SET) < 0) return errno;
+   n = write(fd, buf, len);
+   if (n < 0) return errno;
+   return (size_t)n == len ? 0 : EIO;
+}
+
+
+/*=================================================
+ *  Class CommandHistory
+ *=================================================*/
+
+/*-------------------------------------------------
+ *  Method to open and lock history file 'path'. If the file does not
+ *  exist, or was created with a different record size or 'capacity',
+ *  then it is reinitialized empty. If 'capacity' is zero, then an existing
+ *  file is opened as is for reading.
+ *  On success returns zero, else returns errno.
+ *-------------------------------------------------*/
+int CommandHistory::Open(const char *path, int capacity)
+{
+   int rc;
+
+   Close();
+   fd = open(path, O_RDWR | O_CREAT | O_BINARY, S_IRUSR | S_IWUSR | S_IRGRP);
+   if (fd < 0) return errno;
+   rc = lock_fd(fd, HISTORY_LOCK_TIMEOUT_MS);
+   if (rc) {
+      Close();
+      return rc;
+   }
+   rc = read_at(fd, &hdr, sizeof(hdr), 0);
+   if (rc == 0 && memcmp(hdr.magic, HISTORY_MAGIC, sizeof(hdr.magic)) == 0
+         && hdr.record_size == sizeof(HistoryRecord) && hdr.next < hdr.capacity
+         && hdr.count <= hdr.capacity
+         && (capacity <= 0 || hdr.capacity == (uint32_t)capacity)) {
+      return 0;
+   }
+   if (capacity <= 0) {
+      /* Nothing recorded yet */
+      memset(&hdr, 0, sizeof(hdr));
+      return 0;
+   }
+   /* Start a new history */
+   memset(&hdr, 0, sizeof(hdr));
+   memcpy(hdr.magic, HISTORY_MAGIC, sizeof(hdr.magic));
+   hdr.record_size = sizeof(HistoryRecord);
+   hdr.capacity = (uint32_t)capacity;
+   if (ftruncate(fd, sizeof(hdr))) {
+      rc = errno;
+      Close();
+      return rc;
+   }
+   rc = WriteHeader();
+   if (rc) Close();
+   return rc;
+}
+
+
+/*-------------------------------------------------
+ *  Method to close the history file, releasing its lock
+ *-------------------------------------------------*/
+void CommandHistory::Close()
+{
+   if (fd >= 0) {
+      close(fd);
+      fd = -1;
+   }
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to write the header to the file
+ *-------------------------------------------------*/
+int CommandHistory::WriteHeader()
+{
+   return write_at(fd, &hdr, sizeof(hdr), 0);
+}
+
+
+/*-------------------------------------------------
+ *  Method to append record 'rec', overwriting the oldest record if the
+ *  history is full.
+ *  On success returns zero, else returns errno.
+ *-------------------------------------------------*/
+int CommandHistory::Append(const HistoryRecord &rec)
+{
+   int rc;
+
+   if (fd < 0) return EBADF;
+   if (!hdr.capacity) return EINVAL;
+   rc = write_at(fd, &rec, sizeof(rec), sizeof(hdr) + (off_t)hdr.next * sizeof(rec));
+   if (rc) return rc;
+   hdr.next = (hdr.next + 1) % hdr.capacity;
+   if (hdr.count < hdr.capacity) ++hdr.count;
+   return WriteHeader();
+}
+
+
+/*-------------------------------------------------
+ *  Method to read all records in the history, oldest first
+ *  On success returns zero, else returns errno.
+ *-------------------------------------------------*/
+int CommandHistory::Read(std::vector<HistoryRecord> &recs)
+{
+   int rc;
+   uint32_t n, first;
+   std::vector<HistoryRecord> buf;
+
+   recs.clear();
+   if (fd < 0) return EBADF;
+   if (!hdr.count) return 0;
+   buf.resize(hdr.count);
+   rc = read_at(fd, &buf[0], hdr.count * sizeof(HistoryRecord), sizeof(hdr));
+   if (rc) return rc;
+   /* Oldest record is at 'next' once the ring has wrapped */
+   first = hdr.count < hdr.capacity ? 0 : hdr.next;
+   recs.reserve(hdr.count);
+   for (n = 0; n < hdr.count; n++) {
+      recs.push_back(buf[(first + n) % hdr.count]);
+   }
+   return 0;
+}
@@ -0,0 +1,80 @@
+/* history.h
+ *
+ *  This file is part of vchanger by Josh Fisher.
+ *
+ *  vchanger copyright (C) 2008-2015 Josh Fisher
+ *
+ *  vchanger is free software.
+ *  You may redistribute it and/or modify it under the terms of the
+ *  GNU General Public License version 2, as published by the Free
+ *  Software Foundation.
+ *
+ *  vchanger is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vchanger.  See the file "COPYING".  If not,
+ *  write to:  The Free Software Foundation, Inc.,
+ *             59 Temple Place - Suite 330,
+ *             Boston,  MA  02111-1307, USA.
+ */
+#ifndef _HISTORY_H_
+#define _HISTORY_H_ 1
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+#include <vector>
+#include "tstring.h"
+
+/* Number of magazine bays whose scan time is kept in each record */
+#define HISTORY_MAX_BAYS 16
+#define HISTORY_CMD_LEN 16
+#define HISTORY_MAGIC "VCHIST1"
+
+/* Header at the start of the history file */
+struct HistoryHeader
+{
+   char magic[8];
+   uint32_t record_size;
+   uint32_t capacity;    /* number of record slots in the file */
+   uint32_t next;        /* index of the slot the next record is written to */
+   uint32_t count;       /* number of slots holding records */
+};
+
+/* Fixed-size record of one vchanger invocation */
+struct HistoryRecord
+{
+   int64_t time;                          /* time the invocation finished */
+   int64_t generation;                    /* changer state generation */
+   int32_t duration_us;                   /* wall-clock time of the invocation */
+   int32_t lock_us;                       /* lock wait, or -1 if no lock was taken */
+   int32_t rc;                            /* exit code */
+   int32_t scan_us[HISTORY_MAX_BAYS];     /* magazine scan time, or -1 if not scanned */
+   char command[HISTORY_CMD_LEN];
+};
+
+/*
+ *  Class to keep a ring buffer of the most recent invocation records in a
+ *  file. The file is locked while open, and each record is written in place
+ *  so that appending costs two small writes regardless of the history size.
+ */
+class CommandHistory
+{
+public:
+   CommandHistory() : fd(-1) {}
+   virtual ~CommandHistory() { Close(); }
+   int Open(const char *path, int capacity);
+   void Close();
+   int Append(const HistoryRecord &rec);
+   int Read(std::vector<HistoryRecord> &recs);
+protected:
+   int WriteHeader();
+protected:
+   int fd;
+   HistoryHeader hdr;
+};
+
+#endif /* _HISTORY_H_ */
@@ -32,6 +32,17 @@
 
 static tString EMPTY_VAL;
 
+/* Converts a boolean value string to bool */
+static bool StringToBool(const tString &val)
+{
+   tString v(val);
+   tToLower(v);
+   long l = strtol(v.c_str(), NULL, 10);
+   if (v == "yes" || v == "y" || v == "true" || v == "t"
+         || v == "on" || (isdigit(v[0]) && l != 0)) return true;
+   return false;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //   Class IniValue
 ////////////////////////////////////////////////////////////////////////////////
@@ -41,6 +52,11 @@ IniValue& IniValue::operator=(const IniValue &b)
    if (&b != this) {
       type = b.type;
       value = b.value;
+      parsed = b.parsed;
+      lval = b.lval;
+      ulval = b.ulval;
+      dval = b.dval;
+      bval = b.bval;
    }
    return *this;
 }
@@ -48,14 +64,14 @@ IniValue& IniValue::operator=(const IniValue &b)
 IniValue& IniValue::operator=(const tStringArray &b)
 {
    value.clear();
-   if (b.empty()) return *this;
    if (type == INIKEYWORDTYPE_MULTISZ || type == INIKEYWORDTYPE_SECTION
          || type == INIKEYWORDTYPE_ORDERED_SECTION) {
       value = b;
-      return *this;
+   } else if (!b.empty()) {
+      /* For types that allow only one string, use only the first string of b */
+      value.push_back(b[0]);
    }
-   /* For types that allow only one string, use only the first string of b */
-   value.push_back(b[0]);
+   Parse();
    return *this;
 }
 
@@ -63,6 +79,7 @@ IniValue& IniValue::operator=(const tString &b)
 {
    value.clear();
    value.push_back(b); /* If b is NULL, then value is cleared */
+   Parse();
    return *this;
 }
 
@@ -70,6 +87,7 @@ IniValue& IniValue::operator=(const char *b)
 {
    value.clear();
    if (b) value.push_back(b); /* If b is NULL, then value is cleared */
+   Parse();
    return *this;
 }
 
@@ -79,6 +97,7 @@ IniValue& IniValue::operator=(long long b)
    snprintf(buf, sizeof(buf), "%lld", b);
    value.clear();
    value.push_back(buf);
+   Parse();
    return *this;
 }
 
@@ -88,6 +107,7 @@ IniValue& IniValue::operator=(unsigned long long b)
    snprintf(buf, sizeof(buf), "%llu", b);
    value.clear();
    value.push_back(buf);
+   Parse();
    return *this;
 }
 
@@ -97,6 +117,7 @@ IniValue& IniValue::operator=(long b)
    snprintf(buf, sizeof(buf), "%ld", b);
    value.clear();
    value.push_back(buf);
+   Parse();
    return *this;
 }
 
@@ -106,6 +127,7 @@ IniValue& IniValue::operator=(unsigned long b)
    snprintf(buf, sizeof(buf), "%lu", b);
    value.clear();
    value.push_back(buf);
+   Parse();
    return *this;
 }
 
@@ -116,6 +138,7 @@ IniValue& IniValue::operator=(int b)
    snprintf(buf, sizeof(buf), "%d", b);
    value.clear();
    value.push_back(buf);
+   Parse();
    return *this;
 }
 
@@ -125,6 +148,7 @@ IniValue& IniValue::operator=(unsigned int b)
    snprintf(buf, sizeof(buf), "%u", b);
    value.clear();
    value.push_back(buf);
+   Parse();
    return *this;
 }
 
@@ -135,6 +159,7 @@ IniValue& IniValue::operator=(short b)
    snprintf(buf, sizeof(buf), "%hd", b);
    value.clear();
    value.push_back(buf);
+   Parse();
    return *this;
 }
 
@@ -144,6 +169,7 @@ IniValue& IniValue::operator=(unsigned short b)
    snprintf(buf, sizeof(buf), "%hu", b);
    value.clear();
    value.push_back(buf);
+   Parse();
    return *this;
 }
 
@@ -153,6 +179,7 @@ IniValue& IniValue::operator=(char b)
    snprintf(buf, sizeof(buf), "%hhd", b);
    value.clear();
    value.push_back(buf);
+   Parse();
    return *this;
 }
 
@@ -162,6 +189,7 @@ IniValue& IniValue::operator=(unsigned char b)
    snprintf(buf, sizeof(buf), "%hhu", b);
    value.clear();
    value.push_back(buf);
+   Parse();
    return *this;
 }
 
@@ -171,6 +199,7 @@ IniValue& IniValue::operator=(long double b)
    snprintf(buf, sizeof(buf), "%.21Lg", b);
    value.clear();
    value.push_back(buf);
+   Parse();
    return *this;
 }
 
@@ -180,6 +209,7 @@ IniValue& IniValue::operator=(double b)
    snprintf(buf, sizeof(buf), "%.17g", b);
    value.clear();
    value.push_back(buf);
+   Parse();
    return *this;
 }
 
@@ -189,6 +219,7 @@ IniValue& IniValue::operator=(float b)
    snprintf(buf, sizeof(buf), "%.8g", b);
    value.clear();
    value.push_back(buf);
+   Parse();
    return *this;
 }
 
@@ -197,6 +228,7 @@ IniValue& IniValue::operator=(bool b)
    value.clear();
    if (b) value.push_back("1");
    else value.push_back("0");
+   Parse();
    return *this;
 }
 
@@ -212,6 +244,7 @@ IniValue& IniValue::operator+=(const IniValue &b)
       if (value.empty()) value.push_back("");
       value[0] += b.value[0];
    }
+   Parse();
    return *this;
 }
 
@@ -227,6 +260,7 @@ IniValue& IniValue::operator+=(const tStringArray &b)
       if (value.empty()) value.push_back("");
       value[0] += b[0];
    }
+   Parse();
    return *this;
 }
 
@@ -239,6 +273,7 @@ IniValue& IniValue::operator+=(const tString &b)
       if (value.empty()) value.push_back("");
       value[0] += b;
    }
+   Parse();
    return *this;
 }
 
@@ -252,6 +287,7 @@ IniValue& IniValue::operator+=(const char *b)
       if (value.empty()) value.push_back("");
       value[0] += b;
    }
+   Parse();
    return *this;
 }
 
@@ -286,42 +322,60 @@ const tString& IniValue::GetString() const
    return value.front();
 }
 
+/*
+ * Method to convert the value of a numeric or boolean keyword when it is
+ * assigned, so that reading the value does not convert it again
+ */
+void IniValue::Parse()
+{
+   parsed = type >= INIKEYWORDTYPE_LONGLONG && type <= INIKEYWORDTYPE_BOOL;
+   lval = 0;
+   ulval = 0;
+   dval = 0;
+   bval = false;
+   if (!parsed || value.empty()) return;
+   lval = strtoll(value[0].c_str(), NULL, 10);
+   ulval = strtoull(value[0].c_str(), NULL, 10);
+   dval = strtold(value[0].c_str(), NULL);
+   bval = StringToBool(value[0]);
+}
+
 long long IniValue::GetLONG() const
 {
+   if (parsed) return lval;
    if (value.empty()) return 0;
    return strtoll(value[0].c_str(), NULL, 10);
 }
 
 unsigned long long IniValue::GetULONG() const
 {
+   if (parsed) return ulval;
    if (value.empty()) return 0;
    return strtoull(value[0].c_str(), NULL, 10);
 }
 
 long double IniValue::GetDOUBLE() const
 {
+   if (parsed) return dval;
    if (value.empty()) return 0;
    return strtold(value[0].c_str(), NULL);
 }
 
 bool IniValue::GetBOOL() const
 {
+   if (parsed) return bval;
    if (value.empty()) return false;
-   tString v(value[0]);
-   tToLower(v);
-   long l = strtol(v.c_str(), NULL, 10);
-   if (v == "yes" || v == "y" || v == "true" || v == "t"
-         || v == "on" || (isdigit(v[0]) && l != 0)) return true;
-   return false;
+   return StringToBool(value[0]);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //   Class IniFile
 ////////////////////////////////////////////////////////////////////////////////
 
-IniFile::IniFile(const IniFile &b)
+IniFile::IniFile(const IniFile &b) : kwcount(0)
 {
    kwmap = b.kwmap;
+   RebuildIndex();
 }
 
 /*
@@ -331,11 +385,64 @@ IniFile& IniFile::operator=(const IniFile &b)
 {
    if (&b != this) {
       kwmap = b.kwmap;
+      RebuildIndex();
     }
    return *this;
 }
 
 
+/*
+ * Hash function (FNV-1a) for normalized keys
+ */
+static size_t HashKey(const char *key, size_t len)
+{
+   size_t n;
+   unsigned long h = 2166136261UL;
+   for (n = 0; n < len; n++) {
+      h ^= (unsigned char)key[n];
+      h *= 16777619UL;
+   }
+   return (size_t)h;
+}
+
+/*
+ * Method to rebuild the hash index of the keys in kwmap, with enough
+ * buckets to keep the average bucket size at one key or less
+ */
+void IniFile::RebuildIndex()
+{
+   size_t buckets = 64;
+   IniValuePairList::iterator p;
+
+   kwcount = kwmap.size();
+   while (buckets < kwcount) buckets *= 2;
+   kwindex.clear();
+   kwindex.resize(buckets);
+   for (p = kwmap.begin(); p != kwmap.end(); p++) {
+      kwindex[HashKey(p->key.data(), p->key.size()) & (buckets - 1)].push_back(p);
+   }
+}
+
+/*
+ * Method to append a key, whose name has already been normalized, to kwmap
+ * and add it to the hash index
+ */
+void IniFile::AddKey(const IniValuePair &np)
+{
+   IniValuePairList::iterator p;
+
+   kwmap.push_back(np);
+   if (kwcount + 1 > kwindex.size()) {
+      RebuildIndex();
+      return;
+   }
+   p = kwmap.end();
+   --p;
+   kwindex[HashKey(np.key.data(), np.key.size()) & (kwindex.size() - 1)].push_back(p);
+   ++kwcount;
+}
+
+
 /*
  * Method to parse key and return section, keyword, and if ordered section, then also ordered section
  * base name and the index of the keyword in the section's map entry
@@ -384,15 +491,22 @@ bool IniFile::ParseKey(const char *key_in, tString &base, size_t &ndx, tString &
    return true;
 }
 
-IniValuePairList::iterator IniFile::FindKey(const char *key_in)
+IniValuePairList::iterator IniFile::FindKey(const char *key, size_t len)
 {
-   IniValuePairList::iterator p;
-   tString key(key_in);
-   tToLower(tRemoveWS(key));
-   for (p = kwmap.begin(); p != kwmap.end(); p++) {
-      if (p->key == key) break;
+   size_t n;
+   IniKeyBucket::iterator b;
+
+   if (kwindex.empty()) return kwmap.end();
+   /* Keys are matched ignoring case and blanks */
+   keybuf.clear();
+   for (n = 0; n < len; n++) {
+      if (key[n] != ' ' && key[n] != '\t') keybuf += (char)tolower(key[n]);
    }
-   return p;
+   IniKeyBucket &bucket = kwindex[HashKey(keybuf.data(), keybuf.size()) & (kwindex.size() - 1)];
+   for (b = bucket.begin(); b != bucket.end(); b++) {
+      if ((*b)->key == keybuf) return *b;
+   }
+   return kwmap.end();
 }
 
 IniValuePairList::iterator IniFile::FindValue(const char *key)
@@ -440,7 +554,7 @@ IniValuePairList::iterator IniFile::FindValue(const char *key)
    np.key = sect + '/';
    np.key += kw;
    np.value.type = (int)strtol(p->value.value[s].substr(n + 1).c_str(), NULL, 10);
-   kwmap.push_back(np);
+   AddKey(np);
    p = kwmap.end();
    --p;
    return p;
@@ -510,7 +624,7 @@ bool IniFile::AddKeyword(const char *key, int kwtype)
       return false;
    }
    np.value.type = kwtype;
-   kwmap.push_back(np);
+   AddKey(np);
    return true;
 }
 
@@ -541,18 +655,17 @@ bool IniFile::AddSection(const char *sect, bool is_ordered)
       return false; /* invalid params */
    }
    n = np.key.find_last_not_of("0123456789");
-   if (n != tString::npos) {
-      if (np.key.find_first_not_of("0123456789", n + 1) == tString::npos) {
-         /* Section base name with trailing numeric is invalid */
-         return false;
-      }
+   if (n == tString::npos || n + 1 < np.key.size()) {
+      /* Section base name with trailing numeric is invalid */
+      err_msg = "invalid section name";
+      return false;
    }
    if (is_ordered) {
       np.value.type = INIKEYWORDTYPE_ORDERED_SECTION;
    } else {
       np.value.type = INIKEYWORDTYPE_SECTION;
    }
-   kwmap.push_back(np);
+   AddKey(np);
    return true;
 }
 
@@ -600,7 +713,7 @@ bool IniFile::AddSectionKeyword(const char *sect_in, const char *kw_in, int kwty
       np.key = sect + '/';
       np.key += kw;
       np.value.type = kwtype;
-      kwmap.push_back(np);
+      AddKey(np);
    }
    return true;
 }
@@ -713,7 +826,10 @@ size_t IniFile::GetSetKeywords(tStringArray &kw)
 
 
 /*
- * Method to parse keyword/value pairs from a file
+ * Method to get the next token from the text between 'pos' and 'end',
+ * advancing 'pos' past it. On return, 'tok' and 'len' give the token's
+ * text, which points into the text being parsed except for quoted strings
+ * containing escape sequences, which are decoded into strbuf.
  * returns:
  *     0   EOF
  *    -1   I/O error
@@ -727,96 +843,100 @@ size_t IniFile::GetSetKeywords(tStringArray &kw)
  *    'S'  qouted string
  *    'A'  atom text
  */
-int IniFile::ReadToken(FILE* fs, tString &str)
+int IniFile::ReadToken(const char *&pos, const char *end, const char *&tok, size_t &len)
 {
-   tString word, tmp, special = "=[]\\\n";
-   int c, delim = 0, esc = 0;
+   static const char *special = "=[]\\\n";
+   const char *start;
+   tString hex;
+   char delim, c;
 
-   str.clear();
-   c = fgetc(fs);
+   tok = pos;
+   len = 0;
    /* Strip comments */
-   if (c == ';' || c == '#') {
-      c = fgetc(fs);
-      while (c != EOF && c != '\n') {
-         c = fgetc(fs);
-      }
+   if (pos < end && (*pos == ';' || *pos == '#')) {
+      while (pos < end && *pos != '\n') ++pos;
    }
    /* Check for EOF */
-   if (c == EOF) {
-      if (ferror(fs)) return -1; /* i/o error */
-      return 0; /* normal end of file */
-   }
+   if (pos >= end) return 0; /* normal end of file */
+   c = *pos++;
    /* Special handling for CRLF line endings */
    if (c == '\r') {
-      c = fgetc(fs);
-      if (c != '\n') return -1; /* CR not followed by LF is an error */
+      if (pos >= end || *pos != '\n') return -1; /* CR not followed by LF is an error */
+      c = *pos++;
    }
    /* Look for single char tokens */
-   if (special.find((char)c) != tString::npos) {
-      str = (char)c;
-      return c;
+   if (c && strchr(special, c)) {
+      tok = pos - 1;
+      len = 1;
+      return (unsigned char)c;
    }
    /* look for space token */
    if (c == ' ' || c == '\t') {
-      while (c == ' ' || c == '\t') {
-         str += (char)c;
-         c = fgetc(fs);
-      }
-      if (c != EOF) ungetc(c, fs);
+      tok = pos - 1;
+      while (pos < end && (*pos == ' ' || *pos == '\t')) ++pos;
+      len = pos - tok;
       return ' ';
    }
    /* look for quoted string token */
    if (c == '"' || c == '\'') {
       delim = c;
-      c = fgetc(fs);
-      while (c != EOF) {
-         if (!esc) {
-            if (c == delim) return 'S';
-            if (c == '\\') esc = 1;
-            else str += (char)c;
-         } else {
-            switch (c)
-            {
-            case '0':
-               str += '\0';
-               break;
-            case 'r':
-               str += '\r';
-               break;
-            case 'n':
-               str += '\n';
-               break;
-            case 't':
-               str += '\t';
-               break;
-            case 'x':
-               tmp.clear();
-                c = fgetc(fs);
-               while (c != EOF && tmp.size() < 2 && isxdigit(c)) {
-                  tmp += tolower(c);
-                  c = fgetc(fs);
-               }
-               if (c != EOF) ungetc(c, fs);
-               if (tmp.empty()) return -3;
-               str += (char)strtol(tmp.c_str(), NULL, 16);
-               break;
-            default:
-               str += (char)c;
-               break;
+      start = pos;
+      /* Without escape sequences, the token is the text between the quotes */
+      while (pos < end && *pos != delim && *pos != '\\') ++pos;
+      if (pos >= end) return -2; /* closing delimiter not found */
+      if (*pos == delim) {
+         tok = start;
+         len = pos++ - start;
+         return 'S';
+      }
+      strbuf.assign(start, pos - start);
+      while (pos < end) {
+         c = *pos++;
+         if (c == delim) {
+            tok = strbuf.data();
+            len = strbuf.size();
+            return 'S';
+         }
+         if (c != '\\') {
+            strbuf += c;
+            continue;
+         }
+         if (pos >= end) break;
+         c = *pos++;
+         switch (c)
+         {
+         case '0':
+            strbuf += '\0';
+            break;
+         case 'r':
+            strbuf += '\r';
+            break;
+         case 'n':
+            strbuf += '\n';
+            break;
+         case 't':
+            strbuf += '\t';
+            break;
+         case 'x':
+            hex.clear();
+            while (pos < end && hex.size() < 2 && isxdigit(*pos)) {
+               hex += (char)tolower(*pos++);
             }
-            esc = 0;
+            if (hex.empty()) return -3;
+            strbuf += (char)strtol(hex.c_str(), NULL, 16);
+            break;
+         default:
+            strbuf += c;
+            break;
          }
-         c = fgetc(fs);
       }
       return -2; /* closing delimiter not found */
    }
    /* look for atom */
-   while (c != EOF && c != '"' && c != '\'' && c != ' ' && c != '\t' && c
-         != '=' && c != '[' && c != ']' && c != '\r' && c != '\n' && c != '\\') {
-      str += (char)c;
-      c = fgetc(fs);
-   }
-   if (c != EOF) ungetc(c, fs);
+   tok = pos - 1;
+   while (pos < end && *pos != '"' && *pos != '\'' && *pos != ' ' && *pos != '\t' && *pos
+         != '=' && *pos != '[' && *pos != ']' && *pos != '\r' && *pos != '\n' && *pos != '\\') ++pos;
+   len = pos - tok;
    return 'A';
 }
 
@@ -841,27 +961,43 @@ int IniFile::Read(const char *fname)
 }
 
 /*
- * Method to parse keyword/value pairs from an open file
+ * Method to parse keyword/value pairs from an open file. The whole file
+ * is read into memory and then parsed in place.
  */
 int IniFile::Read(FILE *fin)
 {
-   int tok, state = 0, linenum = 1;
-   tString word, section;
-   tString kw, kwtmp, val, tmp;
-   tString skw_name, sval;
-   tStringArray kwlist;
-   IniValue ival;
-   IniValuePairList::iterator p = kwmap.end(), ps;
-   char buf[4096];
+   size_t n;
+   tString text;
+   char buf[65536];
 
    err_msg.clear();
    if (!fin || ferror(fin)) {
       err_msg = "bad file stream";
       return -1;
    }
-   if (feof(fin)) return 0;
+   while ((n = fread(buf, 1, sizeof(buf), fin)) > 0) text.append(buf, n);
+   if (ferror(fin)) {
+      err_msg = "file i/o error";
+      return -1;
+   }
+   return Parse(text.data(), text.size());
+}
+
+/*
+ * Method to parse keyword/value pairs from 'size' bytes of 'text'
+ */
+int IniFile::Parse(const char *text, size_t size)
+{
+   int tok, state = 0, linenum = 1;
+   const char *pos = text, *end = text + size, *word;
+   size_t wlen;
+   tString section;
+   tString kw, kwtmp, val;
+   IniValuePairList::iterator p = kwmap.end(), ps;
+   char buf[4096];
 
-   tok = ReadToken(fin, word);
+   err_msg.clear();
+   tok = ReadToken(pos, end, word, wlen);
    while (tok > 0) {
       switch (state)
       {
@@ -878,7 +1014,7 @@ int IniFile::Read(FILE *fin)
             state = 5;
             break;
          case 'A':
-            kwtmp = word;
+            kwtmp.assign(word, wlen);
             state = 1;
             break;
          default:
@@ -894,7 +1030,7 @@ int IniFile::Read(FILE *fin)
          case ' ':
             break;
          case 'A':
-            kwtmp += word;
+            kwtmp.append(word, wlen);
             break;
          case '=':
             /* Found '=' marking end of keyword */
@@ -932,7 +1068,7 @@ int IniFile::Read(FILE *fin)
                p->value += "";
                state = 7;
             } else {
-               val = word;
+               val.assign(word, wlen);
                state = 3;
             }
             break;
@@ -945,7 +1081,7 @@ int IniFile::Read(FILE *fin)
             break;
          default:
             /* Found first word of value */
-            val = word;
+            val.assign(word, wlen);
             if (p->value.type == INIKEYWORDTYPE_MULTISZ)
                state = 7;
             else
@@ -969,7 +1105,7 @@ int IniFile::Read(FILE *fin)
             state = 0;
             break;
          default:
-            val += word;
+            val.append(word, wlen);
             break;
          }
          break;
@@ -1001,7 +1137,7 @@ int IniFile::Read(FILE *fin)
             break;
          case 'A':
             /* Found first word of section name */
-            section = word;
+            section.assign(word, wlen);
             state = 6;
             break;
          case ']':
@@ -1022,7 +1158,7 @@ int IniFile::Read(FILE *fin)
          case ' ':
             break;
          case 'A':
-            section += word;
+            section.append(word, wlen);
             break;
          case ']':
             /* Found section name */
@@ -1074,7 +1210,7 @@ int IniFile::Read(FILE *fin)
             state = 0;
             break;
          default:
-            val += word;
+            val.append(word, wlen);
             break;
          }
          break;
@@ -1097,7 +1233,7 @@ int IniFile::Read(FILE *fin)
             state = 0;
             break;
          default:
-            val = word;
+            val.assign(word, wlen);
             state = 7;
             break;
          }
@@ -1135,7 +1271,7 @@ int IniFile::Read(FILE *fin)
          }
          break;
       }
-      tok = ReadToken(fin, word);
+      tok = ReadToken(pos, end, word, wlen);
    }
 
    /* Check state at EOF for error */
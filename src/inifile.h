@@ -20,7 +20,11 @@
 #ifndef _INIPARSE_H_
 #define _INIPARSE_H_ 1
 
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
 #include <list>
+#include <vector>
 #include "tstring.h"
 
 #define INIKEYWORDTYPE_SECTION      0
@@ -45,8 +49,9 @@
 class IniValue
 {
 public:
-   IniValue() : type(INIKEYWORDTYPE_SZ) {}
-   IniValue(const IniValue &b) : type(b.type), value(b.value) {}
+   IniValue() : type(INIKEYWORDTYPE_SZ), parsed(false), lval(0), ulval(0), dval(0), bval(false) {}
+   IniValue(const IniValue &b) : type(b.type), value(b.value), parsed(b.parsed), lval(b.lval),
+         ulval(b.ulval), dval(b.dval), bval(b.bval) {}
    virtual ~IniValue() {}
    IniValue& operator=(const IniValue &b);
    IniValue& operator=(const tStringArray &b);
@@ -78,8 +83,8 @@ public:
    const char* GetSZ() const;
    const tString& GetString() const;
    size_t size() const;
-   inline void SetType(int newtype) { type = newtype; }
-   inline void clear() { value.clear(); }
+   inline void SetType(int newtype) { type = newtype; Parse(); }
+   inline void clear() { value.clear(); Parse(); }
    inline int GetType() const { return type; }
    inline bool empty() const { return size() == 0; }
    inline bool IsSet() const { return value.size() != 0; }
@@ -101,9 +106,17 @@ public:
    inline operator const tString&() const { return GetString(); }
    inline operator const tStringArray&() const { return value; }
    friend class IniFile;
+protected:
+   void Parse();
 protected:
    int type;
    tStringArray value;
+   /* Numeric and boolean values are converted once, when assigned */
+   bool parsed;
+   long long lval;
+   unsigned long long ulval;
+   long double dval;
+   bool bval;
 };
 
 
@@ -126,11 +139,12 @@ public:
 };
 
 typedef std::list<IniValuePair> IniValuePairList;
+typedef std::vector<IniValuePairList::iterator> IniKeyBucket;
 
 class IniFile
 {
 public:
-   IniFile() {}
+   IniFile() : kwcount(0) {}
    IniFile(const IniFile &b);
    virtual ~IniFile() {}
    IniFile& operator=(const IniFile &b);
@@ -167,22 +181,30 @@ public:
    inline int Read(const tString &fname) { return Read(fname.c_str()); }
    size_t GetSetKeywords(tStringArray &kw);
    size_t GetKeywords(tStringArray &kw);
-   inline void clear() { kwmap.clear(); }
+   inline void clear() { kwmap.clear(); kwindex.clear(); kwcount = 0; }
    inline bool empty() { return kwmap.empty(); }
    inline tString GetErrorMessage() { return err_msg; }
 protected:
    bool ParseKey(const char *key, tString &base, size_t &ndx, tString &sect, tString &kw);
    inline bool ParseKey(const tString &key, tString &base, size_t &ndx, tString &sect, tString &kw)
       { return ParseKey(key.c_str(), base, ndx, sect, kw); }
-   IniValuePairList::iterator FindKey(const char *key);
-   inline IniValuePairList::iterator FindKey(const tString &key) { return FindKey(key.c_str()); }
+   IniValuePairList::iterator FindKey(const char *key, size_t len);
+   inline IniValuePairList::iterator FindKey(const char *key) { return FindKey(key, strlen(key)); }
+   inline IniValuePairList::iterator FindKey(const tString &key) { return FindKey(key.data(), key.size()); }
+   void AddKey(const IniValuePair &np);
+   void RebuildIndex();
    IniValuePairList::iterator FindValue(const char *key);
    inline IniValuePairList::iterator FindValue(const tString &key) { return FindValue(key.c_str()); }
    IniValuePairList::iterator FindSection(const char *sect);
    inline IniValuePairList::iterator FindSection(const tString &sect) { return FindSection(sect.c_str()); }
-   int ReadToken(FILE* fs, tString &str);
+   int ReadToken(const char *&pos, const char *end, const char *&tok, size_t &len);
+   int Parse(const char *text, size_t size);
 protected:
    IniValuePairList kwmap;
+   std::vector<IniKeyBucket> kwindex;  /* kwmap entries by hash of key */
+   size_t kwcount;
+   tString keybuf;                     /* normalized key being looked up */
+   tString strbuf;                     /* quoted string token with escapes decoded */
    IniValue bogus;
    tString err_msg;
 };
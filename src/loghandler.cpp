@@ -25,6 +25,9 @@
 #ifdef HAVE_TIME_H
 #include <time.h>
 #endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
 #ifdef HAVE_STDLIB_H
 #include <stdlib.h>
 #endif
@@ -34,9 +37,16 @@
 #ifdef HAVE_STDARG_H
 #include <stdarg.h>
 #endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 #ifndef HAVE_LOCALTIME_R
 #include "compat/localtime_r.h"
 #endif
+#include "compat/gettimeofday.h"
+#ifndef va_copy
+#define va_copy(d, s) __va_copy(d, s)
+#endif
 #define LOGHANDLER_SOURCE 1
 #include "loghandler.h"
 
@@ -47,10 +57,30 @@ LogHandler::LogHandler() : use_syslog(false), max_debug_level(LOG_WARNING), errf
 #ifdef HAVE_PTHREAD_H
    pthread_mutex_init(&mut, NULL);
 #endif
+#ifdef USE_ASYNC_LOG
+   async = true;
+   ring = NULL;
+   enqueue_pos = dequeue_pos = written_pos = 0;
+   writer_running = writer_idle = writer_stop = false;
+   stamp_time = 0;
+   stamp[0] = 0;
+   pthread_cond_init(&wake, NULL);
+   pthread_cond_init(&flushed, NULL);
+#ifndef HAVE_WINDOWS_H
+   /* The writer thread does not survive fork(), so the ring buffer is
+    * drained before forking */
+   pthread_atfork(ForkPrepare, ForkParent, ForkChild);
+#endif
+#endif
 }
 
 LogHandler::~LogHandler()
 {
+#ifdef USE_ASYNC_LOG
+   StopWriter();
+   pthread_cond_destroy(&wake);
+   pthread_cond_destroy(&flushed);
+#endif
    if (use_syslog) closelog();
 #ifdef HAVE_PTHREAD_H
    pthread_mutex_destroy(&mut);
@@ -59,18 +89,24 @@ LogHandler::~LogHandler()
 
 void LogHandler::OpenLog(FILE *fs, int max_level)
 {
+   Flush();
    Lock();
    if (use_syslog) closelog();
    if (max_level < LOG_EMERG || max_level > LOG_DEBUG) max_level = LOG_DEBUG;
    errfs = fs;
    use_syslog = false;
    max_debug_level = max_level;
+#ifdef USE_ASYNC_LOG
+   /* A forked process writes directly until it opens its own log */
+   async = true;
+#endif
    Unlock();
 }
 
 void LogHandler::OpenLog(const char *ident, int facility, int max_level,
                          int syslog_options)
 {
+   Flush();
    Lock();
    if (use_syslog) closelog();
    if (facility < LOG_KERN || facility > LOG_LOCAL7) facility = LOG_DAEMON;
@@ -157,6 +193,15 @@ void LogHandler::MajorDebug(const char *fmt, ...)
 #endif
 }
 
+// Method to log a message at a run-time selected priority level
+void LogHandler::Message(int priority, const char *fmt, ...)
+{
+   va_list vl;
+   va_start(vl, fmt);
+   WriteLog(priority, fmt, vl);
+   va_end(vl);
+}
+
 // Method to acquire mutex lock
 void LogHandler::Lock()
 {
@@ -173,13 +218,33 @@ void LogHandler::Unlock()
 #endif
 }
 
-// Method to write to log
+// Method to write to log. Messages to a log file are normally queued for the
+// writer thread, and are only written directly when they are too long for the
+// ring buffer or the writer thread is not available. Queued messages are
+// flushed before an error is returned to the caller.
 void LogHandler::WriteLog(int priority, const char *fmt, va_list vl)
 {
    size_t n;
    struct tm bt;
    time_t t;
    char buf[1024];
+#ifdef USE_ASYNC_LOG
+   va_list vc;
+   int len;
+
+   if (priority > max_debug_level || priority < LOG_EMERG || !fmt) return;
+   if (async && !use_syslog) {
+      va_copy(vc, vl);
+      len = vsnprintf(buf, LOG_MSG_SIZE, fmt, vc);
+      va_end(vc);
+      if (len >= 0 && len < LOG_MSG_SIZE && QueueLog(time(NULL), buf, len)) {
+         if (priority <= LOG_ERR) Flush();
+         return;
+      }
+      /* Keep messages in order when writing directly */
+      Flush();
+   }
+#endif
    Lock();
    if (priority > max_debug_level || priority < LOG_EMERG || !fmt) {
       Unlock();
@@ -204,3 +269,206 @@ void LogHandler::WriteLog(int priority, const char *fmt, va_list vl)
    }
    Unlock();
 }
+
+// Method to wait until all queued messages have been written to the log
+// file and flushed
+void LogHandler::Flush()
+{
+#ifdef USE_ASYNC_LOG
+   unsigned long ticket;
+   if (!writer_running) return;
+   Lock();
+   ticket = enqueue_pos;
+   while (writer_running && (long)(written_pos - ticket) < 0) {
+      pthread_cond_signal(&wake);
+      pthread_cond_wait(&flushed, &mut);
+   }
+   Unlock();
+#endif
+}
+
+#ifdef USE_ASYNC_LOG
+// Method to store a message in the ring buffer for the writer thread without
+// taking a lock. Producers claim entries by advancing enqueue_pos and then
+// publish them by setting their sequence number. The writer thread is only
+// signalled when it is idle or the ring buffer is half full. Returns false if
+// the writer thread could not be started.
+bool LogHandler::QueueLog(time_t t, const char *msg, size_t len)
+{
+   LogRingEntry *e;
+   unsigned long pos;
+   long dif;
+
+   if (!writer_running && !StartWriter()) return false;
+   pos = enqueue_pos;
+   while (true) {
+      e = &ring[pos % LOG_RING_SIZE];
+      dif = (long)(e->seq - pos);
+      if (dif == 0) {
+         if (__sync_bool_compare_and_swap(&enqueue_pos, pos, pos + 1)) break;
+      } else if (dif < 0) {
+         /* Ring buffer is full, so wait for the writer to catch up */
+         Flush();
+      }
+      pos = enqueue_pos;
+   }
+   e->t = t;
+   e->len = len;
+   memcpy(e->msg, msg, len);
+   __sync_synchronize();
+   e->seq = pos + 1;
+   __sync_synchronize();
+   if ((writer_idle && __sync_bool_compare_and_swap(&writer_idle, true, false))
+         || (pos + 1) % (LOG_RING_SIZE / 2) == 0) {
+      Lock();
+      pthread_cond_signal(&wake);
+      Unlock();
+   }
+   return true;
+}
+
+// Method to start the writer thread, allocating the ring buffer if needed.
+// Returns false if the thread could not be started.
+bool LogHandler::StartWriter()
+{
+   unsigned long n;
+   bool ok;
+   Lock();
+   if (!writer_running && async) {
+      if (!ring) {
+         ring = (LogRingEntry*)malloc(sizeof(LogRingEntry) * LOG_RING_SIZE);
+         if (ring) {
+            for (n = 0; n < LOG_RING_SIZE; n++) ring[n].seq = n;
+            enqueue_pos = dequeue_pos = written_pos = 0;
+         }
+      }
+      writer_stop = false;
+      if (ring && pthread_create(&writer, NULL, WriterThread, this) == 0) writer_running = true;
+      else async = false;
+   }
+   ok = writer_running;
+   Unlock();
+   return ok;
+}
+
+// Method to write any queued messages and stop the writer thread. Messages
+// logged afterward are written directly.
+void LogHandler::StopWriter()
+{
+   Lock();
+   async = false;
+   if (!writer_running) {
+      Unlock();
+      return;
+   }
+   writer_stop = true;
+   pthread_cond_signal(&wake);
+   Unlock();
+   pthread_join(writer, NULL);
+   writer_running = false;
+}
+
+void* LogHandler::WriterThread(void *arg)
+{
+   ((LogHandler*)arg)->WriterLoop();
+   return NULL;
+}
+
+// Method run by the writer thread to write queued messages in batches,
+// flushing the log file once per batch. After each batch the writer waits
+// LOG_BATCH_MS for more messages. It sleeps while the ring buffer is empty,
+// waking at least once a second.
+void LogHandler::WriterLoop()
+{
+   struct timespec ts;
+   struct timeval tv;
+   Lock();
+   while (true) {
+      if (WriteQueued()) {
+         pthread_cond_broadcast(&flushed);
+         if (writer_stop) continue;
+         gettimeofday(&tv, NULL);
+         tv.tv_usec += LOG_BATCH_MS * 1000;
+         ts.tv_sec = tv.tv_sec + tv.tv_usec / 1000000;
+         ts.tv_nsec = (tv.tv_usec % 1000000) * 1000;
+         pthread_cond_timedwait(&wake, &mut, &ts);
+         continue;
+      }
+      pthread_cond_broadcast(&flushed);
+      if (writer_stop) break;
+      writer_idle = true;
+      __sync_synchronize();
+      if ((long)(ring[dequeue_pos % LOG_RING_SIZE].seq - (dequeue_pos + 1)) < 0) {
+         ts.tv_sec = time(NULL) + 1;
+         ts.tv_nsec = 0;
+         pthread_cond_timedwait(&wake, &mut, &ts);
+      }
+      writer_idle = false;
+   }
+   Unlock();
+}
+
+// Method to write the messages published in the ring buffer to the log file
+// and flush it. The timestamp is formatted once per second. Called by the
+// writer thread with the mutex held. Returns the number of messages written.
+size_t LogHandler::WriteQueued()
+{
+   LogRingEntry *e;
+   struct tm bt;
+   size_t n = 0;
+
+   while (true) {
+      e = &ring[dequeue_pos % LOG_RING_SIZE];
+      if ((long)(e->seq - (dequeue_pos + 1)) < 0) break;
+      __sync_synchronize();
+      if (e->t != stamp_time || !stamp[0]) {
+         stamp_time = e->t;
+         localtime_r(&stamp_time, &bt);
+         strftime(stamp, sizeof(stamp), "%b %d %T: ", &bt);
+      }
+      fputs(stamp, errfs);
+      fwrite(e->msg, 1, e->len, errfs);
+      if (!e->len || e->msg[e->len - 1] != '\n') fputc('\n', errfs);
+      __sync_synchronize();
+      e->seq = dequeue_pos + LOG_RING_SIZE;
+      ++dequeue_pos;
+      ++n;
+   }
+   if (n) {
+      fflush(errfs);
+      written_pos = dequeue_pos;
+   }
+   return n;
+}
+
+// Handler called before fork() to write all queued messages and keep the
+// writer thread from writing while the process is copied
+void LogHandler::ForkPrepare()
+{
+   log.Flush();
+   log.Lock();
+}
+
+// Handler called in the parent after fork()
+void LogHandler::ForkParent()
+{
+   log.Unlock();
+}
+
+// Handler called in the child after fork(), where the writer thread does not
+// exist. The child writes its messages directly until it opens a log.
+void LogHandler::ForkChild()
+{
+   unsigned long n;
+   pthread_mutex_init(&log.mut, NULL);
+   pthread_cond_init(&log.wake, NULL);
+   pthread_cond_init(&log.flushed, NULL);
+   log.writer_running = false;
+   log.writer_idle = false;
+   log.async = false;
+   if (log.ring) {
+      for (n = 0; n < LOG_RING_SIZE; n++) log.ring[n].seq = n;
+   }
+   log.enqueue_pos = log.dequeue_pos = log.written_pos = 0;
+}
+#endif
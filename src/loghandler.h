@@ -28,8 +28,34 @@
 #ifdef HAVE_STDARG_H
 #include <stdarg.h>
 #endif
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
 #ifdef HAVE_PTHREAD_H
 #include <pthread.h>
+#if defined(__GNUC__)
+#define USE_ASYNC_LOG 1
+#endif
+#endif
+
+#ifdef USE_ASYNC_LOG
+/* Number of entries in the ring buffer of messages waiting to be written to
+ * the log file, and the longest message an entry holds */
+#define LOG_RING_SIZE 512
+#define LOG_MSG_SIZE 512
+/* Milliseconds the writer thread waits for more messages after each batch */
+#define LOG_BATCH_MS 5
+
+/* Message waiting in the ring buffer. The sequence number tells the writer
+ * thread when the message has been stored, and the producers when the entry
+ * is free again. */
+struct LogRingEntry
+{
+   volatile unsigned long seq;
+   time_t t;
+   size_t len;
+   char msg[LOG_MSG_SIZE];
+};
 #endif
 
 class LogHandler
@@ -49,11 +75,24 @@ public:
    void Info(const char *fmt, ... );
    void Debug(const char *fmt, ... );
    void MajorDebug(const char *fmt, ... );
+   void Message(int priority, const char *fmt, ... );
+   void Flush();
    inline bool UsingSyslog() { return use_syslog; }
 protected:
    void Lock();
    void Unlock();
    void WriteLog(int priority, const char *fmt, va_list vl);
+#ifdef USE_ASYNC_LOG
+   bool QueueLog(time_t t, const char *msg, size_t len);
+   bool StartWriter();
+   void StopWriter();
+   void WriterLoop();
+   size_t WriteQueued();
+   static void* WriterThread(void *arg);
+   static void ForkPrepare();
+   static void ForkParent();
+   static void ForkChild();
+#endif
 protected:
    bool use_syslog;
    int max_debug_level;
@@ -61,6 +100,21 @@ protected:
 #ifdef HAVE_PTHREAD_H
    pthread_mutex_t mut;
 #endif
+#ifdef USE_ASYNC_LOG
+   bool async;                         /* log file is written by the writer thread */
+   LogRingEntry *ring;
+   volatile unsigned long enqueue_pos; /* next entry producers will store to */
+   unsigned long dequeue_pos;          /* next entry the writer thread will write */
+   volatile unsigned long written_pos; /* entries before this have been flushed */
+   volatile bool writer_running;
+   volatile bool writer_idle;
+   bool writer_stop;
+   pthread_t writer;
+   pthread_cond_t wake;
+   pthread_cond_t flushed;
+   time_t stamp_time;                  /* time of the cached timestamp */
+   char stamp[32];
+#endif
 };
 
 #ifndef LOGHANDLER_SOURCE
@@ -0,0 +1,377 @@
+/* metrics.cpp
+ *
+ *  This file is part of vchanger by Josh Fisher.
+ *
+ *  vchanger copyright (C) 2008-2015 Josh Fisher
+ *
+ *  vchanger is free software.
+ *  You may redistribute it and/or modify it under the terms of the
+ *  GNU General Public License version 2, as published by the Free
+ *  Software Foundation.
+ *
+ *  vchanger is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vchanger.  See the file "COPYING".  If not,
+ *  write to:  The Free Software Foundation, Inc.,
+ *             59 Temple Place - Suite 330,
+ *             Boston,  MA  02111-1307, USA.
+ *
+ *  Provides a class for maintaining a Prometheus textfile of metrics
+ */
+
+#include "config.h"
+#include "compat_defs.h"
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+
+#include "util.h"
+#include "metrics.h"
+
+/* Time to wait for another process to finish updating the metrics file */
+#define METRICS_LOCK_TIMEOUT_MS 2000
+
+/* Upper bounds of histogram buckets, in seconds. A final +Inf bucket
+ * holds the count of all observations. */
+static const double bucket_bound[] = { 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+      0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60 };
+#define NUM_BUCKET_BOUNDS (int)(sizeof(bucket_bound) / sizeof(bucket_bound[0]))
+
+
+/*=================================================
+ *  Class MetricsFile
+ *=================================================*/
+
+MetricsFile::MetricsFile() : lfd(-1)
+{
+}
+
+MetricsFile::~MetricsFile()
+{
+   Close();
+}
+
+
+/*-------------------------------------------------
+ *  Method to define a metric of type 'type' (METRIC_GAUGE, METRIC_COUNTER
+ *  or METRIC_HISTOGRAM). Only defined metrics are read from and written
+ *  to the file.
+ *-------------------------------------------------*/
+void MetricsFile::Define(const char *name, int type, const char *help)
+{
+   MetricFamily mf;
+   if (Find(name)) return;
+   mf.name = name;
+   mf.type = type;
+   mf.help = help;
+   family.push_back(mf);
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to find the definition of metric 'name'.
+ *  Returns NULL if not defined.
+ *-------------------------------------------------*/
+MetricFamily* MetricsFile::Find(const char *name)
+{
+   size_t n;
+   for (n = 0; n < family.size(); n++) {
+      if (family[n].name == name) return &family[n];
+   }
+   return NULL;
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to get the series of metric 'mf' having label
+ *  string 'labels', creating it if needed
+ *-------------------------------------------------*/
+MetricSeries& MetricsFile::GetSeries(MetricFamily *mf, const char *labels)
+{
+   MetricSeries &ms = mf->series[labels ? labels : ""];
+   if (mf->type == METRIC_HISTOGRAM && ms.bucket.empty()) {
+      ms.bucket.resize(NUM_BUCKET_BOUNDS + 1, 0);
+   }
+   return ms;
+}
+
+
+/*-------------------------------------------------
+ *  Method to lock the metrics file 'fname' and read its current values.
+ *  The lock is held until Close() is called. A missing file is not an
+ *  error.
+ *  On success returns zero, else returns errno.
+ *-------------------------------------------------*/
+int MetricsFile::Open(const char *fname)
+{
+   int rc;
+   FILE *fs;
+   tString lockfile, line;
+
+   Close();
+   path = fname;
+   tFormat(lockfile, "%s.lock", fname);
+   lfd = open(lockfile.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+   if (lfd < 0) return errno;
+   rc = lock_fd(lfd, METRICS_LOCK_TIMEOUT_MS);
+   if (rc) {
+      Close();
+      return rc;
+   }
+   fs = fopen(fname, "r");
+   if (!fs) {
+      rc = errno;
+      if (rc == ENOENT) return 0;
+      Close();
+      return rc;
+   }
+   while (tGetLine(line, fs)) {
+      Parse(line.c_str());
+   }
+   fclose(fs);
+   return 0;
+}
+
+
+/*-------------------------------------------------
+ *  Method to release the lock on the metrics file
+ *-------------------------------------------------*/
+void MetricsFile::Close()
+{
+   if (lfd >= 0) {
+      close(lfd);
+      lfd = -1;
+   }
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to parse one line of the metrics file of the form
+ *    name{labels} value
+ *  Comments and metrics that have not been defined are ignored.
+ *-------------------------------------------------*/
+void MetricsFile::Parse(const char *line)
+{
+   size_t n, p, e;
+   int b;
+   double value, le;
+   tString str(line), series, name, labels, suffix;
+   MetricFamily *mf = NULL;
+
+   tStrip(str);
+   if (str.empty() || str[0] == '#') return;
+   p = str.find_last_of(" \t");
+   if (p == tString::npos) return;
+   value = strtod(str.c_str() + p + 1, NULL);
+   series = str.substr(0, p);
+   tStrip(series);
+   p = series.find('{');
+   if (p == tString::npos) {
+      name = series;
+   } else {
+      name = series.substr(0, p);
+      e = series.rfind('}');
+      if (e == tString::npos || e < p) return;
+      labels = series.substr(p + 1, e - p - 1);
+   }
+   /* Find the metric this series belongs to */
+   for (n = 0; n < family.size(); n++) {
+      if (family[n].type != METRIC_HISTOGRAM) {
+         if (family[n].name == name) {
+            mf = &family[n];
+            break;
+         }
+      } else if (name.compare(0, family[n].name.size(), family[n].name) == 0) {
+         suffix = name.substr(family[n].name.size());
+         if (suffix == "_bucket" || suffix == "_sum" || suffix == "_count") {
+            mf = &family[n];
+            break;
+         }
+      }
+   }
+   if (!mf) return;
+   if (mf->type != METRIC_HISTOGRAM) {
+      GetSeries(mf, labels.c_str()).value = value;
+      return;
+   }
+   if (suffix == "_sum") {
+      GetSeries(mf, labels.c_str()).sum = value;
+      return;
+   }
+   if (suffix == "_count") {
+      GetSeries(mf, labels.c_str()).value = value;
+      return;
+   }
+   /* Remove the 'le' label from a bucket's labels to find its series */
+   p = labels.find("le=\"");
+   if (p == tString::npos) return;
+   e = labels.find('"', p + 4);
+   if (e == tString::npos) return;
+   if (labels.compare(p + 4, e - p - 4, "+Inf") == 0) {
+      b = NUM_BUCKET_BOUNDS;
+   } else {
+      le = strtod(labels.c_str() + p + 4, NULL);
+      for (b = 0; b < NUM_BUCKET_BOUNDS; b++) {
+         if (le <= bucket_bound[b] * 1.000001 && le >= bucket_bound[b] * 0.999999) break;
+      }
+      /* Buckets of unknown bounds are discarded */
+      if (b >= NUM_BUCKET_BOUNDS) return;
+   }
+   if (e + 1 < labels.size() && labels[e + 1] == ',') ++e;
+   else if (p > 0 && labels[p - 1] == ',') --p;
+   labels.erase(p, e - p + 1);
+   GetSeries(mf, labels.c_str()).bucket[b] = value;
+}
+
+
+/*-------------------------------------------------
+ *  Method to remove all series of metric 'name'. This is used for gauges
+ *  whose set of label values, such as magazine bays, may change.
+ *-------------------------------------------------*/
+void MetricsFile::Clear(const char *name)
+{
+   MetricFamily *mf = Find(name);
+   if (mf) mf->series.clear();
+}
+
+
+/*-------------------------------------------------
+ *  Method to set the value of a series of gauge 'name'
+ *-------------------------------------------------*/
+void MetricsFile::Set(const char *name, const char *labels, double value)
+{
+   MetricFamily *mf = Find(name);
+   if (!mf || mf->type == METRIC_HISTOGRAM) return;
+   GetSeries(mf, labels).value = value;
+}
+
+
+/*-------------------------------------------------
+ *  Method to increment a series of counter 'name' by 'value'
+ *-------------------------------------------------*/
+void MetricsFile::Add(const char *name, const char *labels, double value)
+{
+   MetricFamily *mf = Find(name);
+   if (!mf || mf->type == METRIC_HISTOGRAM) return;
+   GetSeries(mf, labels).value += value;
+}
+
+
+/*-------------------------------------------------
+ *  Method to add observation 'value' to a series of histogram 'name'
+ *-------------------------------------------------*/
+void MetricsFile::Observe(const char *name, const char *labels, double value)
+{
+   int b;
+   MetricFamily *mf = Find(name);
+   if (!mf || mf->type != METRIC_HISTOGRAM) return;
+   MetricSeries &ms = GetSeries(mf, labels);
+   for (b = 0; b < NUM_BUCKET_BOUNDS; b++) {
+      if (value <= bucket_bound[b]) ms.bucket[b] += 1;
+   }
+   ms.bucket[NUM_BUCKET_BOUNDS] += 1;
+   ms.value += 1;
+   ms.sum += value;
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to format all metrics in the text exposition format
+ *-------------------------------------------------*/
+void MetricsFile::Format(tString &out)
+{
+   size_t n;
+   int b;
+   std::map<tString, MetricSeries>::const_iterator it;
+   tString tmp, lbl;
+   static const char *type_name[] = { "gauge", "counter", "histogram" };
+
+   out.clear();
+   for (n = 0; n < family.size(); n++) {
+      const MetricFamily &mf = family[n];
+      if (mf.series.empty()) continue;
+      tFormat(tmp, "# HELP %s %s\n# TYPE %s %s\n", mf.name.c_str(), mf.help.c_str(),
+            mf.name.c_str(), type_name[mf.type]);
+      out += tmp;
+      for (it = mf.series.begin(); it != mf.series.end(); it++) {
+         if (it->first.empty()) lbl.clear();
+         else tFormat(lbl, "{%s}", it->first.c_str());
+         if (mf.type != METRIC_HISTOGRAM) {
+            tFormat(tmp, "%s%s %.15g\n", mf.name.c_str(), lbl.c_str(), it->second.value);
+            out += tmp;
+            continue;
+         }
+         for (b = 0; b <= NUM_BUCKET_BOUNDS; b++) {
+            if (b < NUM_BUCKET_BOUNDS) tFormat(lbl, "le=\"%g\"", bucket_bound[b]);
+            else lbl = "le=\"+Inf\"";
+            tFormat(tmp, "%s_bucket{%s%s%s} %.15g\n", mf.name.c_str(), it->first.c_str(),
+                  it->first.empty() ? "" : ",", lbl.c_str(), it->second.bucket[b]);
+            out += tmp;
+         }
+         if (it->first.empty()) lbl.clear();
+         else tFormat(lbl, "{%s}", it->first.c_str());
+         tFormat(tmp, "%s_sum%s %.9g\n%s_count%s %.15g\n", mf.name.c_str(), lbl.c_str(),
+               it->second.sum, mf.name.c_str(), lbl.c_str(), it->second.value);
+         out += tmp;
+      }
+   }
+}
+
+
+/*-------------------------------------------------
+ *  Method to write the metrics to the file given to Open(). The metrics
+ *  are written to a temporary file that is renamed over the metrics file
+ *  so that the textfile collector never reads a partial file.
+ *  On success returns zero, else returns errno.
+ *-------------------------------------------------*/
+int MetricsFile::Commit()
+{
+   int rc;
+   FILE *fs;
+   tString out, tmp_path;
+
+   if (lfd < 0) return EBADF;
+   Format(out);
+   tFormat(tmp_path, "%s.tmp", path.c_str());
+   fs = fopen(tmp_path.c_str(), "w");
+   if (!fs) return errno;
+   if (fwrite(out.data(), 1, out.size(), fs) != out.size()) {
+      rc = errno;
+      fclose(fs);
+      unlink(tmp_path.c_str());
+      return rc ? rc : EIO;
+   }
+   if (fclose(fs)) {
+      rc = errno;
+      unlink(tmp_path.c_str());
+      return rc ? rc : EIO;
+   }
+   if (rename(tmp_path.c_str(), path.c_str())) {
+      rc = errno;
+      unlink(tmp_path.c_str());
+      return rc;
+   }
+   return 0;
+}
@@ -0,0 +1,88 @@
+/* metrics.h
+ *
+ *  This file is part of vchanger by Josh Fisher.
+ *
+ *  vchanger copyright (C) 2008-2015 Josh Fisher
+ *
+ *  vchanger is free software.
+ *  You may redistribute it and/or modify it under the terms of the
+ *  GNU General Public License version 2, as published by the Free
+ *  Software Foundation.
+ *
+ *  vchanger is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vchanger.  See the file "COPYING".  If not,
+ *  write to:  The Free Software Foundation, Inc.,
+ *             59 Temple Place - Suite 330,
+ *             Boston,  MA  02111-1307, USA.
+ */
+#ifndef _METRICS_H_
+#define _METRICS_H_ 1
+
+#include <map>
+#include <vector>
+#include "tstring.h"
+
+#define METRIC_GAUGE 0
+#define METRIC_COUNTER 1
+#define METRIC_HISTOGRAM 2
+
+/* Value of one labelled series of a metric */
+class MetricSeries
+{
+public:
+   MetricSeries() : value(0), sum(0) {}
+public:
+   double value;                 /* gauge or counter value, or histogram count */
+   double sum;                   /* sum of histogram observations */
+   std::vector<double> bucket;   /* cumulative histogram bucket counts */
+};
+
+/* A metric and all of its labelled series */
+class MetricFamily
+{
+public:
+   MetricFamily() : type(METRIC_GAUGE) {}
+public:
+   tString name;
+   tString help;
+   int type;
+   std::map<tString, MetricSeries> series;   /* keyed by label string */
+};
+
+/*
+ *  Class to maintain a file of metrics in the Prometheus text exposition
+ *  format, as read by the node_exporter textfile collector. Since each
+ *  vchanger invocation is a separate process, counters and histograms are
+ *  accumulated by reading the previous file, updating it, and writing it
+ *  back. The file is updated under a lock and replaced atomically.
+ */
+class MetricsFile
+{
+public:
+   MetricsFile();
+   virtual ~MetricsFile();
+   void Define(const char *name, int type, const char *help);
+   int Open(const char *path);
+   int Commit();
+   void Close();
+   void Clear(const char *name);
+   void Set(const char *name, const char *labels, double value);
+   void Add(const char *name, const char *labels, double value = 1);
+   void Observe(const char *name, const char *labels, double value);
+protected:
+   MetricFamily* Find(const char *name);
+   MetricSeries& GetSeries(MetricFamily *mf, const char *labels);
+   void Parse(const char *line);
+   void Format(tString &out);
+protected:
+   int lfd;
+   tString path;
+   std::vector<MetricFamily> family;
+};
+
+#endif /* _METRICS_H_ */
@@ -46,6 +46,7 @@
 #endif
 
 #include "loghandler.h"
+#include "timing.h"
 #include "mypopen.h"
 
 /*
@@ -565,6 +566,8 @@ static int do_mypopen_raw(const char *cline, int *fno_stdin, int *fno_stdout, in
  */
 int mypopen_raw(const char *command, int *fno_stdin, int *fno_stdout, int *fno_stderr)
 {
+   TraceSpan span("mypopen_raw");
+   span.SetArg("command", command);
    return do_mypopen_raw(command, fno_stdin, fno_stdout, fno_stderr);
 }
 
@@ -0,0 +1,110 @@
+/* outbuf.cpp
+ *
+ *  This file is part of vchanger by Josh Fisher.
+ *
+ *  vchanger copyright (C) 2008-2015 Josh Fisher
+ *
+ *  vchanger is free software.
+ *  You may redistribute it and/or modify it under the terms of the
+ *  GNU General Public License version 2, as published by the Free
+ *  Software Foundation.
+ *
+ *  vchanger is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vchanger.  See the file "COPYING".  If not,
+ *  write to:  The Free Software Foundation, Inc.,
+ *             59 Temple Place - Suite 330,
+ *             Boston,  MA  02111-1307, USA.
+ *
+ *  Provides a class for buffering command output
+ */
+
+#include "config.h"
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <new>
+
+#include "outbuf.h"
+
+
+/*=================================================
+ *  Class OutputBuffer
+ *=================================================*/
+
+OutputBuffer::~OutputBuffer()
+{
+   if (buf) free(buf);
+}
+
+
+/*-------------------------------------------------
+ *  Method to ensure the buffer can hold at least 'n' bytes
+ *-------------------------------------------------*/
+void OutputBuffer::reserve(size_t n)
+{
+   char *p;
+   size_t newcap;
+
+   if (n <= cap) return;
+   newcap = cap ? cap : 4096;
+   while (newcap < n) newcap *= 2;
+   p = (char*)realloc(buf, newcap);
+   if (!p) throw std::bad_alloc();
+   buf = p;
+   cap = newcap;
+}
+
+
+/*-------------------------------------------------
+ *  Method to append the decimal representation of 'i'
+ *-------------------------------------------------*/
+OutputBuffer& OutputBuffer::AppendInt(long i)
+{
+   char tmp[24];
+   char *p = tmp + sizeof(tmp);
+   unsigned long u = i < 0 ? 0UL - (unsigned long)i : (unsigned long)i;
+
+   do {
+      *--p = (char)('0' + u % 10);
+      u /= 10;
+   } while (u);
+   if (i < 0) *--p = '-';
+   return Append(p, tmp + sizeof(tmp) - p);
+}
+
+
+/*-------------------------------------------------
+ *  Method to write the buffer contents to file descriptor 'fd'.
+ *  Normally this is a single write() call, but short writes
+ *  and interrupted calls are retried.
+ *  On success returns zero, else returns errno.
+ *-------------------------------------------------*/
+int OutputBuffer::Write(int fd)
+{
+   ssize_t n;
+   size_t pos = 0;
+
+   while (pos < len) {
+      n = write(fd, buf + pos, len - pos);
+      if (n < 0) {
+         if (errno == EINTR) continue;
+         return errno;
+      }
+      pos += (size_t)n;
+   }
+   return 0;
+}
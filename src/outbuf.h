@@ -0,0 +1,63 @@
+/* outbuf.h
+ *
+ *  This file is part of vchanger by Josh Fisher.
+ *
+ *  vchanger copyright (C) 2008-2015 Josh Fisher
+ *
+ *  vchanger is free software.
+ *  You may redistribute it and/or modify it under the terms of the
+ *  GNU General Public License version 2, as published by the Free
+ *  Software Foundation.
+ *
+ *  vchanger is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vchanger.  See the file "COPYING".  If not,
+ *  write to:  The Free Software Foundation, Inc.,
+ *             59 Temple Place - Suite 330,
+ *             Boston,  MA  02111-1307, USA.
+ */
+#ifndef _OUTBUF_H_
+#define _OUTBUF_H_ 1
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#include "tstring.h"
+
+/*
+ *  Class to build command output in a single contiguous buffer so that it
+ *  can be sent with one write() call instead of one stdio call per line.
+ *  Integers are formatted directly into the buffer without printf.
+ */
+class OutputBuffer
+{
+public:
+   OutputBuffer() : buf(NULL), len(0), cap(0) {}
+   virtual ~OutputBuffer();
+   inline void clear() { len = 0; }
+   inline bool empty() const { return len == 0; }
+   inline size_t size() const { return len; }
+   inline const char* data() const { return buf; }
+   void reserve(size_t n);
+   inline OutputBuffer& Append(const char *s, size_t n)
+      { if (len + n > cap) reserve(len + n); memcpy(buf + len, s, n); len += n; return *this; }
+   inline OutputBuffer& Append(const char *s) { return Append(s, strlen(s)); }
+   inline OutputBuffer& Append(const tString &s) { return Append(s.data(), s.size()); }
+   inline OutputBuffer& Append(char c)
+      { if (len + 1 > cap) reserve(len + 1); buf[len++] = c; return *this; }
+   OutputBuffer& AppendInt(long i);
+   int Write(int fd);
+protected:
+   char *buf;
+   size_t len;
+   size_t cap;
+private:
+   OutputBuffer(const OutputBuffer&);
+   OutputBuffer& operator=(const OutputBuffer&);
+};
+
+#endif /* _OUTBUF_H_ */
@@ -0,0 +1,412 @@
+/* timing.cpp
+ *
+ *  This file is part of vchanger by Josh Fisher.
+ *
+ *  vchanger copyright (C) 2008-2015 Josh Fisher
+ *
+ *  vchanger is free software.
+ *  You may redistribute it and/or modify it under the terms of the
+ *  GNU General Public License version 2, as published by the Free
+ *  Software Foundation.
+ *
+ *  vchanger is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vchanger.  See the file "COPYING".  If not,
+ *  write to:  The Free Software Foundation, Inc.,
+ *             59 Temple Place - Suite 330,
+ *             Boston,  MA  02111-1307, USA.
+ *
+ *  Provides classes for timing the phases of a vchanger invocation
+ */
+
+#include "config.h"
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+
+#include "compat/gettimeofday.h"
+#include "util.h"
+#include "loghandler.h"
+#define TIMING_SOURCE 1
+#include "timing.h"
+
+InvocationTimer timing;
+
+
+/*-------------------------------------------------
+ *  Function to get an integer identifying the calling thread
+ *-------------------------------------------------*/
+static long trace_tid()
+{
+#ifdef SYS_gettid
+   return (long)syscall(SYS_gettid);
+#else
+   return (long)getpid();
+#endif
+}
+
+
+/*-------------------------------------------------
+ *  Function to append 'str' to 'out' as a quoted JSON string
+ *-------------------------------------------------*/
+static void json_quote(tString &out, const char *str)
+{
+   char hex[8];
+   out += '"';
+   for (; *str; str++) {
+      switch (*str) {
+      case '"':
+         out += "\\\"";
+         break;
+      case '\\':
+         out += "\\\\";
+         break;
+      case '\n':
+         out += "\\n";
+         break;
+      default:
+         if ((unsigned char)*str < 0x20) {
+            snprintf(hex, sizeof(hex), "\\u%04x", (unsigned char)*str);
+            out += hex;
+         } else out += *str;
+         break;
+      }
+   }
+   out += '"';
+}
+
+
+/*=================================================
+ *  Class InvocationTimer
+ *=================================================*/
+
+InvocationTimer::InvocationTimer() : log_level(LOG_INFO)
+{
+   gettimeofday(&tv_start, NULL);
+#ifdef HAVE_PTHREAD_H
+   pthread_mutex_init(&mut, NULL);
+#endif
+}
+
+InvocationTimer::~InvocationTimer()
+{
+#ifdef HAVE_PTHREAD_H
+   pthread_mutex_destroy(&mut);
+#endif
+}
+
+void InvocationTimer::Lock()
+{
+#ifdef HAVE_PTHREAD_H
+   pthread_mutex_lock(&mut);
+#endif
+}
+
+void InvocationTimer::Unlock()
+{
+#ifdef HAVE_PTHREAD_H
+   pthread_mutex_unlock(&mut);
+#endif
+}
+
+
+/*-------------------------------------------------
+ *  Method to mark the start of the invocation and discard
+ *  any phases already recorded
+ *-------------------------------------------------*/
+void InvocationTimer::Start()
+{
+   Lock();
+   gettimeofday(&tv_start, NULL);
+   phase.clear();
+   trace.clear();
+   Unlock();
+}
+
+
+/*-------------------------------------------------
+ *  Method to get microseconds elapsed since the invocation started
+ *-------------------------------------------------*/
+long InvocationTimer::Elapsed() const
+{
+   struct timeval now;
+   gettimeofday(&now, NULL);
+   return timeval_et((struct timeval*)&tv_start, &now);
+}
+
+
+/*-------------------------------------------------
+ *  Method to record that phase 'name' of magazine 'bay' (or of the
+ *  invocation if 'bay' is negative) took 'usec' microseconds and
+ *  performed 'count' operations. Times of a phase recorded more than
+ *  once are summed.
+ *-------------------------------------------------*/
+void InvocationTimer::Record(const char *name, int bay, long usec, long count)
+{
+   size_t n;
+   tString pname;
+
+   if (bay >= 0) tFormat(pname, "bay%d_%s", bay, name);
+   else pname = name;
+   if (count >= 0) log.Message(log_level, "timing: %s %ld us, %ld ops", pname.c_str(), usec, count);
+   else log.Message(log_level, "timing: %s %ld us", pname.c_str(), usec);
+   Lock();
+   for (n = 0; n < phase.size(); n++) {
+      if (phase[n].name == pname) break;
+   }
+   if (n >= phase.size()) {
+      phase.push_back(PhaseTime());
+      phase[n].name = pname;
+   }
+   phase[n].usec += usec;
+   if (count >= 0) phase[n].count = (phase[n].count < 0 ? 0 : phase[n].count) + count;
+   ++phase[n].calls;
+   Unlock();
+}
+
+
+/*-------------------------------------------------
+ *  Method to get the total microseconds recorded for phase 'name' of
+ *  magazine 'bay', or of the invocation if 'bay' is negative.
+ *  Returns -1 if the phase was not recorded.
+ *-------------------------------------------------*/
+long InvocationTimer::PhaseUsec(const char *name, int bay)
+{
+   size_t n;
+   long usec = -1;
+   tString pname;
+
+   if (bay >= 0) tFormat(pname, "bay%d_%s", bay, name);
+   else pname = name;
+   Lock();
+   for (n = 0; n < phase.size(); n++) {
+      if (phase[n].name == pname) {
+         usec = phase[n].usec;
+         break;
+      }
+   }
+   Unlock();
+   return usec;
+}
+
+
+/*-------------------------------------------------
+ *  Method to log a single line summarizing all phases of the invocation
+ *  as space separated key=value pairs, for example:
+ *    timing: cmd=list rc=0 pid=123 total_us=5120 config_us=80 ...
+ *  Phases that counted operations also have a name_ops key.
+ *-------------------------------------------------*/
+void InvocationTimer::Summary(const char *cmd, int rc)
+{
+   size_t n;
+   tString line, tmp;
+
+   tFormat(line, "timing: cmd=%s rc=%d pid=%d total_us=%ld", cmd, rc, (int)getpid(), Elapsed());
+   Lock();
+   for (n = 0; n < phase.size(); n++) {
+      tFormat(tmp, " %s_us=%ld", phase[n].name.c_str(), phase[n].usec);
+      line += tmp;
+      if (phase[n].count >= 0) {
+         tFormat(tmp, " %s_ops=%ld", phase[n].name.c_str(), phase[n].count);
+         line += tmp;
+      }
+   }
+   Unlock();
+   log.Message(log_level, "%s", line.c_str());
+}
+
+
+
+/*-------------------------------------------------
+ *  Method to add a trace event named 'name' of category 'cat' that
+ *  started at time 'start' and took 'usec' microseconds. The 'args'
+ *  string holds JSON object members describing the event, or is empty.
+ *-------------------------------------------------*/
+void InvocationTimer::Trace(const char *name, const char *cat, const struct timeval *start,
+      long usec, const tString &args)
+{
+   TraceEvent e;
+
+   e.name = name;
+   e.cat = cat;
+   e.args = args;
+   e.ts = (long long)start->tv_sec * 1000000LL + start->tv_usec;
+   e.dur = usec;
+   e.tid = trace_tid();
+   Lock();
+   trace.push_back(e);
+   Unlock();
+}
+
+
+/*-------------------------------------------------
+ *  Method to write the trace events of this invocation to file 'fname'
+ *  in Chrome trace event format. Any "%p" in 'fname' is replaced by the
+ *  process id so that concurrent invocations write separate files. The
+ *  file is written to a temporary file and renamed so that readers never
+ *  see a partial trace.
+ *  On success returns zero, else returns errno.
+ *-------------------------------------------------*/
+int InvocationTimer::WriteTrace(const char *fname, const char *cmd, int rc)
+{
+   size_t n;
+   int err, pid = (int)getpid();
+   FILE *fs;
+   tString path, tmp_path, out, tmp;
+   struct timeval now;
+
+   if (!fname || !fname[0]) return 0;
+   for (; *fname; fname++) {
+      if (fname[0] == '%' && fname[1] == 'p') {
+         tFormat(tmp, "%d", pid);
+         path += tmp;
+         ++fname;
+      } else path += *fname;
+   }
+   gettimeofday(&now, NULL);
+   out = "{\"traceEvents\":[\n";
+   /* Name the process after the command being performed */
+   tFormat(tmp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+         "\"args\":{\"name\":\"vchanger %s\"}}", pid, pid, cmd);
+   out += tmp;
+   tFormat(tmp, ",\n{\"name\":\"%s\",\"cat\":\"invocation\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+         "\"ts\":%lld,\"dur\":%ld,\"args\":{\"rc\":%d}}", cmd, pid, pid,
+         (long long)tv_start.tv_sec * 1000000LL + tv_start.tv_usec,
+         timeval_et((struct timeval*)&tv_start, &now), rc);
+   out += tmp;
+   Lock();
+   for (n = 0; n < trace.size(); n++) {
+      out += ",\n{\"name\":";
+      json_quote(out, trace[n].name.c_str());
+      tFormat(tmp, ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%ld,\"ts\":%lld,\"dur\":%ld",
+            trace[n].cat.c_str(), pid, trace[n].tid, trace[n].ts, trace[n].dur);
+      out += tmp;
+      if (!trace[n].args.empty()) {
+         out += ",\"args\":{";
+         out += trace[n].args;
+         out += '}';
+      }
+      out += '}';
+   }
+   Unlock();
+   out += "\n],\"displayTimeUnit\":\"ms\"}\n";
+
+   tFormat(tmp_path, "%s.tmp", path.c_str());
+   fs = fopen(tmp_path.c_str(), "w");
+   if (!fs) return errno;
+   if (fwrite(out.data(), 1, out.size(), fs) != out.size()) {
+      err = errno;
+      fclose(fs);
+      unlink(tmp_path.c_str());
+      return err ? err : EIO;
+   }
+   if (fclose(fs)) {
+      err = errno;
+      unlink(tmp_path.c_str());
+      return err ? err : EIO;
+   }
+   if (rename(tmp_path.c_str(), path.c_str())) {
+      err = errno;
+      unlink(tmp_path.c_str());
+      return err;
+   }
+   return 0;
+}
+
+
+/*=================================================
+ *  Class PhaseTimer
+ *=================================================*/
+
+PhaseTimer::PhaseTimer(const char *phase, int b) : name(phase), bay(b), count(-1), stopped(false)
+{
+   gettimeofday(&tv_start, NULL);
+}
+
+
+/*-------------------------------------------------
+ *  Method to stop timing the phase and record it
+ *-------------------------------------------------*/
+void PhaseTimer::Stop()
+{
+   long usec;
+   struct timeval now;
+   tString args, tmp;
+
+   if (stopped) return;
+   stopped = true;
+   gettimeofday(&now, NULL);
+   usec = timeval_et(&tv_start, &now);
+   timing.Record(name, bay, usec, count);
+   if (bay >= 0) tFormat(args, "\"bay\":%d", bay);
+   if (count >= 0) {
+      tFormat(tmp, "%s\"ops\":%ld", args.empty() ? "" : ",", count);
+      args += tmp;
+   }
+   timing.Trace(name, "phase", &tv_start, usec, args);
+}
+
+
+
+/*=================================================
+ *  Class TraceSpan
+ *=================================================*/
+
+TraceSpan::TraceSpan(const char *span, int bay) : name(span), stopped(false)
+{
+   if (bay >= 0) tFormat(args, "\"bay\":%d", bay);
+   gettimeofday(&tv_start, NULL);
+}
+
+
+/*-------------------------------------------------
+ *  Methods to add an argument describing the span
+ *-------------------------------------------------*/
+void TraceSpan::SetArg(const char *key, const char *value)
+{
+   if (!args.empty()) args += ',';
+   json_quote(args, key);
+   args += ':';
+   json_quote(args, value);
+}
+
+void TraceSpan::SetArg(const char *key, long value)
+{
+   tString tmp;
+   if (!args.empty()) args += ',';
+   json_quote(args, key);
+   tFormat(tmp, ":%ld", value);
+   args += tmp;
+}
+
+
+/*-------------------------------------------------
+ *  Method to stop the span and add it to the trace
+ *-------------------------------------------------*/
+void TraceSpan::Stop()
+{
+   struct timeval now;
+   if (stopped) return;
+   stopped = true;
+   gettimeofday(&now, NULL);
+   timing.Trace(name, "span", &tv_start, timeval_et(&tv_start, &now), args);
+}
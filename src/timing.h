@@ -0,0 +1,139 @@
+/* timing.h
+ *
+ *  This file is part of vchanger by Josh Fisher.
+ *
+ *  vchanger copyright (C) 2008-2015 Josh Fisher
+ *
+ *  vchanger is free software.
+ *  You may redistribute it and/or modify it under the terms of the
+ *  GNU General Public License version 2, as published by the Free
+ *  Software Foundation.
+ *
+ *  vchanger is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vchanger.  See the file "COPYING".  If not,
+ *  write to:  The Free Software Foundation, Inc.,
+ *             59 Temple Place - Suite 330,
+ *             Boston,  MA  02111-1307, USA.
+ */
+#ifndef _TIMING_H_
+#define _TIMING_H_ 1
+
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#include <vector>
+#include "tstring.h"
+
+/* Elapsed time and operation count of one phase of an invocation */
+class PhaseTime
+{
+public:
+   PhaseTime() : usec(0), count(-1), calls(0) {}
+public:
+   tString name;  /* phase name, prefixed with "bayN_" for per-magazine phases */
+   long usec;     /* total elapsed wall-clock time */
+   long count;    /* system calls or other operations counted, or -1 if not counted */
+   int calls;     /* number of times the phase was timed */
+};
+
+/* A complete event in Chrome/Perfetto trace event format */
+class TraceEvent
+{
+public:
+   TraceEvent() : ts(0), dur(0), tid(0) {}
+public:
+   tString name;
+   tString cat;   /* "phase" for timed phases, "span" for other traced spans */
+   tString args;  /* JSON object members, without the enclosing braces */
+   long long ts;  /* start time in microseconds since the epoch */
+   long dur;      /* duration in microseconds */
+   long tid;      /* thread that performed the work */
+};
+
+/*
+ *  Class to collect the elapsed time of each phase of a vchanger invocation.
+ *  Each phase is logged when it ends, and a single summary line of all phases
+ *  is logged when the invocation finishes. Phases and other spans of work
+ *  are also kept as trace events that may be written to a file in Chrome
+ *  trace event format for viewing in chrome://tracing or Perfetto. Phases
+ *  and spans may be recorded by more than one thread.
+ */
+class InvocationTimer
+{
+public:
+   InvocationTimer();
+   virtual ~InvocationTimer();
+   void Start();
+   inline void SetLogLevel(int level) { log_level = level; }
+   void Record(const char *phase, int bay, long usec, long count = -1);
+   void Summary(const char *cmd, int rc);
+   void Trace(const char *name, const char *cat, const struct timeval *start, long usec,
+         const tString &args);
+   int WriteTrace(const char *fname, const char *cmd, int rc);
+   long PhaseUsec(const char *name, int bay = -1);
+   long Elapsed() const;
+protected:
+   void Lock();
+   void Unlock();
+protected:
+   struct timeval tv_start;
+   int log_level;
+   std::vector<PhaseTime> phase;
+   std::vector<TraceEvent> trace;
+#ifdef HAVE_PTHREAD_H
+   pthread_mutex_t mut;
+#endif
+};
+
+/*
+ *  Class to time one phase. The phase is recorded in the global
+ *  InvocationTimer when Stop() is called or the object is destroyed.
+ */
+class PhaseTimer
+{
+public:
+   PhaseTimer(const char *phase, int bay = -1);
+   virtual ~PhaseTimer() { Stop(); }
+   inline void AddCount(long n) { count = (count < 0 ? 0 : count) + n; }
+   void Stop();
+protected:
+   const char *name;
+   int bay;
+   long count;
+   bool stopped;
+   struct timeval tv_start;
+};
+
+/*
+ *  Class to trace a span of work that is not a phase of the timing summary.
+ *  The span is added to the global InvocationTimer's trace events when
+ *  Stop() is called or the object is destroyed.
+ */
+class TraceSpan
+{
+public:
+   TraceSpan(const char *name, int bay = -1);
+   virtual ~TraceSpan() { Stop(); }
+   void SetArg(const char *key, const char *value);
+   void SetArg(const char *key, long value);
+   void Stop();
+protected:
+   const char *name;
+   bool stopped;
+   tString args;
+   struct timeval tv_start;
+};
+
+#ifndef TIMING_SOURCE
+extern InvocationTimer timing;
+#endif
+
+#endif /* _TIMING_H_ */
@@ -243,6 +243,41 @@ int tCaseCmp(const char *a, const char *b)
    return strcasecmp(a, b);
 }
 
+/*
+ *  Function to compare strings in natural order, where embedded runs of
+ *  digits are compared by their numeric value, so that "vol_2" sorts
+ *  before "vol_10". Strings that are numerically equal, but differ in
+ *  leading zeros, are ordered by strcmp().
+ */
+int tNaturalCmp(const char *a_in, const char *b_in)
+{
+   const char *a = a_in, *b = b_in, *da, *db;
+   size_t na, nb;
+
+   if (!a || !b) return a ? 1 : (b ? -1 : 0);
+   while (*a && *b) {
+      if (isdigit((unsigned char)*a) && isdigit((unsigned char)*b)) {
+         /* Compare digit runs by value, ignoring leading zeros */
+         while (*a == '0') ++a;
+         while (*b == '0') ++b;
+         for (da = a; isdigit((unsigned char)*da); da++) ;
+         for (db = b; isdigit((unsigned char)*db); db++) ;
+         na = da - a;
+         nb = db - b;
+         if (na != nb) return na < nb ? -1 : 1;
+         for (; a < da; a++, b++) {
+            if (*a != *b) return (unsigned char)*a < (unsigned char)*b ? -1 : 1;
+         }
+         continue;
+      }
+      if (*a != *b) return (unsigned char)*a < (unsigned char)*b ? -1 : 1;
+      ++a;
+      ++b;
+   }
+   if (*a || *b) return *a ? 1 : -1;
+   return strcmp(a_in, b_in);
+}
+
 /*
  *  Function to do case-insensitive search for character b from position pos
  *  in string a
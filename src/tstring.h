@@ -70,6 +70,7 @@ int tCaseCmp(const char *a, const char *b);
 inline int tCaseCmp(const tString &a, const char *b) { return tCaseCmp(a.c_str(), b); }
 inline int tCaseCmp(const char *a, const tString &b) { return tCaseCmp(a, b.c_str()); }
 inline int tCaseCmp(const tString &a, const tString &b) { return tCaseCmp(a.c_str(), b.c_str()); }
+int tNaturalCmp(const char *a, const char *b);
 const char* tGetLine(tString &str, FILE *FS);
 const char* tFormat(tString &str, const char *fmt, ...);
 char tParseStandard(tString &word, const char *str, size_t &pos, tString special = "", tString ws = "");
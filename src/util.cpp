@@ -52,6 +52,24 @@
 #ifdef HAVE_FCNTL_H
 #include <fcntl.h>
 #endif
+#ifdef HAVE_SYS_STATVFS_H
+#include <sys/statvfs.h>
+#endif
+#ifdef HAVE_SYS_VFS_H
+#include <sys/vfs.h>
+#elif defined(HAVE_SYS_MOUNT_H)
+#include <sys/param.h>
+#include <sys/mount.h>
+#endif
+#ifdef HAVE_SYS_IOCTL_H
+#include <sys/ioctl.h>
+#endif
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 #ifdef HAVE_GRP_H
 #include <grp.h>
 #endif
@@ -65,8 +83,21 @@
 #include <sys/time.h>
 #endif
 
+#include "compat/gettimeofday.h"
+#include "compat/sleep.h"
 #include "util.h"
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+/* Most bytes passed to one kernel copy call */
+#define COPY_CHUNK_SIZE (1024L * 1024L * 1024L)
+/* Size of buffer used when the data must be copied through user space */
+#define COPY_BUF_SIZE (1024 * 1024)
+
 /*-------------------------------------------------
  *  Function to return elapsed time between two struct timeval values
  *  in microseconds.
@@ -103,46 +134,329 @@ int exclusive_fopen(const char *fname, FILE **fs)
 
 
 /*-------------------------------------------------
- *  Function to copy file 'from_path' to new file 'to_path'.
+ *  Function to obtain an exclusive advisory lock on open file 'fd'. If
+ *  another process holds the lock, then retries every 10 milliseconds
+ *  for up to 'timeout_ms' milliseconds. The lock is released when 'fd' is
+ *  closed or the process exits, so a lock is never left stale by a process
+ *  that dies while holding it.
+ *  On success returns zero, else returns errno.
+ *------------------------------------------------*/
+int lock_fd(int fd, long timeout_ms)
+{
+#ifdef F_SETLK
+   struct flock fl;
+#ifdef HAVE_NANOSLEEP
+   struct timespec ts;
+#endif
+
+   memset(&fl, 0, sizeof(fl));
+   fl.l_type = F_WRLCK;
+   fl.l_whence = SEEK_SET;
+   while (fcntl(fd, F_SETLK, &fl)) {
+      if (errno != EACCES && errno != EAGAIN && errno != EINTR) return errno;
+      if (timeout_ms <= 0) return EAGAIN;
+#ifdef HAVE_NANOSLEEP
+      ts.tv_sec = 0;
+      ts.tv_nsec = 10000000;
+      nanosleep(&ts, NULL);
+      timeout_ms -= 10;
+#else
+      sleep(1);
+      timeout_ms -= 1000;
+#endif
+   }
+#endif
+   return 0;
+}
+
+
+/*-------------------------------------------------
+ *  Function to parse a size given as an integer optionally followed by
+ *  a K, M, G or T binary multiplier, as in "64G", storing the number of
+ *  bytes in 'size'.
+ *  On success returns zero, else returns EINVAL.
+ *------------------------------------------------*/
+int parse_size(const char *str, long long *size)
+{
+   char *end;
+   long long v;
+
+   errno = 0;
+   v = strtoll(str, &end, 10);
+   if (errno || end == str || v < 0) return EINVAL;
+   while (*end == ' ') ++end;
+   switch (toupper(*end)) {
+   case 'T':
+      v *= 1024;
+      /* fall through */
+   case 'G':
+      v *= 1024;
+      /* fall through */
+   case 'M':
+      v *= 1024;
+      /* fall through */
+   case 'K':
+      v *= 1024;
+      ++end;
+      if (toupper(*end) == 'I') ++end;
+      if (toupper(*end) == 'B') ++end;
+      break;
+   case 'B':
+      ++end;
+      break;
+   }
+   if (*end) return EINVAL;
+   *size = v;
+   return 0;
+}
+
+
+/*-------------------------------------------------
+ *  Function to get the space of the filesystem holding 'path'. On return,
+ *  'avail' is the number of bytes available to unprivileged users and
+ *  'total' is the size of the filesystem in bytes.
+ *  On success returns zero, else returns errno.
+ *------------------------------------------------*/
+int fs_space(const char *path, long long *avail, long long *total)
+{
+#if defined(HAVE_STATVFS) && defined(HAVE_SYS_STATVFS_H)
+   struct statvfs st;
+
+   if (statvfs(path, &st)) return errno;
+   *avail = (long long)st.f_bavail * (long long)st.f_frsize;
+   *total = (long long)st.f_blocks * (long long)st.f_frsize;
+   return 0;
+#else
+   *avail = *total = 0;
+   return ENOSYS;
+#endif
+}
+
+
+/*-------------------------------------------------
+ *  Function to determine if the filesystem holding 'path' keeps the
+ *  modification times of its directories. FAT and exFAT do not store a
+ *  time for the root directory, and not all systems update the time of
+ *  other directories on them when files are added or removed.
+ *  Returns false for such filesystems, else returns true.
+ *------------------------------------------------*/
+bool fs_has_dir_times(const char *path)
+{
+#if defined(HAVE_STATFS) && defined(HAVE_SYS_VFS_H)
+   struct statfs st;
+
+   if (statfs(path, &st)) return true;
+   /* MSDOS_SUPER_MAGIC and EXFAT_SUPER_MAGIC */
+   if (st.f_type == 0x4d44 || (unsigned long)st.f_type == 0x2011bab0UL) return false;
+#elif defined(HAVE_STATFS) && defined(HAVE_SYS_MOUNT_H)
+   struct statfs st;
+
+   if (statfs(path, &st)) return true;
+   if (strcmp(st.f_fstypename, "msdosfs") == 0 || strcmp(st.f_fstypename, "exfat") == 0) return false;
+#endif
+   return true;
+}
+
+
+/*-------------------------------------------------
+ *  Function to allocate 'size' bytes of disk space for the file open on
+ *  'fd', so that later writes land in contiguous extents. If 'keep_size'
+ *  is true, then the file size is not changed, which requires the Linux
+ *  fallocate() call. Otherwise the file is extended to 'size' bytes.
+ *  On success returns zero, else returns errno, which is EOPNOTSUPP if
+ *  the system or filesystem cannot preallocate space.
+ *------------------------------------------------*/
+int preallocate_fd(int fd, long long size, bool keep_size)
+{
+   if (size <= 0) return 0;
+   if (keep_size) {
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+      if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)size)) return errno;
+      return 0;
+#else
+      return EOPNOTSUPP;
+#endif
+   }
+#if defined(HAVE_FALLOCATE)
+   if (fallocate(fd, 0, 0, (off_t)size) == 0) return 0;
+   if (errno != EOPNOTSUPP) return errno;
+#endif
+#if defined(HAVE_POSIX_FALLOCATE)
+   /* posix_fallocate() returns the error rather than setting errno */
+   return posix_fallocate(fd, 0, (off_t)size);
+#else
+   return EOPNOTSUPP;
+#endif
+}
+
+
+/*-------------------------------------------------
+ *  Function to sleep as long as needed to keep the average rate of a copy
+ *  that began at 'start' and has copied 'done' bytes at or below 'rate'
+ *  bytes per second.
+ *------------------------------------------------*/
+static void copy_throttle(struct timeval *start, long long done, long long rate)
+{
+   long long ahead_us;
+   struct timeval now;
+#ifdef HAVE_NANOSLEEP
+   struct timespec ts;
+#endif
+
+   gettimeofday(&now, NULL);
+   ahead_us = done * 1000000 / rate - timeval_et(start, &now);
+   if (ahead_us <= 0) return;
+#ifdef HAVE_NANOSLEEP
+   ts.tv_sec = (time_t)(ahead_us / 1000000);
+   ts.tv_nsec = (long)(ahead_us % 1000000) * 1000;
+   nanosleep(&ts, NULL);
+#else
+   sleep((unsigned int)((ahead_us + 999999) / 1000000));
+#endif
+}
+
+
+/*-------------------------------------------------
+ *  Function to copy 'size' bytes from open file 'from_fd' to open file
+ *  'to_fd', avoiding copying the data through user space where possible.
+ *  A reflink sharing the source's extents is tried first, then the kernel
+ *  copies with copy_file_range() or sendfile(), and only if those are not
+ *  supported is the data read and written through a buffer. If 'rate' is
+ *  greater than zero, the copy is limited to 'rate' bytes per second.
  *  On success returns zero, else returns errno
  *------------------------------------------------*/
-int file_copy(const char *to_path, const char *from_path)
+static int copy_fd(int to_fd, int from_fd, long long size, long long rate)
 {
-   int rc;
-   size_t n;
-   FILE *to, *from;
+   ssize_t n = 0, w;
+   long long done = 0, chunk = COPY_CHUNK_SIZE;
+   size_t pos;
    char *buf;
-   size_t buf_sz = 1024 * 1024;
+   int rc;
+   struct timeval start;
 
-   if (access(to_path, F_OK) == 0) return EEXIST;
-   from = fopen(from_path, "r");
-   if (!from) return errno;
-   to = fopen(to_path, "w");
-   if (!to) {
-      rc = errno;
-      fclose(from);
-      return rc;
+#if defined(HAVE_SYS_IOCTL_H) && defined(FICLONE)
+   /* A reflink copies no data, so is never limited */
+   if (ioctl(to_fd, FICLONE, from_fd) == 0) return 0;
+#endif
+   if (rate > 0) {
+      /* Copy in pieces of a quarter second or so */
+      chunk = rate / 4;
+      if (chunk < COPY_BUF_SIZE) chunk = COPY_BUF_SIZE;
+      if (chunk > COPY_CHUNK_SIZE) chunk = COPY_CHUNK_SIZE;
+      gettimeofday(&start, NULL);
    }
-   buf = (char*)malloc(buf_sz);
-   while ((n = fread(buf, 1, buf_sz, from)) > 0) {
-      if (fwrite(buf, 1 , n, to) != n) {
-         rc = ferror(to);
-         fclose(to);
-         unlink(to_path);
-         fclose(from);
-         free(buf);
-         return rc;
+#ifdef HAVE_COPY_FILE_RANGE
+   while (done < size) {
+      n = copy_file_range(from_fd, NULL, to_fd, NULL, (size_t)(size - done < chunk ? size - done : chunk), 0);
+      if (n <= 0) break;
+      done += n;
+      if (rate > 0) copy_throttle(&start, done, rate);
+   }
+   if (done >= size || n == 0) return 0;
+   /* Not supported between these files, so continue from where it stopped */
+   if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) return errno;
+#endif
+#ifdef HAVE_SENDFILE
+   while (done < size) {
+      n = sendfile(to_fd, from_fd, NULL, (size_t)(size - done < chunk ? size - done : chunk));
+      if (n <= 0) break;
+      done += n;
+      if (rate > 0) copy_throttle(&start, done, rate);
+   }
+   if (done >= size || n == 0) return 0;
+   if (errno != EINVAL && errno != ENOSYS) return errno;
+#endif
+   buf = (char*)malloc(COPY_BUF_SIZE);
+   if (!buf) return ENOMEM;
+   while ((n = read(from_fd, buf, COPY_BUF_SIZE)) > 0) {
+      for (pos = 0; pos < (size_t)n; pos += w) {
+         w = write(to_fd, buf + pos, n - pos);
+         if (w < 0) {
+            rc = errno;
+            free(buf);
+            return rc;
+         }
       }
+      done += n;
+      if (rate > 0) copy_throttle(&start, done, rate);
    }
+   rc = n < 0 ? errno : 0;
    free(buf);
-   fclose(to);
-   if (!feof(from)) {
-      rc = ferror(from);
+   return rc;
+}
+
+
+/*-------------------------------------------------
+ *  Function to copy file 'from_path' to new file 'to_path'. The new file
+ *  is created exclusively with the permissions, modification time and,
+ *  when running as root, the owner of the original, and is flushed to disk
+ *  before returning. If 'rate' is greater than zero, the data is copied at
+ *  no more than 'rate' bytes per second.
+ *  On success returns zero, else returns errno
+ *------------------------------------------------*/
+int file_copy(const char *to_path, const char *from_path, long long rate)
+{
+   int rc, to, from;
+   struct stat st;
+
+   from = open(from_path, O_RDONLY | O_BINARY | O_CLOEXEC);
+   if (from < 0) return errno;
+   if (fstat(from, &st)) {
+      rc = errno;
+      close(from);
+      return rc;
+   }
+   to = open(to_path, O_WRONLY | O_CREAT | O_EXCL | O_BINARY | O_CLOEXEC, st.st_mode & 0777);
+   if (to < 0) {
+      rc = errno;
+      close(from);
+      return rc;
+   }
+   rc = copy_fd(to, from, (long long)st.st_size, rate);
+#ifdef HAVE_FCHOWN
+   /* Only root may give the copy away, and the owner may already match */
+   if (!rc && geteuid() == 0 && fchown(to, st.st_uid, st.st_gid)) rc = errno;
+#endif
+#ifdef HAVE_FUTIMENS
+   if (!rc) {
+      struct timespec ts[2];
+      ts[0] = st.st_atim;
+      ts[1] = st.st_mtim;
+      if (futimens(to, ts)) rc = errno;
+   }
+#endif
+#ifndef HAVE_WINDOWS_H
+   if (!rc && fsync(to)) rc = errno;
+#endif
+   if (close(to) && !rc) rc = errno;
+   close(from);
+   if (rc) unlink(to_path);
+   return rc;
+}
+
+
+/*-------------------------------------------------
+ *  Function to move file 'from_path' to new file 'to_path'. The file is
+ *  renamed when both paths are on the same filesystem, else it is copied
+ *  at no more than 'rate' bytes per second, if given, and the original is
+ *  removed.
+ *  On success returns zero, else returns errno
+ *------------------------------------------------*/
+int file_move(const char *to_path, const char *from_path, long long rate)
+{
+   int rc;
+
+   if (access(to_path, F_OK) == 0) return EEXIST;
+   if (rename(from_path, to_path) == 0) return 0;
+   if (errno != EXDEV) return errno;
+   rc = file_copy(to_path, from_path, rate);
+   if (rc) return rc;
+   if (unlink(from_path)) {
+      /* Do not leave the file in both places */
+      rc = errno;
       unlink(to_path);
-      fclose(from);
       return rc;
    }
-   fclose(from);
    return 0;
 }
 
@@ -26,8 +26,14 @@
 /* Utility Functions */
 long timeval_et(struct timeval *tv1, struct timeval *tv2);
 int exclusive_fopen(const char *fname, FILE **fs);
-int file_copy(const char *to, const char *from);
+int lock_fd(int fd, long timeout_ms);
+int file_copy(const char *to, const char *from, long long rate = 0);
+int file_move(const char *to, const char *from, long long rate = 0);
 int drop_privs(const char *uname, const char *gname);
+int parse_size(const char *str, long long *size);
+int preallocate_fd(int fd, long long size, bool keep_size);
+int fs_space(const char *path, long long *avail, long long *total);
+bool fs_has_dir_times(const char *path);
 int is_root_user();
 
 #endif /* _UTIL_H_ */
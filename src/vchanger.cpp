@@ -49,18 +49,39 @@
 #ifdef HAVE_SIGNAL_H
 #include <signal.h>
 #endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_LIMITS_H
+#include <limits.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+#include <algorithm>
+#include <map>
 
 #include "util.h"
 #include "compat_defs.h"
 #include "loghandler.h"
+#include "timing.h"
+#include "metrics.h"
+#include "history.h"
 #include "diskchanger.h"
+#include "changerset.h"
 
 DiskChanger changer;
 
 /*-------------------------------------------------
  *  Commands
  * ------------------------------------------------*/
-#define NUM_AUTOCHANGER_COMMANDS 10
+#define NUM_AUTOCHANGER_COMMANDS 13
 #define MAX_AUTOCHANGER_CMD_LEN 16
 
 static char autochanger_command[NUM_AUTOCHANGER_COMMANDS][MAX_AUTOCHANGER_CMD_LEN] = {
@@ -73,7 +94,10 @@ static char autochanger_command[NUM_AUTOCHANGER_COMMANDS][MAX_AUTOCHANGER_CMD_LE
    "transfer",
    "listmags",
    "createvols",
-   "refresh"
+   "refresh",
+   "compact",
+   "stats",
+   "rebalance"
 };
 
 #define CMD_LIST        0
@@ -86,6 +110,12 @@ static char autochanger_command[NUM_AUTOCHANGER_COMMANDS][MAX_AUTOCHANGER_CMD_LE
 #define CMD_LISTMAGS    7
 #define CMD_CREATEVOLS  8
 #define CMD_REFRESH     9
+#define CMD_COMPACT     10
+#define CMD_STATS       11
+#define CMD_REBALANCE   12
+
+/* Number of changers of a set that a command is performed for at once */
+#define DEFAULT_SET_JOBS 4
 
 /*-------------------------------------------------
  *  Command line parameters
@@ -99,6 +129,7 @@ typedef struct _cmdparams_s
    int dest_slot;
    int drive;
    int mag_bay;
+   std::vector<int> mag_bays;
    int count;
    tString label_prefix;
    tString pool;
@@ -106,6 +137,11 @@ typedef struct _cmdparams_s
    tString runas_group;
    tString config_file;
    tString archive_device;
+   tString trace_file;
+   tString magazine;
+   long window;
+   bool no_config_cache;
+   int jobs;
 } CMDPARAMS;
 CMDPARAMS cmdl;
 
@@ -129,13 +165,36 @@ static void print_help(void)
       "    Perform Bacula Autochanger API command for virtual\n"
       "    changer defined by vchanger configuration file\n"
       "    'config_file' using 'slot', 'device', and 'drive'\n"
+      "    'config_file' may instead be the storage resource name of a\n"
+      "    changer defined in %s.\n"
+      "  vchanger [options] config_dir REFRESH|COMPACT|REBALANCE [magazine]\n"
+      "    Perform the command for each changer defined by the *.conf files\n"
+      "    in directory 'config_dir'.\n"
+      "  vchanger [options] config_file TRANSFER slot dest_slot\n"
+      "    Move the volume in 'slot' to the empty slot 'dest_slot'.\n"
       "  vchanger [options] config_file LISTMAGS\n"
       "    vchanger extension to list info on all defined magazines.\n"
       "  vchanger [options] config_file CREATEVOLS mag_ndx count [start] [CREATEVOLS options]\n"
       "    vchanger extension to create 'count' empty volume files on the magazine at\n"
       "    index 'mag_ndx'. If specified, 'start' is the lowest integer to use when\n"
       "    appending integers to the label prefix when generating volume names.\n"
-      "  vchanger [options] config_file REFRESH\n"
+      "    'mag_ndx' may be a comma separated list, such as 0,1,2, to create 'count'\n"
+      "    volume files on each of several magazines in parallel, or 'auto' to\n"
+      "    spread 'count' volume files across the magazines by free space.\n"
+      "  vchanger [options] config_file REFRESH [magazine]\n"
+      "    vchanger extension to rescan all magazines, or only the magazine given\n"
+      "    by its index or by its 'magazine' setting, such as UUID:xxxx, and to\n"
+      "    issue 'update slots' in bconsole for any slots that changed.\n"
+      "  vchanger [options] config_file COMPACT\n"
+      "    vchanger extension to renumber the virtual slots of mounted magazines\n"
+      "    into a dense range beginning at slot 1.\n"
+      "  vchanger [options] config_file REBALANCE\n"
+      "    vchanger extension to move volumes between the mounted magazines so\n"
+      "    that their filesystems have similar fractions of free space.\n"
+      "  vchanger [options] config_file STATS [window]\n"
+      "    vchanger extension to print latency percentiles per command and per\n"
+      "    magazine from the invocation history. If specified, 'window' limits\n"
+      "    the statistics to recent invocations, for example 30m, 12h or 7d.\n"
       "  vchanger --version\n"
       "    print version info\n"
       "  vchanger --help\n"
@@ -143,6 +202,12 @@ static void print_help(void)
       "\nGeneral options:\n"
       "    -u, --user=uid       user to run as (when invoked by root)\n"
       "    -g, --group=gid      group to run as (when invoked by root)\n"
+      "    --trace=file         write trace events for this invocation to 'file'\n"
+      "                         in Chrome trace event format\n"
+      "    --no-config-cache    always parse the configuration file, neither using\n"
+      "                         nor saving the configuration snapshot\n"
+      "    -j, --jobs=n         number of changers to perform the command for at\n"
+      "                         once when given a config_dir (default %d)\n"
       "\nCREATEVOLS command options:\n"
       "    -l, --label=string   string to use as a prefix for determining the\n"
       "                         barcode label of the volume files created. Labels\n"
@@ -153,7 +218,7 @@ static void print_help(void)
       "    --pool=string        Overrides the default pool, defined in the vchanger\n"
       "                         config file, that new volumes should be placed into\n"
       "                         when labeling newly created volumes.\n"
-      "\nReport bugs to %s.\n", PACKAGE_BUGREPORT);
+      "\nReport bugs to %s.\n", DEFAULT_CONFDIR, DEFAULT_SET_JOBS, PACKAGE_BUGREPORT);
 }
 
 /*-------------------------------------------------
@@ -162,11 +227,14 @@ static void print_help(void)
 #define LONGONLYOPT_VERSION   0
 #define LONGONLYOPT_HELP      1
 #define LONGONLYOPT_POOL      2
+#define LONGONLYOPT_TRACE     3
+#define LONGONLYOPT_NO_CONFIG_CACHE 4
 
 static int parse_cmdline(int argc, char *argv[])
 {
    int c, ndx = 0;
    tString tmp;
+   char *p, *endp;
    struct option options[] = {
       { "version", 0, 0, LONGONLYOPT_VERSION },
       { "help", 0, 0, LONGONLYOPT_HELP },
@@ -174,6 +242,9 @@ static int parse_cmdline(int argc, char *argv[])
       { "group", 1, 0, 'g' },
       { "label", 1, 0, 'l' },
       { "pool", 1, 0, LONGONLYOPT_POOL },
+      { "trace", 1, 0, LONGONLYOPT_TRACE },
+      { "no-config-cache", 0, 0, LONGONLYOPT_NO_CONFIG_CACHE },
+      { "jobs", 1, 0, 'j' },
       { 0, 0, 0, 0 }
    };
 
@@ -184,6 +255,7 @@ static int parse_cmdline(int argc, char *argv[])
    cmdl.dest_slot = 0;
    cmdl.drive = 0;
    cmdl.mag_bay = 0;
+   cmdl.mag_bays.clear();
    cmdl.count = 0;
    cmdl.label_prefix.clear();
    cmdl.pool.clear();
@@ -191,9 +263,14 @@ static int parse_cmdline(int argc, char *argv[])
    cmdl.runas_group.clear();
    cmdl.config_file.clear();
    cmdl.archive_device.clear();
+   cmdl.trace_file.clear();
+   cmdl.magazine.clear();
+   cmdl.window = 0;
+   cmdl.no_config_cache = false;
+   cmdl.jobs = DEFAULT_SET_JOBS;
    /* process the command line */
    for (;;) {
-      c = getopt_long(argc ,argv, "u:g:l:", options, NULL);
+      c = getopt_long(argc ,argv, "u:g:l:j:", options, NULL);
       if (c == -1) break;
       switch (c) {
       case LONGONLYOPT_VERSION:
@@ -213,9 +290,22 @@ static int parse_cmdline(int argc, char *argv[])
       case 'l':
          cmdl.label_prefix = optarg;
          break;
+      case 'j':
+         cmdl.jobs = (int)strtol(optarg, &endp, 10);
+         if (endp == optarg || *endp || cmdl.jobs < 1 || cmdl.jobs > 64) {
+            fprintf(stderr, "flag -j must specify a value between 1 and 64 inclusive\n");
+            return -1;
+         }
+         break;
       case LONGONLYOPT_POOL:
          cmdl.pool = optarg;
          break;
+      case LONGONLYOPT_TRACE:
+         cmdl.trace_file = optarg;
+         break;
+      case LONGONLYOPT_NO_CONFIG_CACHE:
+         cmdl.no_config_cache = true;
+         break;
       default:
          fprintf(stderr, "unknown option %s\n", optarg);
          return -1;
@@ -265,6 +355,9 @@ static int parse_cmdline(int argc, char *argv[])
       case CMD_SLOTS:
       case CMD_LISTMAGS:
       case CMD_REFRESH:
+      case CMD_COMPACT:
+      case CMD_REBALANCE:
+      case CMD_STATS:
          return 0;   /* OK, because these commands only need 2 parameters */
       case CMD_CREATEVOLS:
          fprintf(stderr, "missing parameter 3 (magazine index)\n");
@@ -281,15 +374,68 @@ static int parse_cmdline(int argc, char *argv[])
    case CMD_LISTALL:
    case CMD_SLOTS:
    case CMD_LISTMAGS:
-   case CMD_REFRESH:
+   case CMD_COMPACT:
+   case CMD_REBALANCE:
       return 0;  /* These commands only need 2 params, so ignore extraneous */
-   case CMD_CREATEVOLS:
-      /* Param 3 for CREATEVOLS command is magazine index */
-      cmdl.mag_bay = (int)strtol(argv[ndx], NULL, 10);
-      if (cmdl.mag_bay < 0) {
-         fprintf(stderr, "invalid magazine index in parameter 3\n");
+   case CMD_REFRESH:
+      /* Param 3 for REFRESH command is the optional magazine to rescan */
+      cmdl.magazine = argv[ndx];
+      return 0;
+   case CMD_STATS:
+      /* Param 3 for STATS command is the window, a number of seconds
+       * optionally followed by a single unit of m, h, d or w */
+      {
+         char *end;
+         long unit = 0;
+         errno = 0;
+         cmdl.window = strtol(argv[ndx], &end, 10);
+         if (end != argv[ndx] && !errno && (end[0] == 0 || end[1] == 0)) {
+            switch (tolower(*end)) {
+            case 0:
+            case 's':
+               unit = 1;
+               break;
+            case 'm':
+               unit = 60;
+               break;
+            case 'h':
+               unit = 3600;
+               break;
+            case 'd':
+               unit = 86400;
+               break;
+            case 'w':
+               unit = 604800;
+               break;
+            }
+         }
+         if (unit == 0 || cmdl.window > LONG_MAX / unit) cmdl.window = -1;
+         else cmdl.window *= unit;
+      }
+      if (cmdl.window <= 0) {
+         fprintf(stderr, "invalid window in parameter 3\n");
          return -1;
       }
+      return 0;
+   case CMD_CREATEVOLS:
+      /* Param 3 for CREATEVOLS command is a comma separated list of magazine
+       * indexes, or 'auto' to choose magazines by their free space */
+      if (tCaseCmp(argv[ndx], "auto") == 0) {
+         cmdl.mag_bay = -1;
+         break;
+      }
+      p = argv[ndx];
+      do {
+         cmdl.mag_bay = (int)strtol(p, &endp, 10);
+         if (endp == p || (*endp && *endp != ',') || cmdl.mag_bay < 0
+               || std::find(cmdl.mag_bays.begin(), cmdl.mag_bays.end(), cmdl.mag_bay) != cmdl.mag_bays.end()) {
+            fprintf(stderr, "invalid magazine index in parameter 3\n");
+            return -1;
+         }
+         cmdl.mag_bays.push_back(cmdl.mag_bay);
+         p = endp + 1;
+      } while (*endp);
+      cmdl.mag_bay = cmdl.mag_bays[0];
       break;
    case CMD_LOADED:
       /* slot is ignored for LOADED command, so just set to 1 */
@@ -395,16 +541,18 @@ static int parse_cmdline(int argc, char *argv[])
  *------------------------------------------------*/
 static int do_list_cmd()
 {
-   int slot, num_slots = changer.NumSlots();
+   int rc;
+   OutputBuffer out;
 
    /* Print all slot numbers, adding volume labels for non-empty slots */
-   for (slot = 1; slot <= num_slots; slot++) {
-      if (changer.SlotEmpty(slot)) {
-         fprintf(stdout, "%d:\n", slot);
-      } else {
-         fprintf(stdout, "%d:%s\n", slot, changer.GetVolumeLabel(slot));
-      }
+   changer.FormatList(out);
+   fflush(stdout);
+   rc = out.Write(fileno(stdout));
+   if (rc) {
+      log.Error("  ERROR writing list to stdout (errno=%d)", rc);
+      return 1;
    }
+   changer.WriteOutputCache(autochanger_command[CMD_LIST], out);
    log.Info("  SUCCESS sent list to stdout");
    return 0;
 }
@@ -487,42 +635,35 @@ static int do_loaded_cmd()
  *------------------------------------------------*/
 static int do_list_all()
 {
-   int n, s, num_slots = changer.NumSlots();
+   int rc;
+   OutputBuffer out;
 
-   /* Print drive state info */
-   for (n = 0; n < changer.NumDrives(); n++) {
-      if (changer.DriveEmpty(n)) {
-         fprintf(stdout, "D:%d:E\n", n);
-      } else {
-         s = changer.GetDriveSlot(n);
-         fprintf(stdout, "D:%d:F:%d:%s\n", n, s,
-               changer.GetVolumeLabel(s));
-      }
-   }
-   /* Print slot state info */
-   for (n = 1; n <= num_slots; n++) {
-      if (changer.SlotEmpty(n)) {
-         fprintf(stdout, "S:%d:E\n", n);
-      } else {
-         if (changer.GetSlotDrive(n) < 0)
-            fprintf(stdout, "S:%d:F:%s\n", n, changer.GetVolumeLabel(n));
-         else
-            fprintf(stdout, "S:%d:E\n", n);
-      }
+   /* Print drive state info followed by slot state info */
+   changer.FormatListAll(out);
+   fflush(stdout);
+   rc = out.Write(fileno(stdout));
+   if (rc) {
+      log.Error("  ERROR writing listall to stdout (errno=%d)", rc);
+      return 1;
    }
+   changer.WriteOutputCache(autochanger_command[CMD_LISTALL], out);
    log.Info("  SUCCESS sent listall to stdout");
    return 0;
 }
 
 /*-------------------------------------------------
  *   Transfer Command
- * Transfer is not supported by vchanger.
+ * Moves the volume file mapped to a virtual slot to an empty virtual slot
  *------------------------------------------------*/
 static int do_transfer_cmd()
 {
-   fprintf(stderr, "transfer not supported\n");
-   log.Error("  ERROR");
-   return -1;
+   if (changer.TransferVolume(cmdl.slot, cmdl.dest_slot)) {
+      fprintf(stderr, "%s\n", changer.GetErrorMsg());
+      log.Error("  ERROR transferring slot %d to slot %d", cmdl.slot, cmdl.dest_slot);
+      return 1;
+   }
+   log.Info("  SUCCESS transferring slot %d to slot %d", cmdl.slot, cmdl.dest_slot);
+   return 0;
 }
 
 /*-------------------------------------------------
@@ -532,43 +673,626 @@ static int do_transfer_cmd()
  *------------------------------------------------*/
 static int do_list_magazines()
 {
-   int n;
+   int rc;
+   OutputBuffer out, listing;
 
    if (changer.NumMagazines() == 0) {
       fprintf(stdout, "No magazines are defined\n");
       log.Info("  SUCCESS no magazines are defined");
       return 0;
    }
-   for (n = 0; n < changer.NumMagazines(); n++) {
-      if (changer.MagazineEmpty(n)) {
-         fprintf(stdout, "%d:::\n", n);
-      } else {
-         fprintf(stdout, "%d:%d:%d:%s\n", n, changer.GetMagazineSlots(n),
-               changer.GetMagazineStartSlot(n), changer.GetMagazineMountpoint(n));
-      }
+   changer.FormatListMags(out);
+   DiskChanger::AddListMagsSpace(out, listing);
+   fflush(stdout);
+   rc = listing.Write(fileno(stdout));
+   if (rc) {
+      log.Error("  ERROR writing magazine info to stdout (errno=%d)", rc);
+      return 1;
    }
+   changer.WriteOutputCache(autochanger_command[CMD_LISTMAGS], out);
    log.Info("  SUCCESS listing magazine info to stdout");
    return 0;
 }
 
+/*-------------------------------------------------
+ *   Cached LIST, LISTALL and LISTMAGS Commands
+ * Prints the output of the command cached in the work directory if it is
+ * still valid for the current state of the changer. This avoids locking
+ * the changer and scanning the magazines.
+ * Returns zero if cached output was sent, negative if there is no valid
+ * cached output, or positive on error.
+ *------------------------------------------------*/
+static int do_cached_list()
+{
+   int rc;
+   OutputBuffer out, listing;
+
+   if (changer.ReadOutputCache(autochanger_command[cmdl.command], out)) return -1;
+   log.Debug("==== sending cached %s output pid=%d", autochanger_command[cmdl.command], getpid());
+   if (cmdl.command == CMD_LISTMAGS) {
+      /* Filesystem space is not cached */
+      DiskChanger::AddListMagsSpace(out, listing);
+      out.clear();
+      out.Append(listing.data(), listing.size());
+   }
+   fflush(stdout);
+   rc = out.Write(fileno(stdout));
+   if (rc) {
+      log.Error("  ERROR writing %s to stdout (errno=%d)", autochanger_command[cmdl.command], rc);
+      return 1;
+   }
+   log.Info("  SUCCESS sent cached %s to stdout (generation %ld)", autochanger_command[cmdl.command],
+         changer.GetGeneration());
+   return 0;
+}
+
 /*-------------------------------------------------
  *   CREATEVOLS (Create Volumes) Command
  * Creates volume files on the specified magazine
  *------------------------------------------------*/
 static int do_create_vols()
 {
+   std::vector<int> counts;
+   bool placed = cmdl.mag_bays.empty();
+
+   if (placed) {
+      /* Distribute the volumes by the free space of the mounted magazines */
+      if (changer.PlaceVolumes(cmdl.count, cmdl.mag_bays, counts)) {
+         fprintf(stderr, "%s\n", changer.GetErrorMsg());
+         log.Error("  ERROR");
+         return -1;
+      }
+   } else {
+      counts.assign(cmdl.mag_bays.size(), cmdl.count);
+   }
    /* Create new volume files on magazine */
-   if (changer.CreateVolumes(cmdl.mag_bay, cmdl.count, cmdl.slot, cmdl.label_prefix.c_str())) {
+   if (changer.CreateVolumes(cmdl.mag_bays, counts, cmdl.slot, cmdl.label_prefix.c_str())) {
       fprintf(stderr, "%s\n", changer.GetErrorMsg());
       log.Error("  ERROR");
       return -1;
    }
-   fprintf(stdout, "Created %d volume files on magazine %d\n",
-           cmdl.count, cmdl.mag_bay);
+   if (placed) {
+      fprintf(stdout, "Created %d volume files on %d magazines\n",
+              cmdl.count, (int)cmdl.mag_bays.size());
+   } else if (cmdl.mag_bays.size() > 1) {
+      fprintf(stdout, "Created %d volume files on each of %d magazines\n",
+              cmdl.count, (int)cmdl.mag_bays.size());
+   } else {
+      fprintf(stdout, "Created %d volume files on magazine %d\n",
+              cmdl.count, cmdl.mag_bays[0]);
+   }
    log.Info("  SUCCESS");
    return 0;
 }
 
+/*-------------------------------------------------
+ *   COMPACT Command
+ * Renumbers the virtual slots of mounted magazines into a dense layout
+ *------------------------------------------------*/
+static int do_compact_cmd()
+{
+   int moved = changer.CompactSlots();
+   if (moved < 0) {
+      fprintf(stderr, "%s\n", changer.GetErrorMsg());
+      log.Error("  ERROR");
+      return -1;
+   }
+   fprintf(stdout, "Moved %d magazines, %d slots\n", moved, changer.NumSlots());
+   log.Info("  SUCCESS");
+   return 0;
+}
+
+/*-------------------------------------------------
+ *   REBALANCE Command
+ * Moves volumes between magazines to even out their free space. The moves
+ * are planned with the changer locked, the volumes are copied to staging
+ * directories with the changer unlocked so that the storage daemon can go
+ * on using it, and the moves are completed with the changer locked again.
+ *------------------------------------------------*/
+static int do_rebalance_cmd()
+{
+   size_t n;
+   long long bytes = 0;
+   VolumeMoveArray moves;
+   int moved, failed = -1;
+
+   moved = changer.PlanRebalance(moves);
+   if (moved > 0) {
+      changer.Unlock();
+      changer.StageRebalance(moves);
+      if (changer.Initialize()) {
+         changer.DiscardStagedMoves(moves);
+         moved = -1;
+      } else moved = changer.CommitStagedMoves(moves);
+   } else if (moved == 0) {
+      log.Info("magazines are balanced, no volumes to move");
+   }
+   if (moved < 0) {
+      fprintf(stderr, "%s\n", changer.GetErrorMsg());
+      log.Error("  ERROR");
+      return -1;
+   }
+   for (n = 0; n < moves.size(); n++) {
+      if (moves[n].rc == EBUSY || moves[n].rc == EAGAIN) {
+         fprintf(stdout, "Deferred %s, volume was used while being copied\n", moves[n].label.c_str());
+      } else if (moves[n].rc == ENOENT) {
+         fprintf(stdout, "Skipped %s, volume or magazine is no longer available\n", moves[n].label.c_str());
+      } else if (moves[n].rc) {
+         if (failed < 0) failed = (int)n;
+      } else {
+         fprintf(stdout, "Moved %s from magazine %d to magazine %d\n", moves[n].label.c_str(),
+               moves[n].src_bay, moves[n].dst_bay);
+         bytes += moves[n].size;
+      }
+   }
+   if (failed >= 0) {
+      fprintf(stderr, "error %d moving volume %s from magazine %d to magazine %d\n", moves[failed].rc,
+            moves[failed].label.c_str(), moves[failed].src_bay, moves[failed].dst_bay);
+      log.Error("  ERROR");
+      return -1;
+   }
+   fprintf(stdout, "Moved %d volumes, %lld bytes\n", moved, bytes);
+   log.Info("  SUCCESS");
+   return 0;
+}
+
+/*-------------------------------------------------
+ * Returns the value at percentile 'pct' of the sorted values 'v'
+ *------------------------------------------------*/
+static double percentile(const std::vector<double> &v, double pct)
+{
+   size_t n;
+   if (v.empty()) return 0;
+   n = (size_t)(pct / 100.0 * v.size() + 0.999999);
+   if (n > 0) --n;
+   if (n >= v.size()) n = v.size() - 1;
+   return v[n];
+}
+
+/*-------------------------------------------------
+ * Appends a line of count, percentiles and max in milliseconds of the
+ * microsecond values 'v' to 'out'
+ *------------------------------------------------*/
+static void format_percentiles(tString &out, std::vector<double> &v)
+{
+   tString tmp;
+   std::sort(v.begin(), v.end());
+   tFormat(tmp, " %7d %9.1f %9.1f %9.1f %9.1f", (int)v.size(), percentile(v, 50) / 1000.0,
+         percentile(v, 90) / 1000.0, percentile(v, 99) / 1000.0,
+         v.empty() ? 0 : v.back() / 1000.0);
+   out += tmp;
+}
+
+/*-------------------------------------------------
+ *   STATS Command
+ * Prints the 50th, 90th and 99th percentile and maximum of the duration
+ * and lock wait of each command, and of the scan time of each magazine,
+ * in milliseconds, over the invocations in the history file that finished
+ * within the last 'window' seconds, or over all recorded invocations if
+ * no window was given.
+ *------------------------------------------------*/
+static int do_stats_cmd()
+{
+   int rc, b;
+   size_t n;
+   time_t since = 0;
+   tString path, out, tmp;
+   CommandHistory hist;
+   std::vector<HistoryRecord> recs;
+   std::map<tString, std::vector<double> > dur, lock;
+   std::map<tString, int> errors;
+   std::map<tString, std::vector<double> >::iterator it;
+   std::vector<double> scan[HISTORY_MAX_BAYS];
+
+   tFormat(path, "%s%shistory.dat", conf.work_dir.c_str(), DIR_DELIM);
+   rc = hist.Open(path.c_str(), 0);
+   if (!rc) rc = hist.Read(recs);
+   hist.Close();
+   if (rc) {
+      fprintf(stderr, "errno=%d reading history file %s\n", rc, path.c_str());
+      log.Error("  ERROR reading history file %s (errno=%d)", path.c_str(), rc);
+      return 1;
+   }
+   if (cmdl.window > 0) since = time(NULL) - cmdl.window;
+   for (n = 0; n < recs.size(); n++) {
+      if (recs[n].time < since) continue;
+      recs[n].command[HISTORY_CMD_LEN - 1] = 0;
+      tmp = recs[n].command;
+      dur[tmp].push_back(recs[n].duration_us);
+      if (recs[n].lock_us >= 0) lock[tmp].push_back(recs[n].lock_us);
+      if (recs[n].rc) ++errors[tmp];
+      for (b = 0; b < HISTORY_MAX_BAYS; b++) {
+         if (recs[n].scan_us[b] >= 0) scan[b].push_back(recs[n].scan_us[b]);
+      }
+   }
+   out = "command       errors   count   p50(ms)   p90(ms)   p99(ms)   max(ms)"
+         "   locks   p50(ms)   p90(ms)   p99(ms)   max(ms)\n";
+   for (it = dur.begin(); it != dur.end(); it++) {
+      tFormat(tmp, "%-12s %7d", it->first.c_str(), errors[it->first]);
+      out += tmp;
+      format_percentiles(out, it->second);
+      format_percentiles(out, lock[it->first]);
+      out += "\n";
+   }
+   out += "\nmagazine       scans   p50(ms)   p90(ms)   p99(ms)   max(ms)\n";
+   for (b = 0; b < HISTORY_MAX_BAYS; b++) {
+      if (scan[b].empty()) continue;
+      tFormat(tmp, "%-12d", b);
+      out += tmp;
+      format_percentiles(out, scan[b]);
+      out += "\n";
+   }
+   fprintf(stdout, "%s", out.c_str());
+   log.Info("  SUCCESS sent stats for %d invocations to stdout", (int)recs.size());
+   return 0;
+}
+
+/*-------------------------------------------------
+ * Appends a record of this invocation to the history file in the work
+ * directory, unless the history is disabled
+ *------------------------------------------------*/
+static void record_history(int rc)
+{
+   int err, b;
+   tString path;
+   CommandHistory hist;
+   HistoryRecord rec;
+
+   if (conf.history_size <= 0 || cmdl.command == CMD_STATS) return;
+   memset(&rec, 0, sizeof(rec));
+   rec.time = (int64_t)time(NULL);
+   rec.generation = changer.GetGeneration();
+   rec.duration_us = (int32_t)timing.Elapsed();
+   rec.lock_us = (int32_t)timing.PhaseUsec("lock");
+   rec.rc = rc;
+   for (b = 0; b < HISTORY_MAX_BAYS; b++) {
+      rec.scan_us[b] = (int32_t)timing.PhaseUsec("scan", b);
+   }
+   strncpy(rec.command, autochanger_command[cmdl.command], HISTORY_CMD_LEN - 1);
+   tFormat(path, "%s%shistory.dat", conf.work_dir.c_str(), DIR_DELIM);
+   err = hist.Open(path.c_str(), conf.history_size);
+   if (!err) err = hist.Append(rec);
+   if (err) log.Warning("errno=%d updating history file %s", err, path.c_str());
+}
+
+/* Set when the changer's state has been read, so that its metrics are valid */
+static bool changer_initialized = false;
+
+/*-------------------------------------------------
+ * Updates the metrics file, if configured, with the latency and result of
+ * this invocation and the current state of the changer
+ *------------------------------------------------*/
+static void update_metrics(int rc)
+{
+   int err;
+   long usec;
+   MetricsFile m;
+   tString lbl;
+
+   if (conf.metrics_file.empty()) return;
+   m.Define("vchanger_command_duration_seconds", METRIC_HISTOGRAM,
+         "Wall-clock time of vchanger invocations by command.");
+   m.Define("vchanger_commands_total", METRIC_COUNTER,
+         "vchanger invocations by command and result.");
+   m.Define("vchanger_lock_wait_seconds", METRIC_HISTOGRAM,
+         "Time spent waiting for the changer lock.");
+   m.Define("vchanger_magazine_scan_duration_seconds", METRIC_GAUGE,
+         "Time taken by the last scan of each mounted magazine.");
+   m.Define("vchanger_magazine_volumes", METRIC_GAUGE,
+         "Number of volume files on each mounted magazine.");
+   m.Define("vchanger_magazine_mounted", METRIC_GAUGE,
+         "Whether each magazine bay has a mounted magazine.");
+   m.Define("vchanger_magazines", METRIC_GAUGE,
+         "Number of magazine bays by state.");
+   m.Define("vchanger_slots", METRIC_GAUGE,
+         "Number of virtual slots reported to Bacula.");
+   m.Define("vchanger_bconsole_commands_total", METRIC_COUNTER,
+         "bconsole commands issued by result.");
+   m.Define("vchanger_needs_update", METRIC_GAUGE,
+         "Whether an 'update slots' command is still pending.");
+   m.Define("vchanger_needs_label", METRIC_GAUGE,
+         "Whether a 'label barcodes' command is still pending.");
+   m.Define("vchanger_last_invocation_timestamp_seconds", METRIC_GAUGE,
+         "Time the last vchanger invocation finished.");
+   err = m.Open(conf.metrics_file.c_str());
+   if (err) {
+      log.Warning("errno=%d locking metrics file %s", err, conf.metrics_file.c_str());
+      return;
+   }
+   tFormat(lbl, "changer=\"%s\",command=\"%s\"", conf.storage_name.c_str(),
+         autochanger_command[cmdl.command]);
+   m.Observe("vchanger_command_duration_seconds", lbl.c_str(), timing.Elapsed() / 1000000.0);
+   tFormat(lbl, "changer=\"%s\",command=\"%s\",result=\"%s\"", conf.storage_name.c_str(),
+         autochanger_command[cmdl.command], rc ? "error" : "success");
+   m.Add("vchanger_commands_total", lbl.c_str());
+   tFormat(lbl, "changer=\"%s\"", conf.storage_name.c_str());
+   usec = timing.PhaseUsec("lock");
+   if (usec >= 0) m.Observe("vchanger_lock_wait_seconds", lbl.c_str(), usec / 1000000.0);
+   m.Set("vchanger_last_invocation_timestamp_seconds", lbl.c_str(), (double)time(NULL));
+   if (changer_initialized) changer.ExportMetrics(m);
+   err = m.Commit();
+   if (err) log.Error("errno=%d writing metrics file %s", err, conf.metrics_file.c_str());
+}
+
+/*-------------------------------------------------
+ * Logs the summary of phase timings for this invocation, writes the trace
+ * file if one was requested, updates the metrics file, and returns 'rc'
+ *------------------------------------------------*/
+static int end_invocation(int rc)
+{
+   int err;
+   timing.Summary(autochanger_command[cmdl.command], rc);
+   err = timing.WriteTrace(conf.trace_file.c_str(), autochanger_command[cmdl.command], rc);
+   if (err) log.Error("errno=%d writing trace file %s", err, conf.trace_file.c_str());
+   record_history(rc);
+   update_metrics(rc);
+   return rc;
+}
+
+/*-------------------------------------------------
+ * Creates volumes on the magazines that are running low on unused volumes,
+ * then updates Bacula once for all of them. Runs in the background process
+ * started by start_background(), and returns its exit status.
+ *------------------------------------------------*/
+static int do_precreate()
+{
+   int fd, rc;
+   tString lockfile;
+
+   /* Only one background process at a time creates volumes */
+   tFormat(lockfile, "%s%sprecreate.lock", conf.work_dir.c_str(), DIR_DELIM);
+   fd = open(lockfile.c_str(), O_RDWR | O_CREAT, 0640);
+   if (fd < 0) {
+      log.Error("errno=%d opening %s", errno, lockfile.c_str());
+      return 1;
+   }
+   if (lock_fd(fd, 0)) {
+      close(fd);
+      return 0;
+   }
+   log.Debug("==== preforming background volume creation pid=%d", getpid());
+   changer.SetFullScan(SCAN_CHANGED);
+   if (changer.Initialize()) {
+      log.Error("ERROR! %s", changer.GetErrorMsg());
+      close(fd);
+      return 1;
+   }
+   rc = changer.PrecreateVolumes();
+   changer.Unlock();
+   if (rc > 0) {
+      log.Notice("created %d volumes in the background pid=%d", rc, getpid());
+      /* Bacula is updated while the precreate lock is held, so that the
+       * LOAD commands issued by 'label barcodes' do not start another */
+      if (conf.bconsole.empty()) {
+         log.Error("WARNING! 'update slots' and 'label barcodes' needed in bconsole pid=%d", getpid());
+      } else {
+         changer.UpdateBacula();
+      }
+   }
+   close(fd);
+   return rc < 0 ? 1 : 0;
+}
+
+/*-------------------------------------------------
+ * Migrates the volumes on fast-tier magazines that have been idle for
+ * 'Migrate After' minutes to slow-tier magazines. The volumes are copied
+ * to the slow-tier filesystems without holding the changer lock, so that
+ * LOAD and UNLOAD commands are not delayed, and the slot maps are only
+ * changed afterward, while locked, for volumes that were not loaded or
+ * written in the meantime. Runs in the background process started by
+ * start_background(), and returns its exit status.
+ *------------------------------------------------*/
+static int do_migrate()
+{
+   int fd, n, rc;
+   tString lockfile;
+   VolumeMoveArray moves;
+
+   /* Only one background process at a time migrates volumes */
+   tFormat(lockfile, "%s%smigrate.lock", conf.work_dir.c_str(), DIR_DELIM);
+   fd = open(lockfile.c_str(), O_RDWR | O_CREAT, 0640);
+   if (fd < 0) {
+      log.Error("errno=%d opening %s", errno, lockfile.c_str());
+      return 1;
+   }
+   if (lock_fd(fd, 0)) {
+      close(fd);
+      return 0;
+   }
+   changer.SetFullScan(SCAN_CHANGED);
+   if (changer.Initialize()) {
+      log.Error("ERROR! %s", changer.GetErrorMsg());
+      close(fd);
+      return 1;
+   }
+   rc = changer.PlanMigration(moves);
+   changer.Unlock();
+   if (rc <= 0) {
+      close(fd);
+      return rc < 0 ? 1 : 0;
+   }
+   log.Debug("==== migrating %d volumes in the background pid=%d", rc, getpid());
+   for (n = 0; n < (int)moves.size(); n++) changer.StageVolumeMove(moves[n], conf.rebalance_rate);
+   if (changer.Initialize()) {
+      log.Error("ERROR! %s", changer.GetErrorMsg());
+      changer.DiscardStagedMoves(moves);
+      close(fd);
+      return 1;
+   }
+   rc = changer.CommitStagedMoves(moves);
+   changer.Unlock();
+   if (rc > 0) {
+      log.Notice("migrated %d volumes in the background pid=%d", rc, getpid());
+      if (conf.bconsole.empty()) {
+         log.Error("WARNING! 'update slots' needed in bconsole pid=%d", getpid());
+      } else {
+         changer.UpdateBacula();
+      }
+   }
+   close(fd);
+   return rc < 0 ? 1 : 0;
+}
+
+/*-------------------------------------------------
+ * Starts a detached background process if this command may have used
+ * volumes and a magazine has 'Min Free Volumes' set, or if volumes are
+ * migrated from fast-tier magazines. The process first creates volumes,
+ * then migrates volumes.
+ *------------------------------------------------*/
+static void start_background()
+{
+#ifndef HAVE_WINDOWS_H
+   int fd, rc;
+   pid_t pid;
+
+   if (cmdl.command != CMD_LOAD && cmdl.command != CMD_UNLOAD && cmdl.command != CMD_REFRESH) return;
+   if (!changer.PrecreateConfigured() && !changer.MigrationConfigured()) return;
+   fflush(NULL);
+   pid = fork();
+   if (pid < 0) {
+      log.Error("errno=%d starting background process", errno);
+      return;
+   }
+   if (pid > 0) return;
+   /* Detach from the storage daemon, which reads the command's output
+    * until it is closed */
+   setsid();
+   /* Magazines may be mounted or unmounted while the background work runs */
+   mount_cache.clear();
+   fd = open("/dev/null", O_RDWR);
+   if (fd >= 0) {
+      dup2(fd, STDIN_FILENO);
+      dup2(fd, STDOUT_FILENO);
+      dup2(fd, STDERR_FILENO);
+      if (fd > STDERR_FILENO) close(fd);
+   }
+   rc = changer.PrecreateConfigured() ? do_precreate() : 0;
+   if (changer.MigrationConfigured() && do_migrate()) rc = 1;
+   log.Flush();
+   fflush(NULL);
+   _exit(rc);
+#endif
+}
+
+/*-------------------------------------------------
+ * Function to find the bay of the magazine given by its index or by its
+ * 'magazine' setting in the config file, where UUIDs and paths are matched
+ * ignoring case. Returns the bay, or -1 if no such magazine is defined.
+ *------------------------------------------------*/
+static int find_magazine_bay(const tString &mag)
+{
+   size_t n;
+   char *endp;
+   long bay;
+
+   bay = strtol(mag.c_str(), &endp, 10);
+   if (endp != mag.c_str() && *endp == 0) {
+      if (bay < 0 || bay >= (long)conf.magazine.size()) return -1;
+      return (int)bay;
+   }
+   for (n = 0; n < conf.magazine.size(); n++) {
+      if (tCaseCmp(conf.magazine[n], mag) == 0) return (int)n;
+   }
+   return -1;
+}
+
+/*-------------------------------------------------
+ * Performs the command for each changer defined by the config files in
+ * directory 'dir', in up to cmdl.jobs worker processes at once. When a
+ * magazine is given to REFRESH, only the changers defining it are refreshed.
+ * The mountpoints of the changers' UUID magazines are looked up once and
+ * shared by the workers. Returns -1 in a worker, which then performs the
+ * command for the changer whose config file is in cmdl.config_file, else
+ * returns the exit status of the invocation.
+ *------------------------------------------------*/
+static int run_changer_set(const tString &dir)
+{
+#ifndef HAVE_WINDOWS_H
+   ChangerSet set;
+   std::vector<size_t> todo;
+   size_t n, m, running = 0;
+   int rc, status;
+   pid_t pid;
+
+   if (cmdl.command != CMD_REFRESH && cmdl.command != CMD_COMPACT && cmdl.command != CMD_REBALANCE) {
+      fprintf(stderr, "command %s requires a config file\n", autochanger_command[cmdl.command]);
+      return 1;
+   }
+   rc = set.Load(dir.c_str());
+   if (rc) {
+      fprintf(stderr, "cannot read config directory %s (errno=%d)\n", dir.c_str(), rc);
+      return 1;
+   }
+   for (n = 0; n < set.size(); n++) {
+      if (cmdl.magazine.empty() || set.DefinesMagazine(n, cmdl.magazine)) todo.push_back(n);
+   }
+   if (todo.empty()) {
+      if (cmdl.magazine.empty()) fprintf(stderr, "no changers defined in %s\n", dir.c_str());
+      else fprintf(stderr, "magazine '%s' not defined\n", cmdl.magazine.c_str());
+      return 1;
+   }
+   for (n = 0; n < todo.size(); n++) {
+      const tStringArray &mag = set[todo[n]].magazine;
+      for (m = 0; m < mag.size(); m++) {
+         if (tCaseFind(mag[m], "uuid:") == 0) mount_cache.Prefetch(mag[m].substr(5));
+      }
+   }
+   fflush(NULL);
+   rc = 0;
+   n = 0;
+   while (n < todo.size() || running) {
+      if (n < todo.size() && running < (size_t)cmdl.jobs) {
+         pid = fork();
+         if (pid == 0) {
+            cmdl.config_file = set[todo[n]].config_file;
+            return -1;
+         }
+         if (pid < 0) {
+            fprintf(stderr, "errno=%d starting worker for %s\n", errno, set[todo[n]].config_file.c_str());
+            rc = 1;
+            n = todo.size();
+            continue;
+         }
+         ++running;
+         ++n;
+         continue;
+      }
+      if (wait(&status) < 0) break;
+      --running;
+      if (!WIFEXITED(status) || WEXITSTATUS(status)) rc = 1;
+   }
+   return rc;
+#else
+   fprintf(stderr, "config directories are not supported on this platform\n");
+   return 1;
+#endif
+}
+
+/*-------------------------------------------------
+ * Function to select the changers that the command is performed for. The
+ * config file parameter may instead be a directory of config files, whose
+ * changers are all selected, or the storage resource name of a changer
+ * defined in the default config directory. Returns -1 to perform the command
+ * for the changer whose config file is in cmdl.config_file, else returns the
+ * exit status of the invocation.
+ *------------------------------------------------*/
+static int select_changers()
+{
+   struct stat st;
+   ChangerSet set;
+   int n;
+
+   if (stat(cmdl.config_file.c_str(), &st) == 0) {
+      if (S_ISDIR(st.st_mode)) return run_changer_set(cmdl.config_file);
+      return -1;
+   }
+   if (cmdl.config_file.find(DIR_DELIM_C) != tString::npos) return -1;
+   if (set.Load(DEFAULT_CONFDIR)) return -1;
+   n = set.Find(cmdl.config_file);
+   if (n >= 0) cmdl.config_file = set[n].config_file;
+   return -1;
+}
+
 /* -------------  Main  -------------------------*/
 
 int main(int argc, char *argv[])
@@ -583,6 +1307,7 @@ int main(int argc, char *argv[])
 
    /* Log initially to stderr */
    log.OpenLog(stderr, LOG_ERR);
+   timing.Start();
    /* parse the command line */
    if ((error_code = parse_cmdline(argc, argv)) != 0) {
       print_help();
@@ -598,17 +1323,30 @@ int main(int argc, char *argv[])
       print_help();
       return 0;
    }
-   /* Read vchanger config file */
-   if (!conf.Read(cmdl.config_file)) {
-      return 1;
+   /* Select the changer, or the changers of a set */
+   if ((rc = select_changers()) >= 0) {
+      return rc;
+   }
+   /* Read vchanger config file, unless its values can be loaded from the
+    * snapshot saved when it was last read */
+   PhaseTimer config_timer("config");
+   if (cmdl.no_config_cache || !conf.ReadSnapshot(cmdl.config_file)) {
+      if (!conf.Read(cmdl.config_file)) {
+         return 1;
+      }
    }
+   config_timer.Stop();
    /* User:group from cmdline overrides config file values */
    if (cmdl.runas_user.size()) conf.user = cmdl.runas_user;
    if (cmdl.runas_group.size()) conf.group = cmdl.runas_group;
    /* Pool from cmdline overrides config file */
    if (!cmdl.pool.empty()) conf.def_pool = cmdl.pool;
+   /* Trace file from cmdline overrides config file */
+   if (!cmdl.trace_file.empty()) conf.trace_file = cmdl.trace_file;
    /* If root, try to run as configured user:group */
+   PhaseTimer privs_timer("privs");
    rc = drop_privs(conf.user.c_str(), conf.group.c_str());
+   privs_timer.Stop();
    if (rc) {
       fprintf(stderr, "Error %d attempting to run as user '%s'", rc, conf.user.c_str());
       return 1;
@@ -622,23 +1360,57 @@ int main(int argc, char *argv[])
       }
       log.OpenLog(fs, conf.log_level);
    }
+   timing.SetLogLevel(conf.timing_log_level);
    /* Validate and commit configuration parameters */
    if (!conf.Validate()) {
-      return 1;
+      return end_invocation(1);
    }
+   if (conf.from_snapshot) log.Debug("loaded configuration from snapshot");
+   else if (!cmdl.no_config_cache) conf.WriteSnapshot();
 #ifndef HAVE_WINDOWS_H
    /* Ignore SIGPIPE signals */
    signal(SIGPIPE, SIG_IGN);
 #endif
+   /* Statistics are read from the history file without locking the changer */
+   if (cmdl.command == CMD_STATS) {
+      log.Debug("==== preforming STATS command pid=%d", getpid());
+      PhaseTimer stats_timer("command");
+      rc = do_stats_cmd();
+      stats_timer.Stop();
+      return end_invocation(rc);
+   }
+   /* Send cached output for listing commands if the changer's state has
+    * not changed since it was cached */
+   if (cmdl.command == CMD_LIST || cmdl.command == CMD_LISTALL || cmdl.command == CMD_LISTMAGS) {
+      PhaseTimer cache_timer("cache");
+      rc = do_cached_list();
+      cache_timer.Stop();
+      if (rc >= 0) return end_invocation(rc);
+   }
    /* Initialize changer. A lock file is created to serialize access
     * to the changer. As a result, changer initialization may block
     * for up to 30 seconds, and may fail if a timeout is reached */
+   if (cmdl.command == CMD_REFRESH) {
+      if (cmdl.magazine.empty()) {
+         changer.SetFullScan(SCAN_ALL);
+      } else {
+         rc = find_magazine_bay(cmdl.magazine);
+         if (rc < 0) {
+            fprintf(stderr, "magazine '%s' not defined\n", cmdl.magazine.c_str());
+            log.Error("ERROR! magazine '%s' not defined", cmdl.magazine.c_str());
+            return end_invocation(1);
+         }
+         changer.SetFullScan(rc);
+      }
+   }
    if (changer.Initialize()) {
       fprintf(stderr, "%s\n", changer.GetErrorMsg());
-      return 1;
+      return end_invocation(1);
    }
+   changer_initialized = true;
 
    /* Perform command */
+   PhaseTimer command_timer("command");
    switch (cmdl.command) {
    case CMD_LIST:
       log.Debug("==== preforming LIST command pid=%d", getpid());
@@ -677,15 +1449,28 @@ int main(int argc, char *argv[])
       error_code = do_create_vols();
       break;
    case CMD_REFRESH:
-      log.Debug("==== preforming REFRESH command pid=%d", getpid());
+      if (cmdl.magazine.empty()) {
+         log.Debug("==== preforming REFRESH command pid=%d", getpid());
+      } else {
+         log.Debug("==== preforming REFRESH command for magazine %s pid=%d", cmdl.magazine.c_str(), getpid());
+      }
       error_code = 0;
       log.Info("  SUCCESS pid=%d", getpid());
       break;
+   case CMD_COMPACT:
+      log.Debug("==== preforming COMPACT command pid=%d", getpid());
+      error_code = do_compact_cmd();
+      break;
+   case CMD_REBALANCE:
+      log.Debug("==== preforming REBALANCE command pid=%d", getpid());
+      error_code = do_rebalance_cmd();
+      break;
    }
+   command_timer.Stop();
    changer.Unlock();
 
    /* If there was an error, then exit */
-   if (error_code) return error_code;
+   if (error_code) return end_invocation(error_code);
 
    /* If not updating Bacula, then exit */
    if (conf.bconsole.empty()) {
@@ -694,7 +1479,8 @@ int main(int argc, char *argv[])
          log.Error("WARNING! 'update slots' needed in bconsole pid=%d", getpid());
       if (changer.NeedsLabel())
          log.Error("WARNING! 'label barcodes' needed in bconsole pid=%d", getpid());
-      return 0;
+      start_background();
+      return end_invocation(0);
    }
 
    /* Update Bacula via bconsole */
@@ -708,5 +1494,6 @@ int main(int argc, char *argv[])
       log.Error("WARNING! 'label barcodes' needed in bconsole");
 #endif
 
-   return 0;
+   start_background();
+   return end_invocation(0);
 }
@@ -44,6 +44,15 @@
 #ifdef HAVE_SYS_STAT_H
 #include <sys/stat.h>
 #endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 #ifdef HAVE_WINDOWS_H
 #include "targetver.h"
 #include <windows.h>
@@ -57,6 +66,12 @@
 #define DIR_DELIM_C '/'
 #define MAG_VOLUME_MASK S_IWGRP|S_IRWXO
 #endif
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+#if defined(HAVE_MMAP) && defined(HAVE_MUNMAP) && defined(HAVE_SYS_MMAN_H)
+#define USE_MMAP 1
+#endif
 
 #include "loghandler.h"
 #include "util.h"
@@ -75,6 +90,20 @@ VchangerConfig conf;
 #define VK_WORK_DIR "work dir"
 #define VK_LOGFILE "logfile"
 #define VK_LOG_LEVEL "log level"
+#define VK_TIMING_LOG_LEVEL "timing log level"
+#define VK_TRACE_FILE "trace file"
+#define VK_METRICS_FILE "metrics file"
+#define VK_HISTORY_SIZE "history size"
+#define VK_PREALLOCATE "preallocate"
+#define VK_PREALLOCATE_MODE "preallocate mode"
+#define VK_MIN_FREE_VOLUMES "min free volumes"
+#define VK_MAX_FREE_VOLUMES "max free volumes"
+#define VK_VOLUME_SIZE "volume size"
+#define VK_REBALANCE_JOBS "rebalance jobs"
+#define VK_REBALANCE_BANDWIDTH "rebalance bandwidth"
+#define VK_TIER "tier"
+#define VK_MIGRATE_AFTER "migrate after"
+#define VK_BAY_SECTION "bay"
 #define VK_USER "user"
 #define VK_GROUP "group"
 #define VK_BCONSOLE "bconsole"
@@ -89,13 +118,12 @@ VchangerConfig conf;
 /*--------------------------------------------------
  * Default constructor
  *------------------------------------------------*/
-VchangerConfig::VchangerConfig() : log_level(DEFAULT_LOG_LEVEL)
+VchangerConfig::VchangerConfig() : from_snapshot(false)
 {
 #ifdef HAVE_WINDOWS_H
    char tmp[4096];
    wchar_t wtmp[2048];
 #endif
-   storage_name = DEFAULT_STORAGE_NAME;
    /* Set default Bacula work directory and vchanger config file path */
 #ifdef HAVE_WINDOWS_H
    /* Bacula installs its work directory in the FOLDERID_ProgramData folder, which
@@ -106,26 +134,40 @@ VchangerConfig::VchangerConfig() : log_level(DEFAULT_LOG_LEVEL)
       wcstombs(tmp, wtmp, sizeof(tmp) - 1);
       snprintf(DEFAULT_STATEDIR, sizeof(DEFAULT_STATEDIR), "%s%svchanger", tmp, DIR_DELIM);
       snprintf(DEFAULT_LOGDIR, sizeof(DEFAULT_LOGDIR), "%s%svchanger", tmp, DIR_DELIM);
+      snprintf(DEFAULT_CONFDIR, sizeof(DEFAULT_CONFDIR), "%s%svchanger", tmp, DIR_DELIM);
    }
 #else
    snprintf(DEFAULT_STATEDIR, sizeof(DEFAULT_STATEDIR), "%s/spool/vchanger", LOCALSTATEDIR);
    snprintf(DEFAULT_LOGDIR, sizeof(DEFAULT_LOGDIR), "%s/log/vchanger", LOCALSTATEDIR);
+   snprintf(DEFAULT_CONFDIR, sizeof(DEFAULT_CONFDIR), "%s/vchanger", SYSCONFDIR);
 #endif
-   tFormat(work_dir, "%s%s%s", DEFAULT_STATEDIR, DIR_DELIM, storage_name.c_str());
-   /* Set default logfile path and log level */
-   tFormat(logfile, "%s%s%s.log", DEFAULT_LOGDIR, DIR_DELIM, storage_name.c_str());
-   /* Set default runas user and group */
-   user = DEFAULT_USER;
-   group = DEFAULT_GROUP;
-   /* Set default bconsole binary path */
-   bconsole = DEFAULT_BCONSOLE;
-   /* Set default pool for created volumes */
-   def_pool = DEFAULT_POOL;
+   SetDefaults();
    /* Define config file keywords */
    keyword.AddKeyword(VK_MAGAZINE, INIKEYWORDTYPE_MULTISZ);
    keyword.AddKeyword(VK_WORK_DIR, INIKEYWORDTYPE_SZ);
    keyword.AddKeyword(VK_LOGFILE, INIKEYWORDTYPE_SZ);
    keyword.AddKeyword(VK_LOG_LEVEL, INIKEYWORDTYPE_LONG);
+   keyword.AddKeyword(VK_TIMING_LOG_LEVEL, INIKEYWORDTYPE_LONG);
+   keyword.AddKeyword(VK_TRACE_FILE, INIKEYWORDTYPE_SZ);
+   keyword.AddKeyword(VK_METRICS_FILE, INIKEYWORDTYPE_SZ);
+   keyword.AddKeyword(VK_HISTORY_SIZE, INIKEYWORDTYPE_LONG);
+   keyword.AddKeyword(VK_PREALLOCATE, INIKEYWORDTYPE_SZ);
+   keyword.AddKeyword(VK_PREALLOCATE_MODE, INIKEYWORDTYPE_SZ);
+   keyword.AddKeyword(VK_MIN_FREE_VOLUMES, INIKEYWORDTYPE_LONG);
+   keyword.AddKeyword(VK_MAX_FREE_VOLUMES, INIKEYWORDTYPE_LONG);
+   keyword.AddKeyword(VK_VOLUME_SIZE, INIKEYWORDTYPE_SZ);
+   keyword.AddKeyword(VK_REBALANCE_JOBS, INIKEYWORDTYPE_LONG);
+   keyword.AddKeyword(VK_REBALANCE_BANDWIDTH, INIKEYWORDTYPE_SZ);
+   keyword.AddKeyword(VK_TIER, INIKEYWORDTYPE_SZ);
+   keyword.AddKeyword(VK_MIGRATE_AFTER, INIKEYWORDTYPE_LONG);
+   /* Sections [Bay 0], [Bay 1], ... hold settings for individual magazines */
+   keyword.AddSection(VK_BAY_SECTION, true);
+   keyword.AddSectionKeyword(VK_BAY_SECTION, VK_PREALLOCATE, INIKEYWORDTYPE_SZ);
+   keyword.AddSectionKeyword(VK_BAY_SECTION, VK_PREALLOCATE_MODE, INIKEYWORDTYPE_SZ);
+   keyword.AddSectionKeyword(VK_BAY_SECTION, VK_MIN_FREE_VOLUMES, INIKEYWORDTYPE_LONG);
+   keyword.AddSectionKeyword(VK_BAY_SECTION, VK_MAX_FREE_VOLUMES, INIKEYWORDTYPE_LONG);
+   keyword.AddSectionKeyword(VK_BAY_SECTION, VK_VOLUME_SIZE, INIKEYWORDTYPE_SZ);
+   keyword.AddSectionKeyword(VK_BAY_SECTION, VK_TIER, INIKEYWORDTYPE_SZ);
    keyword.AddKeyword(VK_USER, INIKEYWORDTYPE_SZ);
    keyword.AddKeyword(VK_GROUP, INIKEYWORDTYPE_SZ);
    keyword.AddKeyword(VK_BCONSOLE, INIKEYWORDTYPE_SZ);
@@ -134,34 +176,65 @@ VchangerConfig::VchangerConfig() : log_level(DEFAULT_LOG_LEVEL)
    keyword.AddKeyword(VK_DEF_POOL, INIKEYWORDTYPE_SZ);
 }
 
+/*-------------------------------------------------
+ *  Method to set all config values to their defaults
+ *------------------------------------------------*/
+void VchangerConfig::SetDefaults()
+{
+   storage_name = DEFAULT_STORAGE_NAME;
+   tFormat(work_dir, "%s%s%s", DEFAULT_STATEDIR, DIR_DELIM, storage_name.c_str());
+   /* Set default logfile path and log level */
+   tFormat(logfile, "%s%s%s.log", DEFAULT_LOGDIR, DIR_DELIM, storage_name.c_str());
+   log_level = DEFAULT_LOG_LEVEL;
+   timing_log_level = DEFAULT_TIMING_LOG_LEVEL;
+   trace_file.clear();
+   metrics_file.clear();
+   history_size = DEFAULT_HISTORY_SIZE;
+   rebalance_jobs = DEFAULT_REBALANCE_JOBS;
+   rebalance_rate = 0;
+   migrate_after = DEFAULT_MIGRATE_AFTER;
+   /* Set default runas user and group */
+   user = DEFAULT_USER;
+   group = DEFAULT_GROUP;
+   /* Set default bconsole binary path */
+   bconsole = DEFAULT_BCONSOLE;
+   bconsole_config.clear();
+   /* Set default pool for created volumes */
+   def_pool = DEFAULT_POOL;
+   magazine.clear();
+   mag_opts.clear();
+}
+
 /*-------------------------------------------------
  *  Method to read config file and set config values from keyword
  *  value pairs. On success, returns true. Otherwise returns false.
  *------------------------------------------------*/
 bool VchangerConfig::Read(const char *cfile)
 {
+   MagazineOptions def_opts;
+   tString section, val;
+   struct stat st;
    int rc, n;
-   IniFile tmp_ini = keyword;
 
-   tmp_ini.ClearKeywordValues();
    if (!cfile || !cfile[0]) {
       log.Error("config file not specified");
       return false;
    }
    /* Does config file exist */
-   if (access(cfile, R_OK)) {
+   if (access(cfile, R_OK) || stat(cfile, &st)) {
       log.Error("could not access config file %s", cfile);
       return false;
    }
-   /* Read config file values */
-   rc = tmp_ini.Read(cfile);
+   config_file = cfile;
+   from_snapshot = false;
+   /* Read config file values directly into the keyword table */
+   keyword.ClearKeywordValues();
+   rc = keyword.Read(cfile);
    if (rc) {
       if (rc > 0) log.Error("Parse error in %s at line %d", cfile, rc);
       else log.Error("could not open config file  %s", cfile);
       return false;
    }
-   /* Update keyword values */
-   keyword.Update(tmp_ini);
 
    /* Get bacula-dir.conf storage resource name associated with this changer name */
    if (keyword[VK_STORAGE_NAME].IsSet()) {
@@ -205,6 +278,71 @@ bool VchangerConfig::Read(const char *cfile)
       }
    }
 
+   /* Get level at which phase timings are logged */
+   if (keyword[VK_TIMING_LOG_LEVEL].IsSet()) {
+      timing_log_level = (int)keyword[VK_TIMING_LOG_LEVEL];
+      if (timing_log_level < 0 || timing_log_level > 7) {
+         log.Error("config file keyword '%s' must specify a value between 0 and 7 inclusive", VK_TIMING_LOG_LEVEL);
+         return false;
+      }
+   }
+
+   /* Get path of file to write trace events to */
+   if (keyword[VK_TRACE_FILE].IsSet()) {
+      trace_file = (const char*)keyword[VK_TRACE_FILE];
+      tStrip(trace_file);
+   }
+
+   /* Get path of Prometheus textfile to maintain metrics in. A relative
+    * path is relative to the work directory. */
+   if (keyword[VK_METRICS_FILE].IsSet()) {
+      metrics_file = (const char*)keyword[VK_METRICS_FILE];
+      tStrip(metrics_file);
+      if (!metrics_file.empty() && metrics_file.find(DIR_DELIM) != 0) {
+         metrics_file.insert(0, DIR_DELIM);
+         metrics_file.insert(0, work_dir);
+      }
+   }
+
+   /* Get number of invocations to keep in the history file */
+   if (keyword[VK_HISTORY_SIZE].IsSet()) {
+      history_size = (int)keyword[VK_HISTORY_SIZE];
+      if (history_size < 0 || history_size > 1000000) {
+         log.Error("config file keyword '%s' must specify a value between 0 and 1000000 inclusive", VK_HISTORY_SIZE);
+         return false;
+      }
+   }
+
+   /* Get number of volumes the REBALANCE command moves at once */
+   if (keyword[VK_REBALANCE_JOBS].IsSet()) {
+      rebalance_jobs = (int)keyword[VK_REBALANCE_JOBS];
+      if (rebalance_jobs < 1 || rebalance_jobs > 64) {
+         log.Error("config file keyword '%s' must specify a value between 1 and 64 inclusive", VK_REBALANCE_JOBS);
+         return false;
+      }
+   }
+
+   /* Get total bytes per second the REBALANCE command may copy, or 0 for no limit */
+   if (keyword[VK_REBALANCE_BANDWIDTH].IsSet()) {
+      val = (const char*)keyword[VK_REBALANCE_BANDWIDTH];
+      tStrip(val);
+      if (val.empty()) rebalance_rate = 0;
+      else if (parse_size(val.c_str(), &rebalance_rate)) {
+         log.Error("config file keyword '%s' must specify a size per second, such as 100M", VK_REBALANCE_BANDWIDTH);
+         return false;
+      }
+   }
+
+   /* Get minutes a volume on a fast-tier magazine must be idle before it is
+    * migrated to a slow-tier magazine, or 0 to never migrate */
+   if (keyword[VK_MIGRATE_AFTER].IsSet()) {
+      migrate_after = (int)keyword[VK_MIGRATE_AFTER];
+      if (migrate_after < 0 || migrate_after > 525600) {
+         log.Error("config file keyword '%s' must specify a value between 0 and 525600 inclusive", VK_MIGRATE_AFTER);
+         return false;
+      }
+   }
+
    /* Get user to run as */
    if (keyword[VK_USER].IsSet()) {
       user = (const char*)keyword[VK_USER];
@@ -262,6 +400,94 @@ bool VchangerConfig::Read(const char *cfile)
          return false;
       }
    }
+
+   /* Get magazine settings for all magazines, then for each bay's section */
+   if (!ReadMagazineOptions("", def_opts)) return false;
+   mag_opts.assign(magazine.size(), def_opts);
+   for (n = 0; n < (int)magazine.size(); n++) {
+      tFormat(section, "%s%d/", VK_BAY_SECTION, n);
+      if (!ReadMagazineOptions(section, mag_opts[n])) return false;
+   }
+   /* Keep the values as read, before any command line overrides, so that
+    * they can be saved as a snapshot once they have been validated */
+   EncodeSnapshot(st);
+   return true;
+}
+
+/*-------------------------------------------------
+ *  Protected method to set the values in 'opts' from the magazine keywords
+ *  that are set in 'section', where 'section' is empty for the global
+ *  keywords, else is a section name followed by '/'.
+ *  On success, returns true. Otherwise returns false.
+ *------------------------------------------------*/
+bool VchangerConfig::ReadMagazineOptions(const tString &section, MagazineOptions &opts)
+{
+   tString val, size_kw(section + VK_PREALLOCATE), mode_kw(section + VK_PREALLOCATE_MODE);
+   tString min_kw(section + VK_MIN_FREE_VOLUMES), max_kw(section + VK_MAX_FREE_VOLUMES);
+   tString vsize_kw(section + VK_VOLUME_SIZE), tier_kw(section + VK_TIER);
+
+   if (keyword[size_kw].IsSet()) {
+      val = (const char*)keyword[size_kw];
+      tStrip(val);
+      if (val.empty()) opts.prealloc_size = 0;
+      else if (parse_size(val.c_str(), &opts.prealloc_size)) {
+         log.Error("config file keyword '%s' must specify a size, such as 64G", size_kw.c_str());
+         return false;
+      }
+   }
+   if (keyword[mode_kw].IsSet()) {
+      val = (const char*)keyword[mode_kw];
+      tToLower(tRemoveWS(val));
+      if (val == "keepsize") opts.prealloc_mode = PREALLOC_KEEP_SIZE;
+      else if (val == "full") opts.prealloc_mode = PREALLOC_FULL;
+      else {
+         log.Error("config file keyword '%s' must be 'keep size' or 'full'", mode_kw.c_str());
+         return false;
+      }
+   }
+   /* Volumes are created in the background to keep the number of unused
+    * volumes between the minimum and maximum */
+   if (keyword[min_kw].IsSet()) {
+      opts.min_free = (int)keyword[min_kw];
+      if (opts.min_free < 0 || opts.min_free > 10000) {
+         log.Error("config file keyword '%s' must specify a value between 0 and 10000 inclusive", min_kw.c_str());
+         return false;
+      }
+      if (opts.max_free < opts.min_free) opts.max_free = opts.min_free;
+   }
+   if (keyword[max_kw].IsSet()) {
+      opts.max_free = (int)keyword[max_kw];
+      if (opts.max_free < opts.min_free || opts.max_free > 10000) {
+         log.Error("config file keyword '%s' must specify a value between '%s' and 10000 inclusive",
+               max_kw.c_str(), min_kw.c_str());
+         return false;
+      }
+   }
+   if (keyword[vsize_kw].IsSet()) {
+      val = (const char*)keyword[vsize_kw];
+      tStrip(val);
+      if (val.empty()) opts.volume_size = 0;
+      else if (parse_size(val.c_str(), &opts.volume_size)) {
+         log.Error("config file keyword '%s' must specify a size, such as 64G", vsize_kw.c_str());
+         return false;
+      }
+   }
+   if (keyword[tier_kw].IsSet()) {
+      val = (const char*)keyword[tier_kw];
+      tToLower(tRemoveWS(val));
+      if (val == "slow") opts.tier = TIER_SLOW;
+      else if (val == "fast") opts.tier = TIER_FAST;
+      else {
+         log.Error("config file keyword '%s' must be 'fast' or 'slow'", tier_kw.c_str());
+         return false;
+      }
+   }
+   /* Unused volumes are found by their size, which full preallocation hides */
+   if (opts.min_free > 0 && opts.prealloc_size > 0 && opts.prealloc_mode == PREALLOC_FULL) {
+      log.Error("config file keyword '%s' cannot be used when '%s' is 'full'",
+            min_kw.c_str(), VK_PREALLOCATE_MODE);
+      return false;
+   }
    return true;
 }
 
@@ -307,3 +533,294 @@ bool VchangerConfig::Validate()
 
    return true;
 }
+
+
+/*================================================
+ *  Configuration snapshot
+ *
+ *  Once the values read from a config file have been validated, they are
+ *  saved in binary form to a snapshot file in the default state directory,
+ *  along with the identity and change times of the config file. Later
+ *  invocations load the values from the snapshot instead of parsing the
+ *  config file, for as long as the config file is unchanged.
+ *================================================*/
+
+/* The snapshot file starts with the magic string, the length of the encoded
+ * values that follow, and a checksum of the encoded values */
+#define SNAPSHOT_MAGIC "VCSNAP1"
+#define SNAPSHOT_MAGIC_LEN 8
+#define SNAPSHOT_HEADER_LEN (SNAPSHOT_MAGIC_LEN + 2 * sizeof(long long))
+#define SNAPSHOT_MAX_LEN (64 * 1024 * 1024)
+
+/*-------------------------------------------------
+ *  Function to compute the FNV-1a hash of 'len' bytes at 'p'
+ *------------------------------------------------*/
+static unsigned long snapshot_hash(const char *p, size_t len)
+{
+   size_t n;
+   unsigned long h = 2166136261UL;
+   for (n = 0; n < len; n++) {
+      h ^= (unsigned char)p[n];
+      h = (h * 16777619UL) & 0xffffffffUL;
+   }
+   return h;
+}
+
+/*-------------------------------------------------
+ *  Function to get the path of the snapshot of config file 'cfile'.
+ *  The work directory is itself set in the config file, so snapshots are
+ *  kept in the default state directory and named by a hash of the path.
+ *------------------------------------------------*/
+static void snapshot_path(tString &path, const char *cfile)
+{
+   tFormat(path, "%s%sconfig-%08lx.snap", DEFAULT_STATEDIR, DIR_DELIM,
+         snapshot_hash(cfile, strlen(cfile)));
+}
+
+/*-------------------------------------------------
+ *  Functions to append a number or a length prefixed string to an
+ *  encoded snapshot
+ *------------------------------------------------*/
+static void snapshot_put(tString &buf, long long v)
+{
+   buf.append((const char*)&v, sizeof(v));
+}
+
+static void snapshot_put(tString &buf, const tString &v)
+{
+   snapshot_put(buf, (long long)v.size());
+   buf.append(v);
+}
+
+/*
+ *  Class to decode the values of an encoded snapshot, checking that
+ *  each value lies within the encoded data
+ */
+class SnapshotDecoder
+{
+public:
+   SnapshotDecoder(const char *data, size_t len) : pos(data), end(data + len) {}
+   bool Get(long long &v) {
+      if ((size_t)(end - pos) < sizeof(v)) return false;
+      memcpy(&v, pos, sizeof(v));
+      pos += sizeof(v);
+      return true;
+   }
+   bool Get(int &v) {
+      long long n;
+      if (!Get(n)) return false;
+      v = (int)n;
+      return true;
+   }
+   bool Get(tString &v) {
+      long long n;
+      if (!Get(n) || n < 0 || n > end - pos) return false;
+      v.assign(pos, (size_t)n);
+      pos += n;
+      return true;
+   }
+   inline size_t Remaining() const { return end - pos; }
+protected:
+   const char *pos;
+   const char *end;
+};
+
+/*-------------------------------------------------
+ *  Protected method to encode the config values in 'snapshot', identifying
+ *  the config file by its status 'st'. A config file changed within the
+ *  last second could be changed again without its times changing, so is
+ *  not encoded.
+ *------------------------------------------------*/
+void VchangerConfig::EncodeSnapshot(const struct stat &st)
+{
+   time_t now = time(NULL);
+   size_t n;
+
+   snapshot.clear();
+   if (st.st_mtime >= now - 1 || st.st_ctime >= now - 1) return;
+   snapshot_put(snapshot, tString(PACKAGE_VERSION));
+   snapshot_put(snapshot, config_file);
+   snapshot_put(snapshot, (long long)st.st_dev);
+   snapshot_put(snapshot, (long long)st.st_ino);
+   snapshot_put(snapshot, (long long)st.st_size);
+   snapshot_put(snapshot, (long long)st.st_mtime);
+   snapshot_put(snapshot, (long long)st.st_ctime);
+   snapshot_put(snapshot, work_dir);
+   snapshot_put(snapshot, logfile);
+   snapshot_put(snapshot, (long long)log_level);
+   snapshot_put(snapshot, (long long)timing_log_level);
+   snapshot_put(snapshot, trace_file);
+   snapshot_put(snapshot, metrics_file);
+   snapshot_put(snapshot, (long long)history_size);
+   snapshot_put(snapshot, (long long)rebalance_jobs);
+   snapshot_put(snapshot, rebalance_rate);
+   snapshot_put(snapshot, (long long)migrate_after);
+   snapshot_put(snapshot, user);
+   snapshot_put(snapshot, group);
+   snapshot_put(snapshot, bconsole);
+   snapshot_put(snapshot, bconsole_config);
+   snapshot_put(snapshot, storage_name);
+   snapshot_put(snapshot, def_pool);
+   snapshot_put(snapshot, (long long)magazine.size());
+   for (n = 0; n < magazine.size(); n++) {
+      snapshot_put(snapshot, magazine[n]);
+      snapshot_put(snapshot, mag_opts[n].prealloc_size);
+      snapshot_put(snapshot, (long long)mag_opts[n].prealloc_mode);
+      snapshot_put(snapshot, (long long)mag_opts[n].min_free);
+      snapshot_put(snapshot, (long long)mag_opts[n].max_free);
+      snapshot_put(snapshot, mag_opts[n].volume_size);
+      snapshot_put(snapshot, (long long)mag_opts[n].tier);
+   }
+}
+
+/*-------------------------------------------------
+ *  Protected method to decode the config values from the 'len' bytes of
+ *  encoded snapshot at 'data'. Returns false without changing any values
+ *  if the snapshot was made by a different version of vchanger or from a
+ *  different or since changed config file.
+ *------------------------------------------------*/
+bool VchangerConfig::DecodeSnapshot(const char *data, size_t len, const struct stat &st)
+{
+   SnapshotDecoder dec(data, len);
+   tString version, path;
+   long long dev, ino, size, mtime, ctime, count, n;
+
+   if (!dec.Get(version) || version != PACKAGE_VERSION) return false;
+   if (!dec.Get(path) || path != config_file) return false;
+   if (!dec.Get(dev) || !dec.Get(ino) || !dec.Get(size) || !dec.Get(mtime) || !dec.Get(ctime))
+      return false;
+   if (dev != (long long)st.st_dev || ino != (long long)st.st_ino || size != (long long)st.st_size
+         || mtime != (long long)st.st_mtime || ctime != (long long)st.st_ctime)
+      return false;
+   if (dec.Get(work_dir) && dec.Get(logfile) && dec.Get(log_level) && dec.Get(timing_log_level)
+         && dec.Get(trace_file) && dec.Get(metrics_file) && dec.Get(history_size)
+         && dec.Get(rebalance_jobs) && dec.Get(rebalance_rate) && dec.Get(migrate_after)
+         && dec.Get(user) && dec.Get(group) && dec.Get(bconsole) && dec.Get(bconsole_config)
+         && dec.Get(storage_name) && dec.Get(def_pool) && dec.Get(count)
+         && count > 0 && count <= (long long)dec.Remaining()) {
+      magazine.resize((size_t)count);
+      mag_opts.assign((size_t)count, MagazineOptions());
+      for (n = 0; n < count; n++) {
+         if (!dec.Get(magazine[n]) || !dec.Get(mag_opts[n].prealloc_size)
+               || !dec.Get(mag_opts[n].prealloc_mode) || !dec.Get(mag_opts[n].min_free)
+               || !dec.Get(mag_opts[n].max_free) || !dec.Get(mag_opts[n].volume_size)
+               || !dec.Get(mag_opts[n].tier)) break;
+      }
+      if (n == count && dec.Remaining() == 0) return true;
+   }
+   /* Values were partially decoded from a malformed snapshot */
+   SetDefaults();
+   return false;
+}
+
+/*-------------------------------------------------
+ *  Method to load config values from the snapshot of config file 'cfile'.
+ *  Only a snapshot owned by the current user and not writable by others
+ *  is trusted. Returns true if the values were loaded, else returns false
+ *  and the config file must be read.
+ *------------------------------------------------*/
+bool VchangerConfig::ReadSnapshot(const char *cfile)
+{
+   tString path;
+   struct stat st, sst;
+   char *data = NULL;
+   bool mapped = false, ok = false;
+   long long payload_len, checksum;
+   size_t len;
+   int fd;
+
+   if (!cfile || !cfile[0] || access(cfile, R_OK) || stat(cfile, &st)) return false;
+   snapshot_path(path, cfile);
+   fd = open(path.c_str(), O_RDONLY | O_BINARY);
+   if (fd < 0) return false;
+   if (fstat(fd, &sst) || !S_ISREG(sst.st_mode) || sst.st_size < (off_t)SNAPSHOT_HEADER_LEN
+         || sst.st_size > SNAPSHOT_MAX_LEN) {
+      close(fd);
+      return false;
+   }
+#ifndef HAVE_WINDOWS_H
+   if (sst.st_uid != geteuid() || (sst.st_mode & (S_IWGRP | S_IWOTH))) {
+      close(fd);
+      return false;
+   }
+#endif
+   len = (size_t)sst.st_size;
+#ifdef USE_MMAP
+   data = (char*)mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+   if (data == (char*)MAP_FAILED) data = NULL;
+   else mapped = true;
+#endif
+   if (!data) {
+      data = (char*)malloc(len);
+      if (data && read(fd, data, len) != (ssize_t)len) {
+         free(data);
+         data = NULL;
+      }
+   }
+   close(fd);
+   if (!data) return false;
+
+   /* Check header and checksum before decoding the values */
+   memcpy(&payload_len, data + SNAPSHOT_MAGIC_LEN, sizeof(payload_len));
+   memcpy(&checksum, data + SNAPSHOT_MAGIC_LEN + sizeof(payload_len), sizeof(checksum));
+   if (memcmp(data, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) == 0
+         && payload_len == (long long)(len - SNAPSHOT_HEADER_LEN)
+         && checksum == (long long)snapshot_hash(data + SNAPSHOT_HEADER_LEN, (size_t)payload_len)) {
+      config_file = cfile;
+      ok = DecodeSnapshot(data + SNAPSHOT_HEADER_LEN, (size_t)payload_len, st);
+   }
+#ifdef USE_MMAP
+   if (mapped) munmap(data, len);
+   else free(data);
+#else
+   free(data);
+#endif
+   from_snapshot = ok;
+   snapshot.clear();
+   return ok;
+}
+
+/*-------------------------------------------------
+ *  Method to save the values encoded when the config file was read as
+ *  the config file's snapshot. Failure to save the snapshot is not an
+ *  error, as the config file is simply read again on the next invocation.
+ *------------------------------------------------*/
+void VchangerConfig::WriteSnapshot()
+{
+   tString path, tname, header(SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+   mode_t old_mask;
+   FILE *FS;
+   int rc;
+
+   if (snapshot.empty() || config_file.empty()) return;
+   snapshot_path(path, config_file.c_str());
+   tFormat(tname, "%s.%d.tmp", path.c_str(), (int)getpid());
+   snapshot_put(header, (long long)snapshot.size());
+   snapshot_put(header, (long long)snapshot_hash(snapshot.data(), snapshot.size()));
+   old_mask = umask(077);
+   FS = fopen(tname.c_str(), "wb");
+   umask(old_mask);
+   if (!FS) {
+      log.Debug("cannot create config snapshot %s (errno=%d)", tname.c_str(), errno);
+      snapshot.clear();
+      return;
+   }
+   if (fwrite(header.data(), 1, header.size(), FS) != header.size()
+         || fwrite(snapshot.data(), 1, snapshot.size(), FS) != snapshot.size()) {
+      rc = errno;
+      fclose(FS);
+      unlink(tname.c_str());
+      log.Debug("cannot write config snapshot %s (errno=%d)", tname.c_str(), rc);
+      snapshot.clear();
+      return;
+   }
+   if (fclose(FS) || rename(tname.c_str(), path.c_str())) {
+      rc = errno;
+      unlink(tname.c_str());
+      log.Debug("cannot replace config snapshot %s (errno=%d)", path.c_str(), rc);
+      snapshot.clear();
+      return;
+   }
+   log.Info("saved config snapshot %s", path.c_str());
+   snapshot.clear();
+}
@@ -24,15 +24,51 @@
 #ifndef _VCONF_H_
 #define _VCONF_H_ 1
 
+#include <vector>
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
 #include "inifile.h"
 
 #define DEFAULT_LOG_LEVEL 3
+#define DEFAULT_TIMING_LOG_LEVEL 6
+#define DEFAULT_HISTORY_SIZE 4096
+#define DEFAULT_REBALANCE_JOBS 2
+#define DEFAULT_MIGRATE_AFTER 60
 #define DEFAULT_USER "bacula"
 #define DEFAULT_GROUP "tape"
 #define DEFAULT_BCONSOLE "/usr/sbin/bconsole"
 #define DEFAULT_STORAGE_NAME "vchanger"
 #define DEFAULT_POOL "Scratch"
 
+/* Volume preallocation modes */
+#define PREALLOC_KEEP_SIZE 0   /* allocate space without changing the file size */
+#define PREALLOC_FULL 1        /* allocate space and extend the file size */
+
+/* Magazine storage tiers */
+#define TIER_SLOW 0            /* large, slow disks holding volumes long term */
+#define TIER_FAST 1            /* fast disks receiving new volumes */
+
+/* Configuration values specific to one magazine bay */
+
+class MagazineOptions
+{
+public:
+   MagazineOptions() : prealloc_size(0), prealloc_mode(PREALLOC_KEEP_SIZE), min_free(0), max_free(0),
+         volume_size(0), tier(TIER_SLOW) {}
+   inline long long VolumeSize() const { return volume_size ? volume_size : prealloc_size; }
+public:
+   long long prealloc_size;   /* bytes to preallocate for new volumes, or 0 */
+   int prealloc_mode;
+   int min_free;              /* create volumes when fewer are unused, or 0 */
+   int max_free;              /* number of unused volumes to create up to */
+   long long volume_size;     /* expected size of a full volume, or 0 if not known */
+   int tier;
+};
+
 /* Configuration values */
 
 class VchangerConfig
@@ -43,6 +79,13 @@ public:
    tString config_file;
    tString logfile;
    int log_level;
+   int timing_log_level;
+   tString trace_file;
+   tString metrics_file;
+   int history_size;
+   int rebalance_jobs;
+   long long rebalance_rate;
+   int migrate_after;         /* minutes a fast-tier volume is idle before migrating, or 0 */
    tString user;
    tString group;
    tString bconsole;
@@ -50,21 +93,35 @@ public:
    tString storage_name;
    tString def_pool;
    tStringArray magazine;
+   std::vector<MagazineOptions> mag_opts;
+   bool from_snapshot;        /* values were loaded from the configuration snapshot */
 public:
    VchangerConfig();
    virtual ~VchangerConfig() {}
    bool Read(const char *cfile);
    inline bool Read(const tString &cfile) { return Read(cfile.c_str()); }
    bool Validate();
+   bool ReadSnapshot(const char *cfile);
+   inline bool ReadSnapshot(const tString &cfile) { return ReadSnapshot(cfile.c_str()); }
+   void WriteSnapshot();
+protected:
+   void SetDefaults();
+   bool ReadMagazineOptions(const tString &section, MagazineOptions &opts);
+   void EncodeSnapshot(const struct stat &st);
+   bool DecodeSnapshot(const char *data, size_t len, const struct stat &st);
+protected:
+   tString snapshot;          /* encoded values as read from the config file */
 };
 
 #ifndef __VCONF_SOURCE
 extern VchangerConfig conf;
 extern char DEFAULT_LOGDIR[4096];
 extern char DEFAULT_STATEDIR[4096];
+extern char DEFAULT_CONFDIR[4096];
 #else
 char DEFAULT_LOGDIR[4096];
 char DEFAULT_STATEDIR[4096];
+char DEFAULT_CONFDIR[4096];
 #endif
 
 #endif /* _VCONF_H_ */